@@ -8,6 +8,7 @@
 #include <cmath>
 #include <stdlib.h>
 #include <tuple>
+#include <cstring>
 #include "simd.hpp"
 #include "global.hpp"
 #include "timebox.hpp"
@@ -416,6 +417,13 @@ struct BBox4 {
 	}
 	{}
 
+	/**
+	 * @brief Returns the i'th (0-3) of the four bounding boxes.
+	 */
+	BBox get(const int i) const {
+		return BBox(Vec3(bounds[0][i], bounds[2][i], bounds[4][i]), Vec3(bounds[1][i], bounds[3][i], bounds[5][i]));
+	}
+
 	BBox4 operator+(const BBox4& b) const {
 		BBox4 result;
 		for (int i = 0; i < 6; ++i)
@@ -553,6 +561,157 @@ struct BBox4 {
 };
 
 
+/**
+ * @brief Four bounding boxes quantized to 8 bits relative to a parent box.
+ *
+ * Each min is stored as the number of steps up from the parent's min,
+ * and each max as the number of steps down from the parent's max, where
+ * a step is 1/255 of the parent's extent on that axis.  Decoded boxes
+ * always contain the boxes they were encoded from, as long as the
+ * parent contains them, and exceed them by less than one step per side.
+ *
+ * The parent box itself is not stored.  It must be passed to decode()
+ * exactly as it was passed to the constructor.
+ */
+struct QBBox4 {
+	uint8_t bounds[6][4]; // Same order as BBox4
+
+	QBBox4() {}
+
+	/**
+	 * @brief Encodes four boxes relative to a parent box.
+	 *
+	 * Boxes that are empty (min greater than max) stay empty when decoded,
+	 * as long as the parent has a non-zero extent on the empty axes.
+	 */
+	QBBox4(const BBox& parent, const BBox4& b) {
+		const float lo[3] = {parent.min.x, parent.min.y, parent.min.z};
+		const float hi[3] = {parent.max.x, parent.max.y, parent.max.z};
+		encode(lo, hi, b);
+	}
+
+	/**
+	 * @brief Encodes four boxes relative to the i'th box of a BBox4.
+	 */
+	QBBox4(const BBox4& parents, const int i, const BBox4& b) {
+		const float lo[3] = {parents.bounds[0][i], parents.bounds[2][i], parents.bounds[4][i]};
+		const float hi[3] = {parents.bounds[1][i], parents.bounds[3][i], parents.bounds[5][i]};
+		encode(lo, hi, b);
+	}
+
+	/**
+	 * @brief Encodes four boxes relative to a parent box given as its
+	 * per-axis minimum and maximum.
+	 */
+	QBBox4(const float lo[3], const float hi[3], const BBox4& b) {
+		encode(lo, hi, b);
+	}
+
+	/**
+	 * @brief Decodes the four boxes, given the parent box they were
+	 * encoded relative to.
+	 */
+	BBox4 decode(const BBox& parent) const {
+		float lo[3] = {parent.min.x, parent.min.y, parent.min.z};
+		float hi[3] = {parent.max.x, parent.max.y, parent.max.z};
+		return decode(lo, hi);
+	}
+
+	/**
+	 * @brief Decodes the four boxes, given the parent box they were
+	 * encoded relative to as the i'th box of a BBox4.
+	 */
+	BBox4 decode(const BBox4& parents, const int i) const {
+		float lo[3] = {parents.bounds[0][i], parents.bounds[2][i], parents.bounds[4][i]};
+		float hi[3] = {parents.bounds[1][i], parents.bounds[3][i], parents.bounds[5][i]};
+		return decode(lo, hi);
+	}
+
+	/**
+	 * @brief Decodes the four boxes, given the per-axis minimum and
+	 * maximum of the parent box they were encoded relative to.
+	 */
+	BBox4 decode(const float lo[3], const float hi[3]) const {
+		// Widen the quantized values to floats
+		const __m128i zeros = _mm_setzero_si128();
+		const __m128i q_xy = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&bounds[0][0]));
+		const __m128i q_z = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&bounds[4][0]));
+		const __m128i q_x16 = _mm_unpacklo_epi8(q_xy, zeros);
+		const __m128i q_y16 = _mm_unpackhi_epi8(q_xy, zeros);
+		const __m128i q_z16 = _mm_unpacklo_epi8(q_z, zeros);
+		const SIMD::float4 q[6] = {
+			_mm_cvtepi32_ps(_mm_unpacklo_epi16(q_x16, zeros)),
+			_mm_cvtepi32_ps(_mm_unpackhi_epi16(q_x16, zeros)),
+			_mm_cvtepi32_ps(_mm_unpacklo_epi16(q_y16, zeros)),
+			_mm_cvtepi32_ps(_mm_unpackhi_epi16(q_y16, zeros)),
+			_mm_cvtepi32_ps(_mm_unpacklo_epi16(q_z16, zeros)),
+			_mm_cvtepi32_ps(_mm_unpackhi_epi16(q_z16, zeros))
+		};
+
+		BBox4 result;
+		for (int a = 0; a < 3; ++a) {
+			const SIMD::float4 s {step(lo[a], hi[a])};
+			result.bounds[a*2] = SIMD::float4(lo[a]) + (q[a*2] * s);
+			result.bounds[a*2+1] = SIMD::float4(hi[a]) - (q[a*2+1] * s);
+		}
+		return result;
+	}
+
+private:
+	void encode(const float lo_[3], const float hi_[3], const BBox4& b) {
+		using namespace SIMD;
+		for (int a = 0; a < 3; ++a) {
+			const float lo = lo_[a];
+			const float hi = hi_[a];
+			const float s = step(lo, hi);
+
+			// Round towards the outside of the boxes (truncation is
+			// flooring, after clamping), then make sure the decoded
+			// values actually contain the original ones.
+			__m128i q_min = _mm_setzero_si128();
+			__m128i q_max = _mm_setzero_si128();
+			if (s > 0.0f) {
+				const float4 zeros(0.0f);
+				const float4 max_q(255.0f);
+				const float4 inv_s(1.0f / s);
+
+				q_min = _mm_cvttps_epi32(min(max((b.bounds[a*2] - float4(lo)) * inv_s, zeros), max_q).data);
+				while (true) {
+					const float4 qf = _mm_cvtepi32_ps(q_min);
+					const float4 too_big = gt(float4(lo) + (qf * float4(s)), b.bounds[a*2]) && gt(qf, zeros);
+					if (to_bitmask(too_big) == 0)
+						break;
+					q_min = _mm_add_epi32(q_min, _mm_castps_si128(too_big.data)); // Subtracts one
+				}
+
+				q_max = _mm_cvttps_epi32(min(max((float4(hi) - b.bounds[a*2+1]) * inv_s, zeros), max_q).data);
+				while (true) {
+					const float4 qf = _mm_cvtepi32_ps(q_max);
+					const float4 too_small = lt(float4(hi) - (qf * float4(s)), b.bounds[a*2+1]) && gt(qf, zeros);
+					if (to_bitmask(too_small) == 0)
+						break;
+					q_max = _mm_add_epi32(q_max, _mm_castps_si128(too_small.data)); // Subtracts one
+				}
+			}
+
+			// Narrow to bytes
+			const __m128i q_min16 = _mm_packs_epi32(q_min, q_min);
+			const __m128i q_max16 = _mm_packs_epi32(q_max, q_max);
+			const int32_t q_min8 = _mm_cvtsi128_si32(_mm_packus_epi16(q_min16, q_min16));
+			const int32_t q_max8 = _mm_cvtsi128_si32(_mm_packus_epi16(q_max16, q_max16));
+			std::memcpy(bounds[a*2], &q_min8, 4);
+			std::memcpy(bounds[a*2+1], &q_max8, 4);
+		}
+	}
+
+	// The size of a quantization step.  Both encoding and decoding must
+	// compute it exactly the same way.
+	static float step(const float lo, const float hi) {
+		return (hi - lo) * (1.0f / 255.0f);
+	}
+};
+
+
 /**
  * @brief Axis-aligned bounding box with multiple time samples.
  */
@@ -575,7 +734,7 @@ public:
 	/**
 	 * @brief Fetches the BBox at time t.
 	 */
-	BBox at_time(const float t) {
+	BBox at_time(const float t) const {
 		int32_t ia=0, ib=0;
 		float alpha=0.0;
 		bool motion;
@@ -597,11 +756,11 @@ public:
 	}
 
 	BBox &operator[](const int32_t &i) {
-		return bbox.states[i];
+		return bbox[i];
 	}
 
 	const BBox &operator[](const int32_t &i) const {
-		return bbox.states[i];
+		return bbox[i];
 	}
 
 	/**
@@ -652,14 +811,14 @@ public:
 	 * @param[out] hitt0 Near hit is placed here if there is a hit.
 	 * @param[out] hitt1 Far hit is placed here if there is a hit.
 	 */
-	inline bool intersect_ray(const Ray &ray, float *hitt0, float *hitt1) {
+	inline bool intersect_ray(const Ray &ray, float *hitt0, float *hitt1) const {
 		return at_time(ray.time).intersect_ray(ray, hitt0, hitt1);
 	}
 
 	/**
 	 * @brief Intersects a ray with the BBoxT.
 	 */
-	inline bool intersect_ray(const Ray &ray) {
+	inline bool intersect_ray(const Ray &ray) const {
 		float hitt0, hitt1;
 		return at_time(ray.time).intersect_ray(ray, &hitt0, &hitt1);
 	}
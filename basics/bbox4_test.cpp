@@ -73,6 +73,24 @@ BOOST_AUTO_TEST_CASE(constructor_2)
 	BOOST_CHECK(bb.bounds[5][3] == 24.0);
 }
 
+// Test for getting the individual boxes back out
+BOOST_AUTO_TEST_CASE(get_1)
+{
+	BBox4 bb(BBox(Vec3(1.0, 5.0, 9.0),  Vec3(13.0, 17.0, 21.0)),
+	         BBox(Vec3(2.0, 6.0, 10.0), Vec3(14.0, 18.0, 22.0)),
+	         BBox(Vec3(3.0, 7.0, 11.0), Vec3(15.0, 19.0, 23.0)),
+	         BBox(Vec3(4.0, 8.0, 12.0), Vec3(16.0, 20.0, 24.0)));
+
+	const BBox b = bb.get(2);
+
+	BOOST_CHECK(b.min.x == 3.0);
+	BOOST_CHECK(b.min.y == 7.0);
+	BOOST_CHECK(b.min.z == 11.0);
+	BOOST_CHECK(b.max.x == 15.0);
+	BOOST_CHECK(b.max.y == 19.0);
+	BOOST_CHECK(b.max.z == 23.0);
+}
+
 #if 0
 // Test for the add operator
 BOOST_AUTO_TEST_CASE(add)
@@ -337,6 +355,7 @@ BOOST_AUTO_TEST_CASE(intersect_ray_7)
 #endif
 
 #endif
+
 // TODO: - diagonal rays
 //       - rays with different tmax values
 
@@ -0,0 +1,125 @@
+#include "test.hpp"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "vector.hpp"
+#include "bbox.hpp"
+#include "rng.hpp"
+
+
+/*
+ ************************************************************************
+ * Testing suite for QBBox4.
+ ************************************************************************
+ */
+BOOST_AUTO_TEST_SUITE(quantized_bounding_box_4_suite)
+
+
+// Test that boxes matching the parent's bounds decode exactly
+BOOST_AUTO_TEST_CASE(decode_1)
+{
+	const BBox parent(Vec3(-1.5f, 2.0f, 3.0f), Vec3(4.0f, 5.5f, 6.25f));
+	const BBox4 bb(parent, parent, parent, parent);
+
+	const BBox4 bb2 = QBBox4(parent, bb).decode(parent);
+
+	for (int i = 0; i < 4; ++i) {
+		const BBox b = bb2.get(i);
+		BOOST_CHECK_EQUAL(b.min.x, parent.min.x);
+		BOOST_CHECK_EQUAL(b.min.y, parent.min.y);
+		BOOST_CHECK_EQUAL(b.min.z, parent.min.z);
+		BOOST_CHECK_EQUAL(b.max.x, parent.max.x);
+		BOOST_CHECK_EQUAL(b.max.y, parent.max.y);
+		BOOST_CHECK_EQUAL(b.max.z, parent.max.z);
+	}
+}
+
+// Test that decoded boxes contain the originals, and exceed them by
+// less than a quantization step
+BOOST_AUTO_TEST_CASE(decode_2)
+{
+	RNG rng(7);
+	bool contains = true;
+	bool tight = true;
+
+	for (int n = 0; n < 1000; ++n) {
+		const Vec3 p_min(rng.next_float_c() * 100.0f, rng.next_float_c() * 100.0f, rng.next_float_c() * 100.0f);
+		const Vec3 p_ext(rng.next_float() * 50.0f, rng.next_float() * 50.0f, rng.next_float() * 50.0f);
+		const BBox parent(p_min, p_min + p_ext);
+
+		BBox boxes[4];
+		for (int i = 0; i < 4; ++i) {
+			for (int a = 0; a < 3; ++a) {
+				const float f1 = rng.next_float();
+				const float f2 = rng.next_float();
+				boxes[i].min[a] = parent.min[a] + (p_ext[a] * std::min(f1, f2));
+				boxes[i].max[a] = parent.min[a] + (p_ext[a] * std::max(f1, f2));
+			}
+		}
+
+		const BBox4 bb2 = QBBox4(parent, BBox4(boxes[0], boxes[1], boxes[2], boxes[3])).decode(parent);
+
+		for (int i = 0; i < 4; ++i) {
+			const BBox b = bb2.get(i);
+			for (int a = 0; a < 3; ++a) {
+				const float step = p_ext[a] / 255.0f * 1.001f;
+				contains = contains && b.min[a] <= boxes[i].min[a] && b.max[a] >= boxes[i].max[a];
+				tight = tight && (boxes[i].min[a] - b.min[a]) <= step && (b.max[a] - boxes[i].max[a]) <= step;
+			}
+		}
+	}
+
+	BOOST_CHECK(contains);
+	BOOST_CHECK(tight);
+}
+
+// Test that empty boxes stay empty
+BOOST_AUTO_TEST_CASE(decode_3)
+{
+	const BBox parent(Vec3(-1.0f, -1.0f, -1.0f), Vec3(1.0f, 1.0f, 1.0f));
+	const BBox empty;
+	const BBox4 bb(parent, empty, parent, empty);
+
+	const BBox4 bb2 = QBBox4(parent, bb).decode(parent);
+
+	BOOST_CHECK(bb2.get(0).min.x <= bb2.get(0).max.x);
+	BOOST_CHECK(bb2.get(1).min.x > bb2.get(1).max.x);
+	BOOST_CHECK(bb2.get(2).min.x <= bb2.get(2).max.x);
+	BOOST_CHECK(bb2.get(3).min.x > bb2.get(3).max.x);
+}
+
+// Test that encoding relative to a lane of a BBox4 is the same as
+// encoding relative to that lane's box
+BOOST_AUTO_TEST_CASE(encode_1)
+{
+	RNG rng(9);
+	const BBox parents[4] = {
+		BBox(Vec3(0.0f, 0.0f, 0.0f), Vec3(1.0f, 1.0f, 1.0f)),
+		BBox(Vec3(-3.0f, 2.0f, 0.5f), Vec3(-1.0f, 7.0f, 0.75f)),
+		BBox(Vec3(10.0f, -10.0f, 4.0f), Vec3(20.0f, -9.0f, 5.0f)),
+		BBox(Vec3(-0.5f, -0.5f, -0.5f), Vec3(0.5f, 0.5f, 0.5f))
+	};
+	const BBox4 parents4(parents[0], parents[1], parents[2], parents[3]);
+
+	for (int i = 0; i < 4; ++i) {
+		BBox boxes[4];
+		for (int j = 0; j < 4; ++j) {
+			for (int a = 0; a < 3; ++a) {
+				const float f1 = rng.next_float();
+				const float f2 = rng.next_float();
+				const float ext = parents[i].max[a] - parents[i].min[a];
+				boxes[j].min[a] = parents[i].min[a] + (ext * std::min(f1, f2));
+				boxes[j].max[a] = parents[i].min[a] + (ext * std::max(f1, f2));
+			}
+		}
+		const BBox4 bb(boxes[0], boxes[1], boxes[2], boxes[3]);
+
+		const QBBox4 q1(parents[i], bb);
+		const QBBox4 q2(parents4, i, bb);
+		BOOST_CHECK(std::equal(&(q1.bounds[0][0]), &(q1.bounds[0][0]) + 24, &(q2.bounds[0][0])));
+	}
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
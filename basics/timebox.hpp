@@ -5,21 +5,62 @@
 
 #include <iostream>
 #include <stdlib.h>
+#include <algorithm>
+#include <array>
 #include <vector>
 
-template <class T>
+/**
+ * @brief A set of time samples of some state.
+ *
+ * Up to INLINE_CAPACITY states are stored inline in the TimeBox itself,
+ * so creating, copying, and destroying TimeBoxes with few time samples
+ * (by far the common case) never touches the heap.  Larger state counts
+ * spill over into heap storage.
+ */
+template <class T, size_t INLINE_CAPACITY=2>
 class TimeBox
 {
-public:
-	std::vector<T> states;
+	uint8_t count {0};
+	std::array<T, INLINE_CAPACITY> inline_states;
+	std::vector<T> heap_states; // Only used when count > INLINE_CAPACITY
+
+	T *data() {
+		return count <= INLINE_CAPACITY ? inline_states.data() : heap_states.data();
+	}
 
+	const T *data() const {
+		return count <= INLINE_CAPACITY ? inline_states.data() : heap_states.data();
+	}
+
+public:
 	TimeBox() {};
-	TimeBox(uint8_t state_count): states(state_count) {}
+	TimeBox(uint8_t state_count) {
+		init(state_count);
+	}
 	~TimeBox() {};
 
-	// Initializes the timebox with the given number of states
+	// Initializes the timebox with the given number of states.
+	// Like std::vector::resize(), existing states are kept and any
+	// new states are default-constructed.
 	void init(uint8_t state_count) {
-		states.resize(state_count);
+		if (state_count <= INLINE_CAPACITY) {
+			if (count > INLINE_CAPACITY)
+				std::copy(heap_states.begin(), heap_states.begin() + state_count, inline_states.begin());
+			for (size_t i = std::min(count, state_count); i < state_count; ++i)
+				inline_states[i] = T();
+			heap_states.clear();
+		} else {
+			if (count <= INLINE_CAPACITY)
+				heap_states.assign(inline_states.begin(), inline_states.begin() + count);
+			heap_states.resize(state_count);
+		}
+		count = state_count;
+	}
+
+	// Appends a state to the end of the timebox
+	void push_back(const T &state) {
+		init(count + 1);
+		(*this)[count - 1] = state;
 	}
 
 	// Given a time in range [0.0, 1.0], fills in the state indices on
@@ -27,18 +68,18 @@ public:
 	// Returns true on success, false on failure.  Failure typically
 	// means that there is only one state in the TimeBox.
 	bool query_time(const float &time, int32_t *ia, int32_t *ib, float *alpha) const {
-		if (states.size() < 2)
+		if (count < 2)
 			return false;
 
 		if (time < 1.0) {
-			const float temp = time * (states.size() - 1);
+			const float temp = time * (count - 1);
 			const int32_t index = temp;
 			*ia = index;
 			*ib = index + 1;
 			*alpha = temp - (float)(index);
 		} else {
-			*ia = states.size() - 2;
-			*ib = states.size() - 1;
+			*ia = count - 2;
+			*ib = count - 1;
 			*alpha = 1.0;
 		}
 
@@ -47,20 +88,15 @@ public:
 
 	// Allows transparent access to the underlying state data
 	T &operator[](const int32_t &i) {
-		return states[i];
+		return data()[i];
 	}
 
 	const T &operator[](const int32_t &i) const {
-		return states[i];
-	}
-
-	TimeBox &operator=(const TimeBox& tb) {
-		states = tb.states;
-		return *this;
+		return data()[i];
 	}
 
 	size_t size() const {
-		return states.size();
+		return count;
 	}
 };
 
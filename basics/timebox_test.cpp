@@ -0,0 +1,73 @@
+#include "test.hpp"
+
+#include "timebox.hpp"
+
+
+BOOST_AUTO_TEST_SUITE(timebox_suite)
+
+
+BOOST_AUTO_TEST_CASE(push_back)
+{
+	TimeBox<int, 2> tb;
+	for (int i = 0; i < 5; ++i)
+		tb.push_back(i * 10);
+
+	BOOST_CHECK(tb.size() == 5);
+
+	bool test = true;
+	for (int i = 0; i < 5; ++i)
+		test = test && tb[i] == i * 10;
+	BOOST_CHECK(test);
+}
+
+
+// Shrinking from heap storage back into inline storage
+// keeps the leading states
+BOOST_AUTO_TEST_CASE(init_shrink)
+{
+	TimeBox<int, 2> tb(4);
+	for (int i = 0; i < 4; ++i)
+		tb[i] = i + 1;
+
+	tb.init(2);
+
+	BOOST_CHECK(tb.size() == 2);
+	BOOST_CHECK(tb[0] == 1);
+	BOOST_CHECK(tb[1] == 2);
+}
+
+
+// Copies are independent of each other
+BOOST_AUTO_TEST_CASE(copy)
+{
+	TimeBox<int, 2> tb1(3);
+	tb1[0] = 1;
+	tb1[1] = 2;
+	tb1[2] = 3;
+
+	TimeBox<int, 2> tb2 = tb1;
+	tb2[2] = 4;
+
+	BOOST_CHECK(tb2.size() == 3);
+	BOOST_CHECK(tb1[2] == 3);
+	BOOST_CHECK(tb2[2] == 4);
+}
+
+
+BOOST_AUTO_TEST_CASE(query_time)
+{
+	TimeBox<int, 2> tb(3);
+	int32_t ia, ib;
+	float alpha;
+
+	BOOST_CHECK(tb.query_time(0.75f, &ia, &ib, &alpha));
+	BOOST_CHECK(ia == 1);
+	BOOST_CHECK(ib == 2);
+	BOOST_CHECK(alpha == 0.5f);
+
+	TimeBox<int, 2> tb1(1);
+	BOOST_CHECK(!tb1.query_time(0.75f, &ia, &ib, &alpha));
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -346,7 +346,7 @@ size_t BVH::recursive_build(size_t parent, size_t first_prim, size_t last_prim)
 }
 
 
-uint BVH::get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, void *state)
+uint BVH::get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, float *ts, void *state)
 {
 	// Algorithm is the BVH2 algorithm from the paper
 	// "Stackless Multi-BVH Traversal for CPU, MIC and GPU Ray Tracing"
@@ -365,13 +365,22 @@ uint BVH::get_potential_intersections(const Ray &ray, float tmax, uint max_poten
 
 	// Traverse the BVH
 	uint32_t hits_so_far = 0;
+	float node_t = 0.0f; // Entry distance of the current node, when known
+	bool node_t_known = false;
 	float hitt0a, hitt1a;
 	float hitt0b, hitt1b;
 	while (hits_so_far < max_potential) {
 		const Node& n = nodes[node];
 
 		if (n.flags & IS_LEAF) {
-			ids[hits_so_far++] = node;
+			// If we jumped here as a sibling we don't know the entry
+			// distance yet, so test the leaf's own bounds.
+			float tfar;
+			if (node_t_known || (intersect_node(node, ray, d_inv, d_sign, &node_t, &tfar) && node_t < tmax)) {
+				ids[hits_so_far] = node;
+				ts[hits_so_far] = node_t;
+				++hits_so_far;
+			}
 		} else {
 			bool hit0, hit1;
 			hitt0a = hitt1a = hitt0b = hitt1b = std::numeric_limits<float>::infinity();
@@ -380,11 +389,14 @@ uint BVH::get_potential_intersections(const Ray &ray, float tmax, uint max_poten
 
 			if (hit0 || hit1) {
 				bit_stack <<= 1;
+				node_t_known = true;
 				if (hitt0a < hitt0b) {
+					node_t = hitt0a;
 					node = child1(node);
 					if (hit1)
 						bit_stack |= 1;
 				} else {
+					node_t = hitt0b;
 					node = child2(node);
 					if (hit0)
 						bit_stack |= 1;
@@ -408,6 +420,7 @@ uint BVH::get_potential_intersections(const Ray &ray, float tmax, uint max_poten
 		// Go to sibling
 		bit_stack &= ~uint64_t(1);
 		node = sibling(node);
+		node_t_known = false;
 	}
 
 	// Return the number of primitives accumulated
@@ -33,7 +33,7 @@ public:
 	virtual bool finalize();
 	virtual size_t max_primitive_id() const;
 	virtual Primitive &get_primitive(size_t id);
-	virtual uint get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, void *state);
+	virtual uint get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, float *ts, void *state);
 	virtual size_t ray_state_size() {
 		return 16;
 	}
@@ -250,7 +250,7 @@ void BVH2::pack()
 }
 
 
-uint BVH2::get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, void *state)
+uint BVH2::get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, float *ts, void *state)
 {
 	// Algorithm is the BVH2 algorithm from the paper
 	// "Stackless Multi-BVH Traversal for CPU, MIC and GPU Ray Tracing"
@@ -272,12 +272,16 @@ uint BVH2::get_potential_intersections(const Ray &ray, float tmax, uint max_pote
 	const SIMD::float4 ray_o[3] = {ray.o[0], ray.o[1], ray.o[2]};
 	const SIMD::float4 d_inv[3] = {d_inv_f[0], d_inv_f[1], d_inv_f[2]};
 	const SIMD::float4 max_t {
-		ray.max_t
+		std::min(ray.max_t, tmax)
 	};
 
 	// Traverse the BVH
 	uint32_t hits_so_far = 0;
 
+	// Entry distance of the current node.  Nodes we jump to as siblings
+	// get zero, which is conservative.
+	float node_t = 0.0f;
+
 	while (hits_so_far < max_potential) {
 		while (nodes[node].child_index) {
 			// Inner node
@@ -300,16 +304,21 @@ uint BVH2::get_potential_intersections(const Ray &ray, float tmax, uint max_pote
 
 			switch (hit_mask) {
 				case 1:
+					node_t = near_hits[0];
 					node = child1(node);
 					break;
 				case 2:
+					node_t = near_hits[1];
 					node = child2(node);
 					break;
 				case 3:
-					if (near_hits[0] < near_hits[1])
+					if (near_hits[0] < near_hits[1]) {
+						node_t = near_hits[0];
 						node = child1(node);
-					else
+					} else {
+						node_t = near_hits[1];
 						node = child2(node);
+					}
 					bit_stack |= 1;
 					break;
 			}
@@ -317,7 +326,9 @@ uint BVH2::get_potential_intersections(const Ray &ray, float tmax, uint max_pote
 
 		// Leaf node
 		if (!nodes[node].child_index) {
-			ids[hits_so_far++] = node;
+			ids[hits_so_far] = node;
+			ts[hits_so_far] = node_t;
+			++hits_so_far;
 		}
 
 		// If we've completed the full traversal
@@ -335,6 +346,7 @@ uint BVH2::get_potential_intersections(const Ray &ray, float tmax, uint max_pote
 		// Go to sibling
 		bit_stack &= ~uint64_t(1);
 		node = sibling(node);
+		node_t = 0.0f;
 	}
 
 	// Return the number of primitives accumulated
@@ -5,10 +5,24 @@
 #include <memory>
 #include <tuple>
 #include <iterator>
+#include <future>
+#include <thread>
+#include <string>
+#include <unordered_map>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "simd.hpp"
 #include "ray.hpp"
 #include "bvh4.hpp"
+#include "low_level.hpp"
+#include "config.hpp"
 #include <cmath>
+#include <cassert>
+#include <limits>
 
 
 #define IS_LEAF 1<<0
@@ -24,25 +38,149 @@ void BVH4::add_primitives(std::vector<std::unique_ptr<Primitive>>* primitives)
 		prim_bag.push_back(BuildPrimitive(p.get()));
 }
 
+void BVH4::add_primitives(const std::vector<Primitive*> &primitives)
+{
+	for (auto p: primitives)
+		prim_bag.push_back(BuildPrimitive(p));
+}
+
 bool BVH4::finalize()
 {
 	if (prim_bag.size() == 0)
 		return true;
 
-	// Build BVH
-	recursive_build(0, 0, prim_bag.size()-1);
+	// The build shuffles prim_bag, so the order the primitives were
+	// added in is recorded beforehand for the cache and refitting.
+	cached = false;
+	refit = false;
+	const bool refit_enabled = Config::bvh_refit_max_sah_growth > 0.0f;
+	const bool keep = refit_enabled && keeping_topology;
+	std::vector<Primitive*> prims;
+	if ((refit_enabled && refit_source) || keep || !Config::bvh_cache_dir.empty()) {
+		prims.reserve(prim_bag.size());
+		for (const auto &bp: prim_bag)
+			prims.push_back(bp.data);
+	}
+
+	// Try refitting the previous frame's tree first, keeping it only if
+	// its quality hasn't degraded too far from when it was built
+	if (refit_enabled && refit_source && refit_source->primitive_count == prims.size()) {
+		nodes = refit_source->nodes;
+		std::vector<BBox> root_bounds;
+		refit = resolve_indices(prims) && refit_node(0, root_bounds);
+		refit = refit && sah_cost() <= (refit_source->built_sah_cost * Config::bvh_refit_max_sah_growth);
+		if (!refit)
+			std::vector<Node>().swap(nodes);
+	}
+
+	// Then the BVH cache
+	std::string cache_path;
+	uint64_t hash = 0;
+	if (!refit && !Config::bvh_cache_dir.empty()) {
+		hash = content_hash();
+
+		char name[32];
+		snprintf(name, sizeof(name), "bvh4_%016llx.cache", static_cast<unsigned long long>(hash));
+		cache_path = Config::bvh_cache_dir + "/" + name;
+		cached = read_cache(cache_path, hash, prims);
+	}
+
+	if (!refit && !cached) {
+		// Build BVH.  The top levels of the tree are built as parallel
+		// tasks, enough to give every hardware thread a few subtrees.
+		const int thread_count = std::max(1u, std::thread::hardware_concurrency());
+		BuildTree tree;
+		recursive_build(tree, 0, 0, prim_bag.size()-1, intlog2(thread_count) + 2);
+		build_nodes = std::move(tree.nodes);
+		build_bboxes = std::move(tree.bboxes);
 
-	// Pack BVH into more efficient form
-	pack();
+		// Pack BVH into more efficient form
+		pack();
+
+		if (!cache_path.empty() && !write_cache(cache_path, hash, prims))
+			std::cout << "Warning: couldn't write BVH cache file \"" << cache_path << "\"" << std::endl;
+	}
 
-	// Empty the temporary build sets
-	prim_bag.clear();
-	build_nodes.clear();
-	build_bboxes.clear();
+	own_topology.reset();
+	if (keep) {
+		if (refit) {
+			// Same structure as the tree it was refit from, so its
+			// leaves can be copied instead of looking up every primitive
+			std::vector<Node> indexed(nodes);
+			for (size_t i = 0; i < indexed.size(); i += is_leaf(i) ? 1 : time_samples(i)) {
+				if (is_leaf(i))
+					indexed[i] = refit_source->nodes[i];
+			}
+			own_topology = std::make_shared<Topology>(Topology {std::move(indexed), prims.size(), refit_source->built_sah_cost});
+		} else {
+			own_topology = std::make_shared<Topology>(Topology {indexed_nodes(prims), prims.size(), sah_cost()});
+		}
+	}
+	refit_source.reset();
+
+	// Only BVHs too large to stay in cache benefit from interleaving
+	interleave_traversal = (nodes.size() * sizeof(Node)) > (Config::interleaved_traversal_size * (1000*1000));
+
+	build_treelets();
+
+	// Free the temporary build sets
+	std::vector<BuildPrimitive>().swap(prim_bag);
+	std::vector<BuildNode>().swap(build_nodes);
+	std::vector<BBox>().swap(build_bboxes);
 
 	return true;
 }
 
+
+bool BVH4::refit_node(size_t node_i, std::vector<BBox> &bounds)
+{
+	bounds.clear();
+
+	if (is_leaf(node_i)) {
+		const BBoxT &bb = nodes[node_i].data->bounds();
+		for (size_t i = 0; i < bb.bbox.size(); ++i)
+			bounds.push_back(bb[i]);
+		return true;
+	}
+
+	// Refit the children
+	const int child_count = 2 + (nodes[node_i].child_indices[1] != 0) + (nodes[node_i].child_indices[2] != 0);
+	std::vector<BBox> child_bounds[4];
+	bool equal_time_samples = true;
+	for (int ci = 0; ci < child_count; ++ci) {
+		if (!refit_node(child(node_i, ci), child_bounds[ci]))
+			return false;
+		equal_time_samples = equal_time_samples && child_bounds[ci].size() == child_bounds[0].size();
+	}
+
+	// Children with different numbers of time samples are merged into a
+	// single sample, the same as when packing
+	if (!equal_time_samples) {
+		for (int ci = 0; ci < child_count; ++ci) {
+			for (size_t i = 1; i < child_bounds[ci].size(); ++i)
+				child_bounds[ci][0].merge_with(child_bounds[ci][i]);
+			child_bounds[ci].resize(1);
+		}
+	}
+	const size_t ts = child_bounds[0].size();
+	if (ts != time_samples(node_i))
+		return false;
+
+	for (size_t i = 0; i < ts; ++i) {
+		BBox bb[4];
+		for (int ci = 0; ci < child_count; ++ci)
+			bb[ci] = child_bounds[ci][i];
+		nodes[node_i + i].bounds = NodeBounds(BBox4(bb[0], bb[1], bb[2], bb[3]));
+
+		bounds.push_back(bb[0]);
+		for (int ci = 1; ci < child_count; ++ci)
+			bounds.back().merge_with(bb[ci]);
+	}
+
+	return true;
+}
+
+
 size_t BVH4::max_primitive_id() const
 {
 	return nodes.size();
@@ -89,12 +227,21 @@ struct CompareDim {
  * Returns the split index (last index of the first group).
  */
 size_t BVH4::split_primitives(size_t first_prim, size_t last_prim)
+{
+	if (build_method == BuildMethod::SAH)
+		return split_primitives_sah(first_prim, last_prim);
+	else
+		return split_primitives_midpoint(first_prim, last_prim);
+}
+
+
+size_t BVH4::split_primitives_midpoint(size_t first_prim, size_t last_prim)
 {
 	// Find the minimum and maximum centroid values on each axis
 	Vec3 min, max;
 	min = prim_bag[first_prim].c;
 	max = prim_bag[first_prim].c;
-	for (uint32_t i = first_prim+1; i <= last_prim; i++) {
+	for (size_t i = first_prim+1; i <= last_prim; i++) {
 		for (int32_t d = 0; d < 3; d++) {
 			min[d] = min[d] < prim_bag[i].c[d] ? min[d] : prim_bag[i].c[d];
 			max[d] = max[d] > prim_bag[i].c[d] ? max[d] : prim_bag[i].c[d];
@@ -125,69 +272,436 @@ size_t BVH4::split_primitives(size_t first_prim, size_t last_prim)
 }
 
 
+/*
+ * Splits the primitives with the binned surface area heuristic.
+ *
+ * The primitives' centroids are sorted into equally sized bins along
+ * each axis, and each boundary between bins is a candidate split.  The
+ * candidate that minimizes the sum of each side's surface area times
+ * its primitive count wins.
+ */
+size_t BVH4::split_primitives_sah(size_t first_prim, size_t last_prim)
+{
+	constexpr int BIN_COUNT = 16;
+
+	// Find the minimum and maximum centroid values on each axis
+	Vec3 min = prim_bag[first_prim].c;
+	Vec3 max = prim_bag[first_prim].c;
+	for (size_t i = first_prim+1; i <= last_prim; i++) {
+		for (int32_t d = 0; d < 3; d++) {
+			min[d] = std::min(min[d], prim_bag[i].c[d]);
+			max[d] = std::max(max[d], prim_bag[i].c[d]);
+		}
+	}
+
+	// Maps centroids to bins.  Slightly shrunk, so that the max
+	// centroid still lands in the last bin.
+	float bin_scale[3];
+	for (int32_t d = 0; d < 3; d++)
+		bin_scale[d] = (max[d] > min[d]) ? ((BIN_COUNT * 0.9999f) / (max[d] - min[d])) : 0.0f;
+	auto bin_index = [&](const BuildPrimitive &p, int32_t d) {
+		return std::min(BIN_COUNT - 1, static_cast<int>((p.c[d] - min[d]) * bin_scale[d]));
+	};
+
+	// Fill the bins
+	BBox bin_bounds[3][BIN_COUNT];
+	size_t bin_counts[3][BIN_COUNT] = {};
+	for (size_t i = first_prim; i <= last_prim; i++) {
+		const BBox pb(prim_bag[i].bmin, prim_bag[i].bmax);
+		for (int32_t d = 0; d < 3; d++) {
+			const int b = bin_index(prim_bag[i], d);
+			bin_counts[d][b]++;
+			bin_bounds[d][b].merge_with(pb);
+		}
+	}
+
+	// Find the cheapest split.  Splits between bins b and b+1 are
+	// costed by sweeping from the right to accumulate the right sides,
+	// and then from the left.
+	int32_t best_axis = -1;
+	int best_bin = 0;
+	float best_cost = std::numeric_limits<float>::infinity();
+	for (int32_t d = 0; d < 3; d++) {
+		if (bin_scale[d] == 0.0f)
+			continue;
+
+		float right_costs[BIN_COUNT];
+		BBox bb;
+		size_t count = 0;
+		for (int b = BIN_COUNT - 1; b > 0; b--) {
+			bb.merge_with(bin_bounds[d][b]);
+			count += bin_counts[d][b];
+			right_costs[b] = count > 0 ? (bb.surface_area() * count) : 0.0f;
+		}
+
+		bb = BBox();
+		count = 0;
+		const size_t total = last_prim - first_prim + 1;
+		for (int b = 0; b < BIN_COUNT - 1; b++) {
+			bb.merge_with(bin_bounds[d][b]);
+			count += bin_counts[d][b];
+			if (count == 0 || count == total)
+				continue;
+			const float cost = (bb.surface_area() * count) + right_costs[b+1];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = d;
+				best_bin = b;
+			}
+		}
+	}
+
+	// If all the centroids are in the same bin on every axis, any
+	// split is as good as any other
+	if (best_axis == -1)
+		return (first_prim + last_prim) / 2;
+
+	auto mid_itr = std::partition(prim_bag.begin()+first_prim,
+	                              prim_bag.begin()+last_prim+1,
+	                              [&](const BuildPrimitive &p) {
+		return bin_index(p, best_axis) <= best_bin;
+	});
+
+	return std::distance(prim_bag.begin(), mid_itr) - 1;
+}
+
+
 /*
  * Recursively builds the BVH starting at the given node with the given
  * first and last primitive indices (in bag).
  */
-size_t BVH4::recursive_build(size_t parent, size_t first_prim, size_t last_prim)
+size_t BVH4::recursive_build(BuildTree &tree, size_t parent, size_t first_prim, size_t last_prim, int parallel_depth)
 {
+	// Smallest number of primitives worth building as parallel tasks
+	constexpr size_t MIN_PARALLEL_PRIMS = 1 << 12;
+
 	// Allocate the node
-	const size_t me = build_nodes.size();
-	build_nodes.push_back(BuildNode());
+	const size_t me = tree.nodes.size();
+	tree.nodes.push_back(BuildNode());
 
 
-	build_nodes[me].flags = 0;
-	build_nodes[me].parent_index = parent;
+	tree.nodes[me].flags = 0;
+	tree.nodes[me].parent_index = parent;
 
 	if (first_prim == last_prim) {
 		// Leaf node
 
-		build_nodes[me].flags |= IS_LEAF;
-		build_nodes[me].data = prim_bag[first_prim].data;
+		tree.nodes[me].flags |= IS_LEAF;
+		tree.nodes[me].data = prim_bag[first_prim].data;
 
 		// Copy bounding boxes
-		build_nodes[me].bbox_index = build_bboxes.size();
-		build_nodes[me].ts = prim_bag[first_prim].data->bounds().size();
-		for (size_t i = 0; i < build_nodes[me].ts; i++)
-			build_bboxes.push_back(prim_bag[first_prim].data->bounds()[i]);
+		tree.nodes[me].bbox_index = tree.bboxes.size();
+		tree.nodes[me].ts = prim_bag[first_prim].data->bounds().size();
+		for (size_t i = 0; i < tree.nodes[me].ts; i++)
+			tree.bboxes.push_back(prim_bag[first_prim].data->bounds()[i]);
 	} else {
 		// Not a leaf node
 
 		// Create child nodes
-		uint32_t split_index = split_primitives(first_prim, last_prim);
-		const size_t child1i = recursive_build(me, first_prim, split_index);
-		const size_t child2i = recursive_build(me, split_index+1, last_prim);
+		const size_t split_index = split_primitives(first_prim, last_prim);
+		size_t child1i, child2i;
+		if (parallel_depth > 0 && (last_prim - first_prim) >= MIN_PARALLEL_PRIMS) {
+			// Build the two subtrees as parallel tasks, each into its own
+			// tree, and then append them after this node.  They work on
+			// separate ranges of the primitives, so they don't interfere.
+			BuildTree subtree1, subtree2;
+			auto task = std::async(std::launch::async, [&]() {
+				recursive_build(subtree1, 0, first_prim, split_index, parallel_depth - 1);
+			});
+			recursive_build(subtree2, 0, split_index+1, last_prim, parallel_depth - 1);
+			task.get();
+
+			child1i = append_subtree(tree, subtree1, me);
+			child2i = append_subtree(tree, subtree2, me);
+		} else {
+			child1i = recursive_build(tree, me, first_prim, split_index, parallel_depth);
+			child2i = recursive_build(tree, me, split_index+1, last_prim, parallel_depth);
+		}
 
-		build_nodes[me].child_index = child2i;
+		tree.nodes[me].child_index = child2i;
+		merge_child_bounds(tree, me, child1i, child2i);
+	}
 
+	return me;
+}
 
-		// Calculate bounds
-		build_nodes[me].bbox_index = build_bboxes.size();
-		// If both children have same number of time samples
-		if (build_nodes[child1i].ts == build_nodes[child2i].ts) {
-			build_nodes[me].ts = build_nodes[child1i].ts;
 
-			// Copy merged bounding boxes
-			for (size_t i = 0; i < build_nodes[me].ts; i++) {
-				build_bboxes.push_back(build_bboxes[build_nodes[child1i].bbox_index+i]);
-				build_bboxes.back().merge_with(build_bboxes[build_nodes[child2i].bbox_index+i]);
+void BVH4::merge_child_bounds(BuildTree &tree, size_t node, size_t child1, size_t child2)
+{
+	std::vector<BuildNode> &nodes = tree.nodes;
+	std::vector<BBox> &bboxes = tree.bboxes;
+
+	// Calculate bounds
+	nodes[node].bbox_index = bboxes.size();
+	// If both children have same number of time samples
+	if (nodes[child1].ts == nodes[child2].ts) {
+		nodes[node].ts = nodes[child1].ts;
+
+		// Copy merged bounding boxes
+		for (size_t i = 0; i < nodes[node].ts; i++) {
+			bboxes.push_back(bboxes[nodes[child1].bbox_index+i]);
+			bboxes.back().merge_with(bboxes[nodes[child2].bbox_index+i]);
+		}
+
+	}
+	// If children have different number of time samples
+	else {
+		nodes[node].ts = 1;
+
+		// Merge children's bboxes to get our bbox
+		bboxes.push_back(bboxes[nodes[child1].bbox_index]);
+		for (size_t i = 1; i < nodes[child1].ts; i++)
+			bboxes.back().merge_with(bboxes[nodes[child1].bbox_index+i]);
+		for (size_t i = 0; i < nodes[child2].ts; i++)
+			bboxes.back().merge_with(bboxes[nodes[child2].bbox_index+i]);
+	}
+}
+
+
+size_t BVH4::append_subtree(BuildTree &tree, const BuildTree &subtree, size_t parent)
+{
+	const size_t node_offset = tree.nodes.size();
+	const size_t bbox_offset = tree.bboxes.size();
+
+	tree.nodes.insert(tree.nodes.end(), subtree.nodes.begin(), subtree.nodes.end());
+	tree.bboxes.insert(tree.bboxes.end(), subtree.bboxes.begin(), subtree.bboxes.end());
+
+	// Fix up the indices, which are relative to the subtree
+	for (size_t i = node_offset; i < tree.nodes.size(); ++i) {
+		BuildNode &node = tree.nodes[i];
+		node.parent_index = (i == node_offset) ? parent : (node.parent_index + node_offset);
+		node.bbox_index += bbox_offset;
+		if (!(node.flags & IS_LEAF))
+			node.child_index += node_offset;
+	}
+
+	return node_offset;
+}
+
+
+/*
+ * The header of a BVH cache file.  The nodes follow it directly, so it's
+ * padded to keep them aligned to a cache line when the file is mapped.
+ */
+struct BVH4CacheHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t node_size;
+	uint64_t content_hash;
+	uint64_t primitive_count;
+	uint64_t node_count;
+	uint8_t padding[24];
+};
+
+static const uint64_t BVH4_CACHE_MAGIC = 0x3448564259535000; // "\0PSYBVH4" when read as little-endian
+static const uint32_t BVH4_CACHE_VERSION = 1; // Must change whenever the node layout or build algorithms change
+
+
+uint64_t BVH4::content_hash() const
+{
+	// 64-bit FNV-1a, over 32-bit words
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&hash](uint32_t n) {
+		hash ^= n;
+		hash *= 1099511628211ull;
+	};
+	auto add_float = [&add](float f) {
+		uint32_t n;
+		std::memcpy(&n, &f, 4);
+		add(n);
+	};
+
+	add(BVH4_CACHE_VERSION);
+	add(sizeof(Node));
+	add(static_cast<uint32_t>(build_method));
+	add(prim_bag.size());
+	for (const auto &bp: prim_bag) {
+		const BBoxT &bb = bp.data->bounds();
+		add(bb.bbox.size());
+		for (size_t i = 0; i < bb.bbox.size(); ++i) {
+			for (int a = 0; a < 3; ++a) {
+				add_float(bb[i].min[a]);
+				add_float(bb[i].max[a]);
 			}
+		}
+	}
+
+	return hash;
+}
+
 
+std::vector<BVH4::Node> BVH4::indexed_nodes(const std::vector<Primitive*> &prims) const
+{
+	std::unordered_map<const Primitive*, uint64_t> prim_indices;
+	for (size_t i = 0; i < prims.size(); ++i)
+		prim_indices[prims[i]] = i;
+
+	// Inner nodes are followed by the extra nodes of their other time
+	// samples, which are copied as they are
+	std::vector<Node> indexed(nodes);
+	for (size_t i = 0; i < indexed.size();) {
+		if (is_leaf(i)) {
+			const uint64_t prim_i = prim_indices.at(indexed[i].data);
+			std::memset(static_cast<void*>(&(indexed[i].bounds)), 0, sizeof(indexed[i].bounds));
+			std::memcpy(&(indexed[i].data), &prim_i, sizeof(prim_i));
+			i += 1;
+		} else {
+			i += time_samples(i);
 		}
-		// If children have different number of time samples
-		else {
-			build_nodes[me].ts = 1;
-
-			// Merge children's bboxes to get our bbox
-			build_bboxes.push_back(build_bboxes[build_nodes[child1i].bbox_index]);
-			for (size_t i = 1; i < build_nodes[child1i].ts; i++)
-				build_bboxes.back().merge_with(build_bboxes[build_nodes[child1i].bbox_index+i]);
-			for (size_t i = 0; i < build_nodes[child2i].ts; i++)
-				build_bboxes.back().merge_with(build_bboxes[build_nodes[child2i].bbox_index+i]);
+	}
+
+	return indexed;
+}
+
+
+bool BVH4::resolve_indices(const std::vector<Primitive*> &prims)
+{
+	// All indices are checked, so a corrupt or mismatched set of nodes
+	// can't crash or hang traversal.  Nodes are packed depth-first, so
+	// children always come after their parent and parents before their
+	// children, which also rules out cycles.  Missing children have to
+	// have empty bounds, so that traversal never tries to visit them.
+	const size_t count = nodes.size();
+	bool ok = count <= std::numeric_limits<uint32_t>::max();
+	for (size_t i = 0; ok && i < count;) {
+		Node &node = nodes[i];
+		ok = node.which_sibling < 4 && (i == 0 || node.parent_index < i);
+		if (ok && is_leaf(i)) {
+			uint64_t prim_i;
+			std::memcpy(&prim_i, &(node.data), sizeof(prim_i));
+			ok = prim_i < prims.size();
+			node.data = ok ? prims[prim_i] : nullptr;
+			node.data_bounds = ok ? &(node.data->bounds()) : nullptr;
+			i += 1;
+		} else if (ok) {
+			// The first child is implicitly the node right after the
+			// inner node's time samples
+			ok = node.time_sample_count > 0 && (i + node.time_sample_count) < count;
+			for (int c = 0; ok && c < 3; ++c) {
+				const uint32_t child_i = node.child_indices[c];
+				ok = child_i == 0 ? (c > 0 && (c == 2 || node.child_indices[c+1] == 0)) : (child_i > i && child_i < count);
+			}
+			for (uint32_t t = 0; ok && t < node.time_sample_count; ++t) {
+				const BBox4 b = nodes[i+t].bounds.decode();
+				for (int c = 2; ok && c < 4; ++c) {
+					if (node.child_indices[c-1] == 0) {
+						const BBox bb = b.get(c);
+						ok = bb.min.x > bb.max.x || bb.min.y > bb.max.y || bb.min.z > bb.max.z;
+					}
+				}
+			}
+			i += ok ? node.time_sample_count : 0;
 		}
 	}
 
-	return me;
+	if (!ok)
+		std::vector<Node>().swap(nodes);
+	return ok;
+}
+
+
+bool BVH4::write_cache(const std::string &path, uint64_t hash, const std::vector<Primitive*> &prims) const
+{
+	static_assert(sizeof(BVH4CacheHeader) == 64, "BVH4 cache header should be a cache line");
+
+	const std::vector<Node> indexed = indexed_nodes(prims);
+
+	BVH4CacheHeader header;
+	std::memset(&header, 0, sizeof(header));
+	header.magic = BVH4_CACHE_MAGIC;
+	header.version = BVH4_CACHE_VERSION;
+	header.node_size = sizeof(Node);
+	header.content_hash = hash;
+	header.primitive_count = prims.size();
+	header.node_count = nodes.size();
+
+	// Include the process id, in case several are writing the same file
+	const std::string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+	FILE *f = fopen(tmp_path.c_str(), "wb");
+	if (f == nullptr)
+		return false;
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	ok = ok && fwrite(indexed.data(), sizeof(Node), indexed.size(), f) == indexed.size();
+
+	ok = (fclose(f) == 0) && ok;
+	ok = ok && (rename(tmp_path.c_str(), path.c_str()) == 0);
+	if (!ok)
+		remove(tmp_path.c_str());
+	return ok;
+}
+
+
+bool BVH4::read_cache(const std::string &path, uint64_t hash, const std::vector<Primitive*> &prims)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(BVH4CacheHeader))) {
+		close(fd);
+		return false;
+	}
+	const size_t file_size = st.st_size;
+	void *map = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	const BVH4CacheHeader &header = *static_cast<const BVH4CacheHeader*>(map);
+	bool ok = header.magic == BVH4_CACHE_MAGIC
+	          && header.version == BVH4_CACHE_VERSION
+	          && header.node_size == sizeof(Node)
+	          && header.content_hash == hash
+	          && header.primitive_count == prims.size()
+	          && header.node_count <= std::numeric_limits<uint32_t>::max()
+	          && file_size == sizeof(BVH4CacheHeader) + (header.node_count * sizeof(Node));
+
+	if (ok) {
+		const Node *mapped_nodes = reinterpret_cast<const Node*>(static_cast<const char*>(map) + sizeof(BVH4CacheHeader));
+		nodes.assign(mapped_nodes, mapped_nodes + header.node_count);
+		ok = resolve_indices(prims);
+	}
+
+	munmap(map, file_size);
+	return ok;
+}
+
+
+BVH4::NodeBounds::NodeBounds(const BBox4 &b)
+{
+	static_assert(sizeof(Node) == 64, "BVH4 nodes should fit in a cache line");
+
+	// The quantization box is the union of the (non-empty) children
+	BBox parent = b.get(0);
+	for (int i = 1; i < 4; ++i)
+		parent.merge_with(b.get(i));
+
+	for (int a = 0; a < 3; ++a) {
+		origin[a] = parent.min[a];
+
+		// Smallest power-of-two step that covers the extent in 255
+		// steps.  Flat extents still get a step that's big enough to
+		// not vanish when added to the origin.
+		const float size = std::max({parent.max[a] - parent.min[a], std::abs(origin[a]) * std::numeric_limits<float>::epsilon(), std::numeric_limits<float>::min() * 255.0f});
+		int e;
+		std::frexp(size / 255.0f, &e);
+		step_exp[a] = std::min(std::max(e, -126), 127);
+	}
+
+	// Rounding when adding the extent to the origin can leave it just
+	// short of the maximum, in which case the step is doubled.
+	float lo[3], hi[3];
+	extent(lo, hi);
+	for (int a = 0; a < 3; ++a) {
+		while ((hi[a] < parent.max[a] || hi[a] <= lo[a]) && step_exp[a] < 127) {
+			step_exp[a]++;
+			extent(lo, hi);
+		}
+	}
+
+	children = QBBox4(lo, hi, b);
 }
 
 
@@ -209,18 +723,18 @@ void BVH4::pack()
 
 		// Set the values that don't depend on whether this
 		// is a leaf node or not.
-		nodes[ni].set_parent_index(bn.parent_index);
+		nodes[ni].parent_index = bn.parent_index;
 		if (bn.flags & IS_2ND) {
 			nodes[bn.parent_index].child_indices[0] = ni;
-			nodes[ni].set_which_sibling(1);
+			nodes[ni].which_sibling = 1;
 		} else if (bn.flags & IS_3RD) {
 			nodes[bn.parent_index].child_indices[1] = ni;
-			nodes[ni].set_which_sibling(2);
+			nodes[ni].which_sibling = 2;
 		} else if (bn.flags & IS_4TH) {
 			nodes[bn.parent_index].child_indices[2] = ni;
-			nodes[ni].set_which_sibling(3);
+			nodes[ni].which_sibling = 3;
 		} else {
-			nodes[ni].set_which_sibling(0);
+			nodes[ni].which_sibling = 0;
 		}
 
 		// Set the values that _do_ depend on whether this is
@@ -228,6 +742,7 @@ void BVH4::pack()
 		if (bn.flags & IS_LEAF) {
 			nodes[ni].child_indices[0] = 0; // Indicates that this is a leaf node
 			nodes[ni].data = bn.data;
+			nodes[ni].data_bounds = &(bn.data->bounds());
 			nodes.push_back(Node());
 		} else {
 			// Collect children
@@ -270,17 +785,17 @@ void BVH4::pack()
 
 			// If children have same number of time samples, easy
 			if (equal_time_samples) {
-				nodes[ni].set_time_samples(children[0]->ts);
+				nodes[ni].time_sample_count = children[0]->ts;
 				for (uint16_t i = 0; i < children[0]->ts; ++i) {
 					switch (child_count) {
 						case 2:
-							nodes.back().bounds = BBox4(build_bboxes[children[0]->bbox_index+i], build_bboxes[children[1]->bbox_index+i], BBox(), BBox());
+							nodes.back().bounds = NodeBounds(BBox4(build_bboxes[children[0]->bbox_index+i], build_bboxes[children[1]->bbox_index+i], BBox(), BBox()));
 							break;
 						case 3:
-							nodes.back().bounds = BBox4(build_bboxes[children[0]->bbox_index+i], build_bboxes[children[1]->bbox_index+i], build_bboxes[children[2]->bbox_index+i], BBox());
+							nodes.back().bounds = NodeBounds(BBox4(build_bboxes[children[0]->bbox_index+i], build_bboxes[children[1]->bbox_index+i], build_bboxes[children[2]->bbox_index+i], BBox()));
 							break;
 						case 4:
-							nodes.back().bounds = BBox4(build_bboxes[children[0]->bbox_index+i], build_bboxes[children[1]->bbox_index+i], build_bboxes[children[2]->bbox_index+i], build_bboxes[children[3]->bbox_index+i]);
+							nodes.back().bounds = NodeBounds(BBox4(build_bboxes[children[0]->bbox_index+i], build_bboxes[children[1]->bbox_index+i], build_bboxes[children[2]->bbox_index+i], build_bboxes[children[3]->bbox_index+i]));
 							break;
 					}
 					nodes.push_back(Node());
@@ -289,7 +804,7 @@ void BVH4::pack()
 			// If children have different number of time samples,
 			// merge time samples into a single sample
 			else {
-				nodes[ni].set_time_samples(1);
+				nodes[ni].time_sample_count = 1;
 				BBox bb[4];
 				for (int ci = 0; ci < child_count; ++ci) {
 					for (uint16_t i = 0; i < children[ci]->ts; ++i)
@@ -298,13 +813,13 @@ void BVH4::pack()
 
 				switch (child_count) {
 					case 2:
-						nodes[ni].bounds = BBox4(bb[0], bb[1], BBox(), BBox());
+						nodes[ni].bounds = NodeBounds(BBox4(bb[0], bb[1], BBox(), BBox()));
 						break;
 					case 3:
-						nodes[ni].bounds = BBox4(bb[0], bb[1], bb[2], BBox());
+						nodes[ni].bounds = NodeBounds(BBox4(bb[0], bb[1], bb[2], BBox()));
 						break;
 					case 4:
-						nodes[ni].bounds = BBox4(bb[0], bb[1], bb[2], bb[3]);
+						nodes[ni].bounds = NodeBounds(BBox4(bb[0], bb[1], bb[2], bb[3]));
 						break;
 				}
 
@@ -314,15 +829,257 @@ void BVH4::pack()
 	}
 	nodes.pop_back();
 	nodes.shrink_to_fit();
+
+	// Node indices are stored in 32 bits
+	assert(nodes.size() <= std::numeric_limits<uint32_t>::max());
 }
 
 
-uint BVH4::get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, void *state)
+void BVH4::build_treelets()
+{
+	node_treelets.assign(nodes.size(), 0);
+	num_treelets = 1;
+	if (nodes.size() == 0 || Config::treelet_size == 0)
+		return;
+
+	std::vector<size_t> leaf_counts(nodes.size());
+	count_leaves(0, leaf_counts);
+	assign_treelets(0, 0, leaf_counts);
+}
+
+
+float BVH4::sah_cost() const
+{
+	if (nodes.size() == 0 || is_leaf(0))
+		return nodes.size();
+
+	// Bounds of the root
+	const BBox4 b = nodes[0].bounds.decode();
+	BBox root_bounds = b.get(0);
+	const int child_count = 2 + (nodes[0].child_indices[1] != 0) + (nodes[0].child_indices[2] != 0);
+	for (int i = 1; i < child_count; ++i)
+		root_bounds.merge_with(b.get(i));
+	const float root_area = root_bounds.surface_area();
+
+	return sah_cost(0, root_area) / root_area;
+}
+
+
+/*
+ * Returns the SAH cost of the subtree at node_i, whose bounds have the
+ * given surface area, scaled by the surface area of the whole BVH.
+ */
+float BVH4::sah_cost(size_t node_i, float area) const
+{
+	if (is_leaf(node_i))
+		return area;
+
+	float cost = area;
+	const BBox4 b = nodes[node_i].bounds.decode();
+	const int child_count = 2 + (nodes[node_i].child_indices[1] != 0) + (nodes[node_i].child_indices[2] != 0);
+	for (int i = 0; i < child_count; ++i)
+		cost += sah_cost(child(node_i, i), b.get(i).surface_area());
+	return cost;
+}
+
+
+size_t BVH4::count_leaves(size_t node_i, std::vector<size_t> &leaf_counts) const
+{
+	size_t count = 1;
+	if (!is_leaf(node_i)) {
+		const int child_count = 2 + (nodes[node_i].child_indices[1] != 0) + (nodes[node_i].child_indices[2] != 0);
+		count = 0;
+		for (int i = 0; i < child_count; ++i)
+			count += count_leaves(child(node_i, i), leaf_counts);
+	}
+
+	leaf_counts[node_i] = count;
+	return count;
+}
+
+
+void BVH4::assign_treelets(size_t node_i, uint32_t treelet, const std::vector<size_t> &leaf_counts)
+{
+	node_treelets[node_i] = treelet;
+	if (is_leaf(node_i))
+		return;
+
+	// Leaves always stay in their parent's treelet, since a treelet
+	// of a single primitive wouldn't gain anything
+	const bool too_big = leaf_counts[node_i] > Config::treelet_size;
+	const int child_count = 2 + (nodes[node_i].child_indices[1] != 0) + (nodes[node_i].child_indices[2] != 0);
+	for (int i = 0; i < child_count; ++i) {
+		const size_t child_i = child(node_i, i);
+		if (too_big && !is_leaf(child_i) && leaf_counts[child_i] <= Config::treelet_size)
+			assign_treelets(child_i, num_treelets++, leaf_counts);
+		else
+			assign_treelets(child_i, treelet, leaf_counts);
+	}
+}
+
+
+inline unsigned int BVH4::intersect_children(const size_t node_i, const Ray &ray, const SIMD::float4 *ray_o, const SIMD::float4 *d_inv, const SIMD::float4 &max_t, const std::array<uint32_t, 3> &d_sign, SIMD::float4 *near_hits) const
+{
+#ifdef GLOBAL_STATS_TOP_LEVEL_BVH_NODE_TESTS
+	Global::Stats::top_level_bvh_node_tests += 4;
+#endif
+	uint32_t ti;
+	float alpha;
+
+	// Get the time-interpolated bounding box
+	const BBox4 b = calc_time_interp(time_samples(node_i), ray.time, &ti, &alpha) ? lerp(alpha, nodes[node_i+ti].bounds.decode(), nodes[node_i+ti+1].bounds.decode()) : nodes[node_i].bounds.decode();
+
+	// Ray test
+	return b.intersect_ray(ray_o, d_inv, max_t, d_sign, near_hits);
+}
+
+
+inline void BVH4::descend(uint64_t &node, uint64_t &bit_stack, const unsigned int hit_mask, const SIMD::float4 &near_hits, float *node_t) const
+{
+	bit_stack <<= 3;
+
+	// Single hit
+	switch (hit_mask) {
+		case 1 << 0:
+			*node_t = near_hits[0];
+			node = child(node, 0);
+			return;
+		case 1 << 1:
+			*node_t = near_hits[1];
+			node = child(node, 1);
+			return;
+		case 1 << 2:
+			*node_t = near_hits[2];
+			node = child(node, 2);
+			return;
+		case 1 << 3:
+			*node_t = near_hits[3];
+			node = child(node, 3);
+			return;
+	}
+
+	// Multiple hits
+	// Find the index of the nearst hit
+	int nearest_hit_i = 0;
+	float nearest_hit = std::numeric_limits<float>::infinity();
+	for (int i = 0; i < 4; ++i) {
+		if ((hit_mask & (1<<i)) && (near_hits[i] <= nearest_hit)) {
+			nearest_hit = near_hits[i];
+			nearest_hit_i = i;
+		}
+	}
+
+	// Add skip code to the bit stack and set the next node
+	bit_stack |= skip_code(hit_mask, nearest_hit_i);
+	*node_t = nearest_hit;
+	node = child(node, nearest_hit_i);
+}
+
+
+inline bool BVH4::advance(uint64_t &node, uint64_t &bit_stack) const
+{
+	// If we've completed the full traversal
+	if (bit_stack == 0) {
+		node = ~uint64_t(0); // Magic number for "finished"
+		return false;
+	}
+
+	// Find the next node to work from
+	while ((bit_stack & 7) == 0) {
+		node = parent(node);
+		bit_stack >>= 3;
+	}
+
+	// Traverse to the next available sibling node
+	static const int code_table[8] = {0, 1, 2, 1, 3, 1, 2, 1};
+	const uint64_t code = bit_stack & 7;
+	const uint64_t skip_code_next = code >> code_table[code];
+	node = next_sibling(node, code_table[code]);
+	bit_stack = (bit_stack & ~7) | skip_code_next;
+
+	return true;
+}
+
+
+inline bool BVH4::intersect_leaf(const size_t node_i, const Ray &ray, const float max_t, const bool node_t_known, float *node_t) const
+{
+	// If we don't know the leaf's entry distance yet, test against the
+	// primitive's own bounds, which also culls it if it's entirely
+	// beyond max_t.
+	float tfar;
+	return node_t_known || (nodes[node_i].data_bounds->intersect_ray(ray, node_t, &tfar) && *node_t < max_t);
+}
+
+
+inline bool BVH4::step(Traversal &tr, const uint max_potential) const
+{
+	if (!is_leaf(tr.node)) {
+		// Inner node
+		// Test ray against children's bboxes, and descend into the
+		// nearest one that was hit
+		SIMD::float4 near_hits;
+		const unsigned int hit_mask = intersect_children(tr.node, *(tr.ray), tr.ray_o, tr.d_inv, tr.max_t, tr.d_sign, &near_hits);
+		if (hit_mask != 0) {
+			descend(tr.node, tr.bit_stack, hit_mask, near_hits, &tr.node_t);
+			tr.node_t_known = true;
+			return tr.treelet == NO_TREELET || node_treelets[tr.node] == tr.treelet;
+		}
+	} else if (intersect_leaf(tr.node, *(tr.ray), tr.ray_max_t, tr.node_t_known, &tr.node_t)) {
+		// Leaf node
+		tr.ids[tr.count] = tr.node;
+		tr.ts[tr.count] = tr.node_t;
+		++tr.count;
+	}
+
+	tr.node_t_known = false;
+	return advance(tr.node, tr.bit_stack) && tr.count < max_potential && (tr.treelet == NO_TREELET || node_treelets[tr.node] == tr.treelet);
+}
+
+
+inline bool BVH4::interleaved_step(Traversal &tr, const uint max_potential) const
+{
+	// The leaf node itself was prefetched on the previous step, so its
+	// primitive bounds pointer can be read without stalling
+	if (!tr.leaf_prefetched && !tr.node_t_known && is_leaf(tr.node)) {
+		LowLevel::prefetch_L1(nodes[tr.node].data_bounds);
+		tr.leaf_prefetched = true;
+		return true;
+	}
+
+	tr.leaf_prefetched = false;
+	if (!step(tr, max_potential))
+		return false;
+	LowLevel::prefetch_L1(&(nodes[tr.node]));
+	return true;
+}
+
+
+uint BVH4::traverse(const Ray &ray, const float ray_max_t, uint64_t &node, uint64_t &bit_stack, float node_t, bool node_t_known, uint32_t treelet, uint max_potential, size_t *ids, float *ts) const
 {
 	// Algorithm is based on the BVH4 algorithm from the paper
 	// "Stackless Multi-BVH Traversal for CPU, MIC and GPU Ray Tracing"
 	// by Afra et al.
+	if (max_potential == 0)
+		return 0;
+
+	Traversal tr;
+	tr.init(ray, ray_max_t, node, bit_stack, node_t, node_t_known, treelet, ids, ts);
+	while (step(tr, max_potential)) {}
+
+	node = tr.node;
+	bit_stack = tr.bit_stack;
+	return tr.count;
+}
+
 
+uint BVH4::get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, float *ts, void *state)
+{
+	return resume_traversal(ray, tmax, max_potential, ids, ts, state, false);
+}
+
+
+uint BVH4::resume_traversal(const Ray &ray, float tmax, uint max_potential, size_t *ids, float *ts, void *state, bool treelet_bound) const
+{
 	// Get state
 	uint64_t& node = static_cast<uint64_t *>(state)[0];
 	uint64_t& bit_stack = static_cast<uint64_t *>(state)[1];
@@ -331,100 +1088,77 @@ uint BVH4::get_potential_intersections(const Ray &ray, float tmax, uint max_pote
 	if (nodes.size() == 0 || node == ~uint64_t(0))
 		return 0;
 
-	// Get inverse ray direction and whether each ray component is negative
-	const Vec3 d_inv_f = ray.get_d_inverse();
-	const auto d_sign = ray.get_d_sign();
-
-	// Load ray origin, inverse direction, and max_t into simd layouts for intersection testing
-	const SIMD::float4 ray_o[3] = {ray.o[0], ray.o[1], ray.o[2]};
-	const SIMD::float4 d_inv[3] = {d_inv_f[0], d_inv_f[1], d_inv_f[2]};
-	const SIMD::float4 max_t {
-		ray.max_t
-	};
+	// Nodes the ray only enters beyond tmax can't contain a closer hit, so
+	// they're culled along with everything else beyond the ray's extent.
+	// The entry distance of the node we start at isn't known, since we
+	// didn't get to it from its parent.
+	return traverse(ray, std::min(ray.max_t, tmax), node, bit_stack, 0.0f, false, treelet_bound ? node_treelets[node] : NO_TREELET, max_potential, ids, ts);
+}
 
-	// Traverse the BVH
-	uint32_t hits_so_far = 0;
 
-	while (hits_so_far < max_potential) {
-		while (!is_leaf(node)) {
-			// Inner node
-#ifdef GLOBAL_STATS_TOP_LEVEL_BVH_NODE_TESTS
-			Global::Stats::top_level_bvh_node_tests += 4;
-#endif
-			// Test ray against children's bboxes
-			SIMD::float4 near_hits;
-			uint32_t ti;
-			float alpha;
-
-			// Get the time-interpolated bounding box
-			const BBox4 b = calc_time_interp(time_samples(node), ray.time, &ti, &alpha) ? lerp(alpha, nodes[node+ti].bounds, nodes[node+ti+1].bounds) : nodes[node].bounds;
-
-			// Ray test
-			uint64_t hit_mask = b.intersect_ray(ray_o, d_inv, max_t, d_sign, &near_hits);
-
-			// If we didn't hit anything, exit loop
-			if (hit_mask == 0)
-				break;
-
-			bit_stack <<= 3;
-
-			// Single hit
-			switch (hit_mask) {
-				case 1 << 0:
-					node = child(node, 0);
-					continue;
-				case 1 << 1:
-					node = child(node, 1);
-					continue;
-				case 1 << 2:
-					node = child(node, 2);
-					continue;
-				case 1 << 3:
-					node = child(node, 3);
-					continue;
-			}
+void BVH4::get_potential_intersections_batch(uint ray_count, const Ray *const rays[], const float tmaxes[], uint max_potential, size_t *ids, float *ts, uint *counts, void *const states[], bool treelet_bound)
+{
+	if (!interleave_traversal || max_potential == 0) {
+		for (uint r = 0; r < ray_count; ++r)
+			counts[r] = resume_traversal(*(rays[r]), tmaxes[r], max_potential, ids + (r * max_potential), ts + (r * max_potential), states[r], treelet_bound);
+		return;
+	}
 
-			// Multiple hits
-			// Find the index of the nearst hit
-			int nearest_hit_i = 0;
-			float nearest_hit = std::numeric_limits<float>::infinity();
-			for (int i = 0; i < 4; ++i) {
-				if ((hit_mask & (1<<i)) && (near_hits[i] <= nearest_hit)) {
-					nearest_hit = near_hits[i];
-					nearest_hit_i = i;
-				}
+	// Keep up to width traversals in flight, round-robin, and start the
+	// next ray in the slot of each one that finishes.  Enough traversals
+	// are needed for the prefetches of each to arrive by its next turn.
+	const uint width = std::max(1u, std::min<uint>(Config::interleaved_traversal_width, MAX_INTERLEAVED_WIDTH));
+	Traversal traversals[MAX_INTERLEAVED_WIDTH];
+	uint slot_rays[MAX_INTERLEAVED_WIDTH]; // Which ray each traversal is of
+	uint next_ray = 0;
+
+	// Starts the next ray that has anything left to traverse in the given
+	// slot, returning false if there are no rays left
+	auto start_next = [&](uint slot) -> bool {
+		while (next_ray < ray_count) {
+			const uint r = next_ray++;
+			const uint64_t node = static_cast<uint64_t *>(states[r])[0];
+			const uint64_t bit_stack = static_cast<uint64_t *>(states[r])[1];
+			counts[r] = 0;
+
+			// Skip the ray if it's an empty BVH or if we have the
+			// "finished" magic number.  The entry distance of the node we
+			// start at isn't known, since we didn't get to it from its
+			// parent.
+			if (nodes.size() > 0 && node != ~uint64_t(0)) {
+				traversals[slot].init(*(rays[r]), std::min(rays[r]->max_t, tmaxes[r]), node, bit_stack, 0.0f, false, treelet_bound ? node_treelets[node] : NO_TREELET, ids + (r * max_potential), ts + (r * max_potential));
+				slot_rays[slot] = r;
+				LowLevel::prefetch_L1(&(nodes[node]));
+				return true;
 			}
-
-			// Add skip code to the bit stack and set the next node
-			bit_stack |= skip_code(hit_mask, nearest_hit_i);
-			node = child(node, nearest_hit_i);
 		}
+		return false;
+	};
 
-		if (is_leaf(node)) {
-			// Leaf node
-			ids[hits_so_far++] = node;
-		}
+	uint in_flight = 0;
+	while (in_flight < width && start_next(in_flight))
+		++in_flight;
 
-		// If we've completed the full traversal
-		if (bit_stack == 0) {
-			node = ~uint64_t(0); // Magic number for "finished"
-			break;
-		}
+	while (in_flight > 0) {
+		for (uint i = 0; i < in_flight;) {
+			Traversal &tr = traversals[i];
+			if (interleaved_step(tr, max_potential)) {
+				++i;
+				continue;
+			}
 
-		// Find the next node to work from
-		while ((bit_stack & 7) == 0) {
-			node = parent(node);
-			bit_stack >>= 3;
+			// Finished, so save its state and replace it
+			const uint r = slot_rays[i];
+			static_cast<uint64_t *>(states[r])[0] = tr.node;
+			static_cast<uint64_t *>(states[r])[1] = tr.bit_stack;
+			counts[r] = tr.count;
+			if (start_next(i)) {
+				++i;
+			} else {
+				--in_flight;
+				traversals[i] = traversals[in_flight];
+				slot_rays[i] = slot_rays[in_flight];
+			}
 		}
-
-		// Traverse to the next available sibling node
-		static const int code_table[8] = {0, 1, 2, 1, 3, 1, 2, 1};
-		const uint64_t code = bit_stack & 7;
-		const uint64_t skip_code_next = code >> code_table[code];
-		node = next_sibling(node, code_table[code]);
-		bit_stack = (bit_stack & ~7) | skip_code_next;
 	}
-
-	// Return the number of primitives accumulated
-	return hits_so_far;
 }
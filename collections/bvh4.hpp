@@ -5,9 +5,10 @@
 #include "global.hpp"
 
 #include <stdlib.h>
+#include <cstring>
 #include <iostream>
 #include <vector>
-#include <deque>
+#include <string>
 #include <memory>
 #include <tuple>
 #include <x86intrin.h>
@@ -18,6 +19,8 @@
 #include "utils.hpp"
 #include "vector.hpp"
 #include "chunked_array.hpp"
+#include "simd.hpp"
+#include "config.hpp"
 
 
 
@@ -28,54 +31,189 @@
 class BVH4: public Collection
 {
 public:
+	/**
+	 * @brief How to split the primitives at each node while building.
+	 */
+	enum class BuildMethod {
+		MIDPOINT, // At the midpoint of the largest extent of the centroids
+		SAH // Binned surface area heuristic
+	};
+
+	BVH4() {}
+	BVH4(BuildMethod method): build_method {method} {}
 	virtual ~BVH4() {};
 
 	virtual void add_primitives(std::vector<std::unique_ptr<Primitive>>* primitives);
+
+	/**
+	 * @brief Adds primitives owned elsewhere, e.g. in a MemoryArena.
+	 */
+	void add_primitives(const std::vector<Primitive*> &primitives);
+
 	virtual bool finalize();
 	virtual size_t max_primitive_id() const;
 	virtual Primitive &get_primitive(size_t id);
-	virtual uint get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, void *state);
+	virtual uint get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, float *ts, void *state);
+	virtual void get_potential_intersections_batch(uint ray_count, const Ray *const rays[], const float tmaxes[], uint max_potential, size_t *ids, float *ts, uint *counts, void *const states[], bool treelet_bound);
 	virtual size_t ray_state_size() {
 		return 16;
 	}
+	virtual uint treelet_count() const {
+		return num_treelets;
+	}
+	virtual uint ray_treelet(const void *state) const {
+		const uint64_t node = static_cast<const uint64_t *>(state)[0];
+		return node == ~uint64_t(0) ? NO_TREELET : node_treelets[node];
+	}
+
+	/**
+	 * @brief Returns the expected cost of tracing a ray through the
+	 * BVH, according to the surface area heuristic.
+	 *
+	 * The cost is the number of inner nodes plus the number of leaves
+	 * a random ray that hits the BVH's bounds is expected to visit.  It
+	 * uses the first time sample of the bounds.
+	 */
+	float sah_cost() const;
+
+	/**
+	 * @brief Returns whether the BVH was read from the BVH cache instead
+	 * of being built.
+	 *
+	 * See Config::bvh_cache_dir.
+	 */
+	bool from_cache() const {
+		return cached;
+	}
+
+	/**
+	 * @brief The bounds of the four children of an inner node, for one
+	 * time sample.
+	 *
+	 * The children's boxes are quantized to 8 bits relative to a box
+	 * that has a float origin and a power-of-two step size on each
+	 * axis.  Quantization always rounds outwards, so the decoded boxes
+	 * contain the original ones.
+	 */
+	struct NodeBounds {
+		float origin[3];
+		int8_t step_exp[3]; // Base 2 exponent of the quantization step of each axis
+		QBBox4 children;
+
+		NodeBounds() {}
+		NodeBounds(const BBox4 &b);
+
+		BBox4 decode() const {
+			float lo[3], hi[3];
+			extent(lo, hi);
+			return children.decode(lo, hi);
+		}
+
+	private:
+		// Computes the box the children are quantized relative to.  Both
+		// encoding and decoding must compute it exactly the same way.
+		void extent(float lo[3], float hi[3]) const {
+			for (int a = 0; a < 3; ++a) {
+				lo[a] = origin[a];
+				hi[a] = origin[a] + (255.0f * exp2i(step_exp[a]));
+			}
+		}
 
+		// 2 to the power of e, for e in [-126, 127]
+		static float exp2i(const int32_t e) {
+			const uint32_t bits = uint32_t(e + 127) << 23;
+			float f;
+			std::memcpy(&f, &bits, 4);
+			return f;
+		}
+	};
+
+	/*
+	 * A node of the packed BVH, 64 bytes in size.
+	 *
+	 * Nodes with more than one time sample are followed by one extra
+	 * Node per additional time sample, of which only the bounds are
+	 * used.
+	 */
 	struct Node {
-		uint64_t parent_index_and_misc = 0;  // Stores the parent index, and also the time sample count and which sibling the node is
-		size_t child_indices[3] = {0,0,0}; // When first element is 0, indicates that this is a leaf node,
+		uint32_t parent_index = 0;
+		uint16_t time_sample_count = 0;
+		uint8_t which_sibling = 0; // Whether the node is the first, second, third, or fourth sibling (as 0-3)
+		uint32_t child_indices[3] = {0,0,0}; // When first element is 0, indicates that this is a leaf node,
 		// because a non-leaf node needs at least two children.  When the
 		// second and/or third elements are zero, indicates there is no
 		// third or fourth child, respectively.
 		union {
 			// If the node is a leaf, we don't need the bounds.
 			// If the node is not a leaf, it doesn't have Primitive data.
-			BBox4 bounds {BBox(), BBox(), BBox(), BBox()};
-			Primitive *data;
+			NodeBounds bounds;
+			struct {
+				Primitive *data;
+				const BBoxT *data_bounds; // data->bounds(), so traversal can prefetch and test it without a virtual call
+			};
 		};
 
-		Node() {}
-
-		Node(const Node& n): parent_index_and_misc {n.parent_index_and_misc} {
-			for (int i = 0; i < 3; ++i)
-				child_indices[i] = n.child_indices[i];
-			bounds = n.bounds;
+		Node() {
+			data = nullptr;
+			data_bounds = nullptr;
 		}
+	};
 
-		void set_time_samples(const uint64_t ts) {
-			parent_index_and_misc &= 0xF000FFFFFFFFFFFF;
-			parent_index_and_misc |= (ts << 48) & 0x0FFF000000000000;
-		}
+	/**
+	 * @brief The tree structure of a finalized BVH4, independent of the
+	 * primitives in it.
+	 *
+	 * Used to refit the BVH of the next frame of an animation instead of
+	 * building it from scratch.
+	 */
+	struct Topology {
+		std::vector<Node> nodes; // Leaves store the index of their primitive instead of a pointer to it
+		size_t primitive_count;
+		float built_sah_cost; // The SAH cost when the tree was last built rather than refit
+	};
 
-		void set_parent_index(const uint64_t par_i) {
-			parent_index_and_misc &= 0xFFFF000000000000;
-			parent_index_and_misc |= par_i & 0x0000FFFFFFFFFFFF;
-		}
+	/**
+	 * @brief Makes finalize() try to refit the given tree to the
+	 * primitives before falling back to building a new one.
+	 *
+	 * The primitives must have been added in the same order as for the
+	 * BVH the topology came from.  The refit is rejected if it grows the
+	 * SAH cost by more than Config::bvh_refit_max_sah_growth over the
+	 * cost when the tree was built.
+	 */
+	void refit_from(std::shared_ptr<const Topology> prev) {
+		refit_source = prev;
+	}
 
-		// Record whether this node is the first, second, third, or fourth sibling (as 0-3).
-		void set_which_sibling(const uint64_t sibling_id) {
-			parent_index_and_misc &= 0x0FFFFFFFFFFFFFFF;
-			parent_index_and_misc |= (sibling_id << 60) & 0xF000000000000000;
-		}
-	};
+	/**
+	 * @brief Makes finalize() keep the tree structure, for topology()
+	 * to hand to a later frame.
+	 *
+	 * The topology is a second copy of the nodes, so it's only kept when
+	 * asked for.
+	 */
+	void keep_topology() {
+		keeping_topology = true;
+	}
+
+	/**
+	 * @brief Returns the tree structure of the finalized BVH, for
+	 * refitting the BVH of a later frame.
+	 *
+	 * Only available if keep_topology() was called and refitting is
+	 * enabled, otherwise returns null.
+	 */
+	std::shared_ptr<const Topology> topology() const {
+		return own_topology;
+	}
+
+	/**
+	 * @brief Returns whether the BVH was refit from another's topology
+	 * instead of being built.
+	 */
+	bool refitted() const {
+		return refit;
+	}
 
 	/*
 	 * A node for building the bounding volume hierarchy.
@@ -134,12 +272,31 @@ public:
 		BBoxT bb;
 	};
 
+	/*
+	 * A BVH under construction, with its nodes in depth-first order:
+	 * each inner node's first child comes right after it, and its
+	 * second child after the first child's subtree.
+	 */
+	struct BuildTree {
+		std::vector<BuildNode> nodes;
+		std::vector<BBox> bboxes;
+	};
+
 private:
+	BuildMethod build_method {Config::bvh_sah_build ? BuildMethod::SAH : BuildMethod::MIDPOINT};
 	BBoxT bbox;
 	std::vector<Node> nodes;
-	std::deque<BuildNode> build_nodes;
-	std::deque<BBox> build_bboxes;
-	std::deque<BuildPrimitive> prim_bag;  // Temporary holding spot for primitives not yet added to the hierarchy
+	bool cached {false}; // Whether the nodes were read from the BVH cache
+	bool refit {false}; // Whether the nodes were refit from refit_source
+	std::shared_ptr<const Topology> refit_source;
+	std::shared_ptr<const Topology> own_topology;
+	bool keeping_topology {false}; // Whether finalize() should fill in own_topology
+	bool interleave_traversal {false}; // Whether to interleave the traversals of batches of rays
+	std::vector<uint32_t> node_treelets; // Which treelet each node belongs to
+	uint32_t num_treelets {1};
+	std::vector<BuildNode> build_nodes;
+	std::vector<BBox> build_bboxes;
+	std::vector<BuildPrimitive> prim_bag;  // Temporary holding spot for primitives not yet added to the hierarchy
 
 	/**
 	 * @brief Returns the index of the nth (0-3) child
@@ -157,7 +314,7 @@ private:
 	 * of the node with the given index.
 	 */
 	inline size_t parent(const size_t node_i) const {
-		return nodes[node_i].parent_index_and_misc & 0x0000FFFFFFFFFFFF;
+		return nodes[node_i].parent_index;
 	}
 
 	/**
@@ -165,14 +322,14 @@ private:
 	 * of the node with the given index.
 	 */
 	inline uint32_t time_samples(const size_t node_i) const {
-		return (nodes[node_i].parent_index_and_misc >> 48) & 0x0000000000000FFF;
+		return nodes[node_i].time_sample_count;
 	}
 
 	/**
 	 * @brief Returns which sibling the node with the given index is.
 	 */
 	inline uint32_t which_sibling(const size_t node_i) const {
-		return (nodes[node_i].parent_index_and_misc >> 60) & 0x000000000000000F;
+		return nodes[node_i].which_sibling;
 	}
 
 
@@ -210,9 +367,225 @@ private:
 
 
 
+	/**
+	 * @brief Tests a ray against the children of the (inner) node with
+	 * the given index.
+	 *
+	 * @returns A bitmask of which children were hit.
+	 */
+	inline unsigned int intersect_children(const size_t node_i, const Ray &ray, const SIMD::float4 *ray_o, const SIMD::float4 *d_inv, const SIMD::float4 &max_t, const std::array<uint32_t, 3> &d_sign, SIMD::float4 *near_hits) const;
+
+	/**
+	 * @brief Moves a traversal down into the nearest hit child of the
+	 * current node, recording any other hit children on the bit stack.
+	 *
+	 * @param[out] node_t Set to the entry distance of the new node.
+	 */
+	inline void descend(uint64_t &node, uint64_t &bit_stack, const unsigned int hit_mask, const SIMD::float4 &near_hits, float *node_t) const;
+
+	/**
+	 * @brief Moves a traversal on to the next node on the bit stack.
+	 *
+	 * @returns False if there are no nodes left, in which case node
+	 *          is set to the "finished" magic number.
+	 */
+	inline bool advance(uint64_t &node, uint64_t &bit_stack) const;
+
+	/**
+	 * @brief Determines whether a traversal that reached the leaf node
+	 * with the given index actually needs to visit it, and at what
+	 * distance it enters it.
+	 */
+	inline bool intersect_leaf(const size_t node_i, const Ray &ray, const float max_t, const bool node_t_known, float *node_t) const;
+
+	/**
+	 * @brief A single ray's traversal, in a form that can be advanced one
+	 * node at a time.
+	 */
+	struct Traversal {
+		const Ray *ray;
+		SIMD::float4 ray_o[3]; // Ray origin, for simd intersection testing
+		SIMD::float4 d_inv[3]; // Inverse ray direction, for simd intersection testing
+		SIMD::float4 max_t;
+		std::array<uint32_t, 3> d_sign;
+		float ray_max_t;
+		uint64_t node;
+		uint64_t bit_stack;
+		float node_t; // Entry distance of the current node, if known
+		bool node_t_known;
+		uint count; // Number of leaf nodes accumulated so far
+		bool leaf_prefetched; // Whether the current leaf node's primitive bounds have been prefetched
+		uint32_t treelet; // The treelet to stop at the boundary of, or NO_TREELET
+		size_t *ids;
+		float *ts;
+
+		void init(const Ray &ray_, const float ray_max_t_, const uint64_t node_, const uint64_t bit_stack_, const float node_t_, const bool node_t_known_, const uint32_t treelet_, size_t *ids_, float *ts_) {
+			ray = &ray_;
+			const Vec3 d_inv_f = ray_.get_d_inverse();
+			for (int i = 0; i < 3; ++i) {
+				ray_o[i] = SIMD::float4(ray_.o[i]);
+				d_inv[i] = SIMD::float4(d_inv_f[i]);
+			}
+			max_t = SIMD::float4(ray_max_t_);
+			d_sign = ray_.get_d_sign();
+			ray_max_t = ray_max_t_;
+			node = node_;
+			bit_stack = bit_stack_;
+			node_t = node_t_;
+			node_t_known = node_t_known_;
+			count = 0;
+			leaf_prefetched = false;
+			treelet = treelet_;
+			ids = ids_;
+			ts = ts_;
+		}
+	};
+
+	/**
+	 * @brief Advances a traversal by a single node: tests the current
+	 * node, and moves on to the next one.
+	 *
+	 * @returns False if the traversal is finished, either because there
+	 *          are no nodes left, because max_potential leaf nodes have
+	 *          been accumulated, or because it reached the boundary of
+	 *          its treelet.
+	 */
+	inline bool step(Traversal &tr, const uint max_potential) const;
+
+	/**
+	 * @brief The most traversals get_potential_intersections_batch()
+	 * interleaves at once, regardless of
+	 * Config::interleaved_traversal_width.
+	 */
+	static constexpr uint MAX_INTERLEAVED_WIDTH = 32;
+
+	/**
+	 * @brief Same as step(), but prefetches whatever the traversal
+	 * needs next instead of waiting for it, for interleaving with other
+	 * traversals.
+	 *
+	 * That's the next node, or, when the traversal is at a leaf whose
+	 * entry distance isn't known yet, the leaf's primitive bounds.  In
+	 * the latter case the leaf is only tested on the following call.
+	 */
+	inline bool interleaved_step(Traversal &tr, const uint max_potential) const;
+
+	/**
+	 * @brief Same as get_potential_intersections(), but optionally
+	 * stopping at the boundary of the ray's current treelet.
+	 */
+	uint resume_traversal(const Ray &ray, float tmax, uint max_potential, size_t *ids, float *ts, void *state, bool treelet_bound) const;
+
+	/**
+	 * @brief Continues a ray's traversal from the given state, accumulating
+	 * up to max_potential leaf nodes.
+	 *
+	 * @param ray_max_t The ray's max_t, or its tmax if smaller.
+	 * @param node_t The entry distance of the current node, if known.
+	 * @param node_t_known Whether node_t is known.
+	 * @param treelet The treelet to stop at the boundary of, or NO_TREELET.
+	 */
+	uint traverse(const Ray &ray, const float ray_max_t, uint64_t &node, uint64_t &bit_stack, float node_t, bool node_t_known, uint32_t treelet, uint max_potential, size_t *ids, float *ts) const;
+
 	size_t split_primitives(size_t first_prim, size_t last_prim);
-	size_t recursive_build(size_t parent, size_t first_prim, size_t last_prim);
+	size_t split_primitives_midpoint(size_t first_prim, size_t last_prim);
+	size_t split_primitives_sah(size_t first_prim, size_t last_prim);
+
+	/**
+	 * @brief Builds the subtree of the given primitives into tree, with
+	 * the given parent.
+	 *
+	 * @param parallel_depth How many more levels of the tree to build
+	 *                       the two subtrees of each node as parallel
+	 *                       tasks.
+	 *
+	 * @returns The index of the subtree's root in tree.
+	 */
+	size_t recursive_build(BuildTree &tree, size_t parent, size_t first_prim, size_t last_prim, int parallel_depth);
+
+	/**
+	 * @brief Sets the bounds of an inner node of tree from those of its
+	 * two children.
+	 */
+	static void merge_child_bounds(BuildTree &tree, size_t node, size_t child1, size_t child2);
+
+	/**
+	 * @brief Appends a subtree to tree, with the given parent.
+	 *
+	 * @returns The index of the subtree's root in tree.
+	 */
+	static size_t append_subtree(BuildTree &tree, const BuildTree &subtree, size_t parent);
+
 	void pack();
+
+	/**
+	 * @brief Recomputes the bounds of the subtree at node_i from the
+	 * current bounds of its primitives, keeping its structure.
+	 *
+	 * @param[out] bounds The bounds of the whole subtree, one per time
+	 *                    sample.
+	 *
+	 * @returns False if the primitives' time sample counts no longer fit
+	 *          the tree's layout.
+	 */
+	bool refit_node(size_t node_i, std::vector<BBox> &bounds);
+
+	/**
+	 * @brief Copies a node array whose leaves store the indices of their
+	 * primitives in prims, instead of pointers to them.
+	 */
+	std::vector<Node> indexed_nodes(const std::vector<Primitive*> &prims) const;
+
+	/**
+	 * @brief Turns the primitive indices stored in the leaves back into
+	 * pointers into prims, checking every index along the way.
+	 *
+	 * @returns False, leaving the BVH empty, if any index is out of
+	 *          range.
+	 */
+	bool resolve_indices(const std::vector<Primitive*> &prims);
+
+	/**
+	 * @brief Hashes everything the built BVH depends on: the file format
+	 * version, the build method, and the bounds of the primitives in
+	 * the order they were added.
+	 */
+	uint64_t content_hash() const;
+
+	/**
+	 * @brief Writes the packed BVH to a cache file.
+	 *
+	 * The file is a CacheHeader followed by the nodes exactly as they
+	 * are in memory, except that leaf nodes store the index of their
+	 * primitive in prims instead of a pointer to it.  It's written to a
+	 * temporary file that's then renamed, so other processes never see
+	 * a partial file.
+	 *
+	 * @param prims The primitives, in the order they were added.
+	 */
+	bool write_cache(const std::string &path, uint64_t hash, const std::vector<Primitive*> &prims) const;
+
+	/**
+	 * @brief Reads the packed BVH from a cache file written by
+	 * write_cache(), by mapping it into memory.
+	 *
+	 * @returns False, leaving the BVH empty, if the file doesn't exist
+	 *          or doesn't match the format version, hash, or primitives.
+	 */
+	bool read_cache(const std::string &path, uint64_t hash, const std::vector<Primitive*> &prims);
+
+	/**
+	 * @brief Partitions the packed BVH into treelets of at most
+	 * Config::treelet_size primitives each.
+	 *
+	 * Every inner node whose subtree holds few enough primitives, but
+	 * whose parent's doesn't, becomes the root of a treelet containing
+	 * that whole subtree.  The nodes above those form one more treelet.
+	 */
+	void build_treelets();
+	size_t count_leaves(size_t node_i, std::vector<size_t> &leaf_counts) const;
+	float sah_cost(size_t node_i, float area) const;
+	void assign_treelets(size_t node_i, uint32_t treelet, const std::vector<size_t> &leaf_counts);
 };
 
 
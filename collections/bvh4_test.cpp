@@ -0,0 +1,580 @@
+#include "test.hpp"
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include "numtype.h"
+#include "vector.hpp"
+#include "ray.hpp"
+#include "rng.hpp"
+#include "timer.hpp"
+#include "bilinear.hpp"
+#include "bvh4.hpp"
+#include "config.hpp"
+
+
+// Makes count patches of widely varying sizes, clumped unevenly around
+// a handful of centers the way real scene geometry tends to be.  Patches
+// are moved along x by an amount proportional to their distance from
+// the origin times motion, to simulate animation.
+static std::vector<std::unique_ptr<Primitive>> make_patches(size_t count, uint32_t seed, float motion = 0.0f)
+{
+	RNG rng(seed);
+	Vec3 centers[8];
+	for (auto &c: centers)
+		c = Vec3(rng.next_float_c() * 100.0f, rng.next_float_c() * 100.0f, rng.next_float_c() * 100.0f);
+
+	std::vector<std::unique_ptr<Primitive>> prims;
+	for (size_t i = 0; i < count; ++i) {
+		const Vec3 &c = centers[(i * i) % 8];
+		const float spread = 2.0f + (40.0f * rng.next_float() * rng.next_float());
+		Vec3 p = c + Vec3(rng.next_float_c() * spread, rng.next_float_c() * spread, rng.next_float_c() * spread);
+		p.x += p.length() * motion;
+		const float size = 0.1f / (0.01f + rng.next_float());
+		const Vec3 du = Vec3(rng.next_float_c(), rng.next_float_c(), rng.next_float_c()) * size;
+		const Vec3 dv = Vec3(rng.next_float_c(), rng.next_float_c(), rng.next_float_c()) * size;
+
+		Bilinear *patch = new Bilinear(p, p + du, p + du + dv, p + dv);
+		patch->finalize();
+		prims.emplace_back(patch);
+	}
+	return prims;
+}
+
+static Ray make_ray(const Vec3 &o, const Vec3 &d)
+{
+	Ray ray;
+	ray.o = o;
+	ray.d = d;
+	ray.time = 0.5f;
+	ray.ow = 0.0f;
+	ray.dw = 0.0f;
+	ray.max_t = std::numeric_limits<float>::infinity();
+	ray.is_shadow_ray = false;
+	ray.finalize();
+	return ray;
+}
+
+// Random rays from outside the scene, aimed into it
+static std::vector<Ray> make_rays(size_t count, uint32_t seed)
+{
+	RNG rng(seed);
+	std::vector<Ray> rays;
+	for (size_t i = 0; i < count; ++i) {
+		Vec3 o(rng.next_float_c(), rng.next_float_c(), rng.next_float_c());
+		o.normalize();
+		o = o * 300.0f;
+		const Vec3 target(rng.next_float_c() * 100.0f, rng.next_float_c() * 100.0f, rng.next_float_c() * 100.0f);
+		rays.push_back(make_ray(o, target - o));
+	}
+	return rays;
+}
+
+// Collects every potential intersection of a ray with the BVH, in
+// traversal order
+static std::vector<size_t> all_potential_intersections(BVH4 &bvh, const Ray &ray)
+{
+	const uint max_potential = 16;
+	size_t ids[max_potential];
+	float ts[max_potential];
+	uint64_t state[2] = {0, 0};
+
+	std::vector<size_t> found;
+	while (uint count = bvh.get_potential_intersections(ray, ray.max_t, max_potential, ids, ts, state))
+		found.insert(found.end(), ids, ids + count);
+	return found;
+}
+
+
+// Collects every potential intersection of each ray with the BVH,
+// tracing all of the rays as a single batch each round
+static std::vector<std::vector<size_t>> all_potential_intersections_batch(BVH4 &bvh, const std::vector<Ray> &rays)
+{
+	const uint max_potential = 16;
+	std::vector<size_t> ids(rays.size() * max_potential);
+	std::vector<float> ts(rays.size() * max_potential);
+	std::vector<uint> counts(rays.size());
+	std::vector<const Ray*> batch_rays;
+	std::vector<float> tmaxes;
+	std::vector<uint64_t> states(rays.size() * 2, 0);
+	std::vector<void*> batch_states;
+	for (size_t r = 0; r < rays.size(); ++r) {
+		batch_rays.push_back(&rays[r]);
+		tmaxes.push_back(rays[r].max_t);
+		batch_states.push_back(&states[r * 2]);
+	}
+
+	std::vector<std::vector<size_t>> found(rays.size());
+	bool any = true;
+	while (any) {
+		bvh.get_potential_intersections_batch(rays.size(), batch_rays.data(), tmaxes.data(), max_potential, ids.data(), ts.data(), counts.data(), batch_states.data(), false);
+		any = false;
+		for (size_t r = 0; r < rays.size(); ++r) {
+			found[r].insert(found[r].end(), ids.begin() + (r * max_potential), ids.begin() + (r * max_potential) + counts[r]);
+			any = any || counts[r] > 0;
+		}
+	}
+	return found;
+}
+
+/*
+ * Test suite for BVH4.
+ */
+BOOST_AUTO_TEST_SUITE(bvh4);
+
+// Test that both build methods find every primitive whose bounds a ray
+// hits, and each of them exactly once
+BOOST_AUTO_TEST_CASE(potential_intersections_1)
+{
+	const auto rays = make_rays(300, 3);
+
+	for (auto method: {BVH4::BuildMethod::MIDPOINT, BVH4::BuildMethod::SAH}) {
+		auto prims = make_patches(5000, 1);
+		std::vector<Primitive*> prim_ptrs;
+		for (auto &p: prims)
+			prim_ptrs.push_back(p.get());
+
+		BVH4 bvh(method);
+		bvh.add_primitives(&prims);
+		bvh.finalize();
+
+		bool complete = true;
+		bool no_duplicates = true;
+		for (const auto &ray: rays) {
+			auto found = all_potential_intersections(bvh, ray);
+
+			std::vector<Primitive*> found_prims;
+			for (auto id: found)
+				found_prims.push_back(&bvh.get_primitive(id));
+			std::sort(found_prims.begin(), found_prims.end());
+			no_duplicates = no_duplicates && std::adjacent_find(found_prims.begin(), found_prims.end()) == found_prims.end();
+
+			for (auto p: prim_ptrs) {
+				if (p->bounds().at_time(ray.time).intersect_ray(ray))
+					complete = complete && std::binary_search(found_prims.begin(), found_prims.end(), p);
+			}
+		}
+
+		BOOST_CHECK(complete);
+		BOOST_CHECK(no_duplicates);
+	}
+}
+
+// Test that every primitive can be reached by a ray aimed at its center
+BOOST_AUTO_TEST_CASE(potential_intersections_2)
+{
+	for (auto method: {BVH4::BuildMethod::MIDPOINT, BVH4::BuildMethod::SAH}) {
+		auto prims = make_patches(2000, 5);
+		std::vector<Primitive*> prim_ptrs;
+		for (auto &p: prims)
+			prim_ptrs.push_back(p.get());
+
+		BVH4 bvh(method);
+		bvh.add_primitives(&prims);
+		bvh.finalize();
+
+		bool reachable = true;
+		for (auto p: prim_ptrs) {
+			const BBox b = p->bounds()[0];
+			const Vec3 center = (b.min + b.max) * 0.5f;
+			const Vec3 o(center.x + 1.0f, center.y + 500.0f, center.z + 2.0f);
+			const auto found = all_potential_intersections(bvh, make_ray(o, center - o));
+
+			bool hit = false;
+			for (auto id: found)
+				hit = hit || &bvh.get_primitive(id) == p;
+			reachable = reachable && hit;
+		}
+
+		BOOST_CHECK(reachable);
+	}
+}
+
+// Test that quantized node bounds contain the original boxes, and
+// exceed them by less than two quantization steps of the node's extent
+BOOST_AUTO_TEST_CASE(node_bounds_1)
+{
+	RNG rng(17);
+	bool contains = true;
+	bool tight = true;
+
+	for (int n = 0; n < 1000; ++n) {
+		const Vec3 p_min(rng.next_float_c() * 1000.0f, rng.next_float_c() * 1000.0f, rng.next_float_c() * 1000.0f);
+		const Vec3 p_ext(rng.next_float() * 50.0f, rng.next_float() * 50.0f, (n % 4 == 0) ? 0.0f : rng.next_float() * 50.0f);
+
+		BBox boxes[4];
+		const int child_count = 2 + (n % 3);
+		for (int i = 0; i < child_count; ++i) {
+			for (int a = 0; a < 3; ++a) {
+				const float f1 = rng.next_float();
+				const float f2 = rng.next_float();
+				boxes[i].min[a] = p_min[a] + (p_ext[a] * std::min(f1, f2));
+				boxes[i].max[a] = p_min[a] + (p_ext[a] * std::max(f1, f2));
+			}
+		}
+
+		const BBox4 b = BVH4::NodeBounds(BBox4(boxes[0], boxes[1], boxes[2], boxes[3])).decode();
+
+		for (int i = 0; i < 4; ++i) {
+			const BBox d = b.get(i);
+			if (i >= child_count) {
+				// Missing children must stay empty
+				contains = contains && d.min.x > d.max.x;
+				continue;
+			}
+			for (int a = 0; a < 3; ++a) {
+				const float step = std::max(p_ext[a], std::abs(p_min[a]) * 1.0e-6f) * (2.0f / 255.0f);
+				contains = contains && d.min[a] <= boxes[i].min[a] && d.max[a] >= boxes[i].max[a];
+				tight = tight && (boxes[i].min[a] - d.min[a]) <= step && (d.max[a] - boxes[i].max[a]) <= step;
+			}
+		}
+	}
+
+	BOOST_CHECK(contains);
+	BOOST_CHECK(tight);
+}
+
+// Test that the SAH build doesn't come out worse than the midpoint
+// build by its own measure
+BOOST_AUTO_TEST_CASE(sah_cost_1)
+{
+	auto prims_1 = make_patches(20000, 7);
+	auto prims_2 = make_patches(20000, 7);
+
+	BVH4 bvh_mid(BVH4::BuildMethod::MIDPOINT);
+	bvh_mid.add_primitives(&prims_1);
+	bvh_mid.finalize();
+
+	BVH4 bvh_sah(BVH4::BuildMethod::SAH);
+	bvh_sah.add_primitives(&prims_2);
+	bvh_sah.finalize();
+
+	BOOST_CHECK(bvh_sah.sah_cost() > 1.0f);
+	BOOST_CHECK(bvh_sah.sah_cost() <= bvh_mid.sah_cost());
+}
+
+// Points Config::bvh_cache_dir at a new temporary directory for as long
+// as it exists, and then deletes the directory and the cache files in it
+// and restores the setting, even if the test fails partway
+struct TempBVHCacheDir {
+	std::string saved_dir;
+	std::string dir;
+
+	TempBVHCacheDir(): saved_dir {Config::bvh_cache_dir} {
+		char path[] = "/tmp/psy_bvh4_test_XXXXXX";
+		if (mkdtemp(path) != nullptr)
+			dir = path;
+		Config::bvh_cache_dir = dir;
+	}
+
+	~TempBVHCacheDir() {
+		Config::bvh_cache_dir = saved_dir;
+		if (dir.empty())
+			return;
+		if (DIR *d = opendir(dir.c_str())) {
+			while (dirent *entry = readdir(d)) {
+				const std::string name = entry->d_name;
+				if (name != "." && name != "..")
+					unlink((dir + "/" + name).c_str());
+			}
+			closedir(d);
+		}
+		rmdir(dir.c_str());
+	}
+};
+
+// Test that a BVH read back from the cache gives the same results as
+// the one that was built, and that changed primitives aren't served a
+// stale BVH
+BOOST_AUTO_TEST_CASE(cache_1)
+{
+	TempBVHCacheDir cache_dir;
+	BOOST_REQUIRE(!cache_dir.dir.empty());
+
+	auto prims_1 = make_patches(3000, 19);
+	auto prims_2 = make_patches(3000, 19);
+	auto prims_3 = make_patches(3000, 19);
+	prims_3.pop_back();
+	std::vector<Primitive*> prim_ptrs_1, prim_ptrs_2;
+	for (size_t i = 0; i < prims_1.size(); ++i) {
+		prim_ptrs_1.push_back(prims_1[i].get());
+		prim_ptrs_2.push_back(prims_2[i].get());
+	}
+
+	BVH4 bvh_1, bvh_2, bvh_3;
+	bvh_1.add_primitives(&prims_1);
+	bvh_1.finalize();
+	bvh_2.add_primitives(&prims_2);
+	bvh_2.finalize();
+	bvh_3.add_primitives(&prims_3);
+	bvh_3.finalize();
+
+	BOOST_CHECK(!bvh_1.from_cache());
+	BOOST_CHECK(bvh_2.from_cache());
+	BOOST_CHECK(!bvh_3.from_cache());
+
+	// Same primitives, by index, in the same order
+	bool same = true;
+	for (const auto &ray: make_rays(300, 23)) {
+		const auto found_1 = all_potential_intersections(bvh_1, ray);
+		const auto found_2 = all_potential_intersections(bvh_2, ray);
+		same = same && found_1.size() == found_2.size();
+		for (size_t i = 0; same && i < found_1.size(); ++i) {
+			const auto p1 = std::find(prim_ptrs_1.begin(), prim_ptrs_1.end(), &bvh_1.get_primitive(found_1[i])) - prim_ptrs_1.begin();
+			const auto p2 = std::find(prim_ptrs_2.begin(), prim_ptrs_2.end(), &bvh_2.get_primitive(found_2[i])) - prim_ptrs_2.begin();
+			same = p1 == p2;
+		}
+	}
+	BOOST_CHECK(same);
+}
+
+// Checks that a BVH finds every primitive whose bounds a ray hits
+static bool is_complete(BVH4 &bvh, const std::vector<std::unique_ptr<Primitive>> &prims)
+{
+	bool complete = true;
+	for (const auto &ray: make_rays(300, 29)) {
+		auto found = all_potential_intersections(bvh, ray);
+		std::vector<Primitive*> found_prims;
+		for (auto id: found)
+			found_prims.push_back(&bvh.get_primitive(id));
+		std::sort(found_prims.begin(), found_prims.end());
+
+		for (const auto &p: prims) {
+			if (p->bounds().at_time(ray.time).intersect_ray(ray))
+				complete = complete && std::binary_search(found_prims.begin(), found_prims.end(), p.get());
+		}
+	}
+	return complete;
+}
+
+// Test that cache files whose nodes could loop or index out of range are
+// rejected, and the BVH is rebuilt instead
+BOOST_AUTO_TEST_CASE(cache_2)
+{
+	TempBVHCacheDir cache_dir;
+	BOOST_REQUIRE(!cache_dir.dir.empty());
+
+	auto prims_1 = make_patches(3000, 31);
+	BVH4 bvh_1;
+	bvh_1.add_primitives(&prims_1);
+	bvh_1.finalize();
+
+	std::string cache_path;
+	if (DIR *d = opendir(cache_dir.dir.c_str())) {
+		while (dirent *entry = readdir(d)) {
+			const std::string name = entry->d_name;
+			if (name != "." && name != "..")
+				cache_path = cache_dir.dir + "/" + name;
+		}
+		closedir(d);
+	}
+	BOOST_REQUIRE(!cache_path.empty());
+
+	std::vector<char> original;
+	if (FILE *f = fopen(cache_path.c_str(), "rb")) {
+		char buf[4096];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+			original.insert(original.end(), buf, buf + n);
+		fclose(f);
+	}
+
+	// Nodes are 64 bytes and follow a 64 byte header.  Within a node,
+	// parent_index is at byte 0, which_sibling at 6, and child_indices
+	// at 8.
+	const size_t node_count = (original.size() - 64) / 64;
+	BOOST_REQUIRE(node_count > 2);
+	auto field = [&](std::vector<char> &bytes, size_t node_i, size_t offset) {
+		return &bytes[64 + (node_i * 64) + offset];
+	};
+	uint32_t first_child;
+	std::memcpy(&first_child, field(original, 1, 8), sizeof(first_child));
+	BOOST_REQUIRE(first_child != 0);
+
+	const uint32_t self = 1;
+	const uint32_t last = node_count - 1;
+	const uint32_t root = 0;
+	const uint8_t sibling = 4;
+	const struct {
+		size_t offset;
+		const void *value;
+		size_t size;
+	} corruptions[] = {
+		{8, &self, sizeof(self)}, // Child is its own parent
+		{12, &root, sizeof(root)}, // Missing third child with non-empty bounds
+		{0, &last, sizeof(last)}, // Parent after its child
+		{6, &sibling, sizeof(sibling)}, // No fifth sibling
+	};
+
+	for (const auto &c: corruptions) {
+		std::vector<char> corrupt = original;
+		std::memcpy(field(corrupt, 1, c.offset), c.value, c.size);
+		FILE *f = fopen(cache_path.c_str(), "wb");
+		BOOST_REQUIRE(f != nullptr);
+		fwrite(corrupt.data(), 1, corrupt.size(), f);
+		fclose(f);
+
+		auto prims_2 = make_patches(3000, 31);
+		BVH4 bvh_2;
+		bvh_2.add_primitives(&prims_2);
+		bvh_2.finalize();
+		BOOST_CHECK(!bvh_2.from_cache());
+		BOOST_CHECK(is_complete(bvh_2, prims_2));
+	}
+}
+
+// Test that a slightly animated frame is refit, and still finds
+// everything
+BOOST_AUTO_TEST_CASE(refit_1)
+{
+	auto prims_1 = make_patches(5000, 31);
+	auto prims_2 = make_patches(5000, 31, 0.01f);
+
+	BVH4 bvh_1;
+	bvh_1.keep_topology();
+	bvh_1.add_primitives(&prims_1);
+	bvh_1.finalize();
+	BOOST_REQUIRE(bvh_1.topology() != nullptr);
+	BOOST_CHECK(!bvh_1.refitted());
+
+	BVH4 bvh_2;
+	bvh_2.refit_from(bvh_1.topology());
+	bvh_2.keep_topology();
+	bvh_2.add_primitives(&prims_2);
+	bvh_2.finalize();
+	BOOST_CHECK(bvh_2.refitted());
+	BOOST_CHECK(is_complete(bvh_2, prims_2));
+
+	// The topology of a refit BVH carries on the cost of the original
+	// build, so that degradation accumulates across frames
+	BOOST_CHECK_EQUAL(bvh_2.topology()->built_sah_cost, bvh_1.topology()->built_sah_cost);
+}
+
+// Test that frames whose primitives changed too much, or in number, are
+// rebuilt instead of refit
+BOOST_AUTO_TEST_CASE(refit_2)
+{
+	auto prims_1 = make_patches(5000, 31);
+	auto prims_2 = make_patches(5000, 37);
+	auto prims_3 = make_patches(4999, 31);
+
+	BVH4 bvh_1;
+	bvh_1.keep_topology();
+	bvh_1.add_primitives(&prims_1);
+	bvh_1.finalize();
+
+	BOOST_REQUIRE(bvh_1.topology() != nullptr);
+
+	BVH4 bvh_2;
+	bvh_2.refit_from(bvh_1.topology());
+	bvh_2.add_primitives(&prims_2);
+	bvh_2.finalize();
+	BOOST_CHECK(!bvh_2.refitted());
+	BOOST_CHECK(is_complete(bvh_2, prims_2));
+
+	BVH4 bvh_3;
+	bvh_3.refit_from(bvh_1.topology());
+	bvh_3.add_primitives(&prims_3);
+	bvh_3.finalize();
+	BOOST_CHECK(!bvh_3.refitted());
+	BOOST_CHECK(is_complete(bvh_3, prims_3));
+}
+
+// Test that the topology is only kept when asked for, and that a BVH
+// refit without keeping its own topology doesn't keep one either
+BOOST_AUTO_TEST_CASE(refit_3)
+{
+	auto prims_1 = make_patches(5000, 31);
+	auto prims_2 = make_patches(5000, 31, 0.01f);
+
+	BVH4 bvh_0;
+	bvh_0.add_primitives(&prims_1);
+	bvh_0.finalize();
+	BOOST_CHECK(bvh_0.topology() == nullptr);
+
+	BVH4 bvh_1;
+	bvh_1.keep_topology();
+	bvh_1.add_primitives(&prims_1);
+	bvh_1.finalize();
+	BOOST_REQUIRE(bvh_1.topology() != nullptr);
+
+	BVH4 bvh_2;
+	bvh_2.refit_from(bvh_1.topology());
+	bvh_2.add_primitives(&prims_2);
+	bvh_2.finalize();
+	BOOST_CHECK(bvh_2.refitted());
+	BOOST_CHECK(bvh_2.topology() == nullptr);
+}
+
+// Test that tracing a batch of rays with interleaved traversals finds
+// exactly what tracing each ray on its own does, in the same order, for
+// various numbers of traversals in flight
+BOOST_AUTO_TEST_CASE(batch_traversal_1)
+{
+	const float interleaved_size = Config::interleaved_traversal_size;
+	const uint32_t interleaved_width = Config::interleaved_traversal_width;
+	Config::interleaved_traversal_size = 0.0f;
+
+	auto prims = make_patches(5000, 37);
+	BVH4 bvh;
+	bvh.add_primitives(&prims);
+	bvh.finalize();
+
+	const auto rays = make_rays(500, 41);
+	std::vector<std::vector<size_t>> expected;
+	for (const auto &ray: rays)
+		expected.push_back(all_potential_intersections(bvh, ray));
+
+	for (uint32_t width: {1u, 3u, 16u, 32u, 100u}) {
+		Config::interleaved_traversal_width = width;
+		BOOST_CHECK(all_potential_intersections_batch(bvh, rays) == expected);
+	}
+
+	Config::interleaved_traversal_size = interleaved_size;
+	Config::interleaved_traversal_width = interleaved_width;
+}
+
+// Compares build time, SAH cost, and traversal time of the two build
+// methods.  Doesn't test anything, just reports, so it's disabled by
+// default.  Run it with --run_test=bvh4/benchmark_1.
+BOOST_AUTO_TEST_CASE(benchmark_1, * boost::unit_test::disabled())
+{
+	const auto rays = make_rays(20000, 11);
+
+	for (auto method: {BVH4::BuildMethod::MIDPOINT, BVH4::BuildMethod::SAH}) {
+		auto prims = make_patches(200000, 13);
+
+		BVH4 bvh(method);
+		bvh.add_primitives(&prims);
+		Timer<> timer;
+		bvh.finalize();
+		const float build_time = timer.time();
+
+		// Best of several runs, to filter out noise
+		size_t potential_count = 0;
+		float trace_time = std::numeric_limits<float>::infinity();
+		for (int run = 0; run < 5; ++run) {
+			timer.reset();
+			potential_count = 0;
+			for (const auto &ray: rays)
+				potential_count += all_potential_intersections(bvh, ray).size();
+			trace_time = std::min(trace_time, timer.time());
+		}
+
+		std::cout << "BVH4 " << (method == BVH4::BuildMethod::SAH ? "SAH" : "midpoint")
+		          << " build: " << build_time << "s"
+		          << "  sah_cost: " << bvh.sah_cost()
+		          << "  traversal: " << trace_time << "s"
+		          << "  potential intersections: " << potential_count << std::endl;
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END();
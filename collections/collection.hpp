@@ -69,15 +69,71 @@ public:
 	 * The number of results is bounded by max_potential.
 	 *
 	 * @param ray The ray.
+	 * @param tmax Primitives whose bounds the ray enters beyond this distance
+	 *             are skipped, typically because the ray already has a closer hit.
 	 * @param max_potential The maximum number of results.
 	 * @param ids Output parameter, should be an array of ids at least as large as max_potential.
+	 * @param ts Output parameter, same size as ids.  Receives the distance at which
+	 *           the ray enters each result's bounds.  Collections that can't cheaply
+	 *           compute that may give a smaller (conservative) distance.
 	 * @param state Input/output parameter.  Should point to memory large enough to store the traversal
 	                state of the ray.  nullptr just gets the first N potentially
 	 *                intersecting primitives.  Array values of all zeros starts as default.
 	 *
 	 * @returns The number of results acquired.  If zero, that means there were no potential intersections.
 	 */
-	virtual uint get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, void *state) = 0;
+	virtual uint get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, float *ts, void *state) = 0;
+
+	/**
+	 * Same as get_potential_intersections(), but for a batch of rays,
+	 * which needn't be coherent at all.  Collections can use this to
+	 * keep many traversals in flight at once, overlapping their memory
+	 * latency, but the results must be the same as tracing each ray on
+	 * its own.  The default just does that.
+	 *
+	 * @param ray_count The number of rays.
+	 * @param rays The rays.
+	 * @param tmaxes The tmax of each ray.
+	 * @param ids Output parameter, max_potential ids per ray, one ray after another.
+	 * @param ts Output parameter, laid out the same as ids.
+	 * @param counts Output parameter, the number of results of each ray.
+	 * @param states The traversal state of each ray.
+	 * @param treelet_bound If true, each ray's traversal also stops when
+	 *                      it's about to leave its current treelet (see
+	 *                      treelet_count()), even if that means it
+	 *                      gets no results.  Use ray_treelet() to tell
+	 *                      that apart from the ray being finished.
+	 */
+	virtual void get_potential_intersections_batch(uint ray_count, const Ray *const rays[], const float tmaxes[], uint max_potential, size_t *ids, float *ts, uint *counts, void *const states[], bool treelet_bound) {
+		for (uint i = 0; i < ray_count; ++i)
+			counts[i] = get_potential_intersections(*(rays[i]), tmaxes[i], max_potential, ids + (i * max_potential), ts + (i * max_potential), states[i]);
+	}
+
+	/**
+	 * Returned by ray_treelet() for rays whose traversal is finished.
+	 */
+	static constexpr uint NO_TREELET = ~0u;
+
+	/**
+	 * Returns the number of treelets the collection is partitioned into.
+	 *
+	 * A treelet is a part of the collection's acceleration structure,
+	 * along with the primitives it contains.  Tracing all the rays that
+	 * are in the same treelet together keeps the data they need in
+	 * cache.  Collections that aren't partitioned have a single treelet.
+	 */
+	virtual uint treelet_count() const {
+		return 1;
+	}
+
+	/**
+	 * Returns the treelet that a ray's traversal continues in next, given
+	 * its traversal state, or NO_TREELET if its traversal is finished.
+	 * Only meaningful for collections with more than one treelet.
+	 */
+	virtual uint ray_treelet(const void *state) const {
+		return 0;
+	}
 
 
 
@@ -51,7 +51,7 @@ BBoxT &PrimArray::bounds()
 	return bbox;
 }
 
-uint PrimArray::get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, void *state)
+uint PrimArray::get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, float *ts, void *state)
 {
 	const uint32_t size = children.size();
 	float tnear, tfar;
@@ -71,6 +71,7 @@ uint PrimArray::get_potential_intersections(const Ray &ray, float tmax, uint max
 	for (; i < size && hits_so_far < max_potential; i++) {
 		if (children[i]->bounds().intersect_ray(ray, &tnear, &tfar) && tnear < tmax) {
 			ids[hits_so_far] = i;
+			ts[hits_so_far] = tnear;
 			hits_so_far++;
 		}
 	}
@@ -26,7 +26,7 @@ public:
 	virtual void add_primitives(std::vector<std::unique_ptr<Primitive>>* primitives);
 	virtual bool finalize();
 	virtual size_t max_primitive_id() const;
-	virtual uint get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, void *state);
+	virtual uint get_potential_intersections(const Ray &ray, float tmax, uint max_potential, size_t *ids, float *ts, void *state);
 	virtual Primitive &get_primitive(size_t id);
 	virtual size_t size() {
 		return children.size();
@@ -9,6 +9,16 @@ float dice_rate = 0.5; // 0.7 is about half pixel area
 float min_upoly_size = 0.001; // Approximate minimum micropolygon size in world space
 uint8_t max_grid_size = 64;
 float grid_cache_size = 256.0; // In MB
+float split_cache_size = 32.0; // In MB
+float slab_pool_size = 32.0; // In MB, per pool, max freed MicroSurface and Grid storage kept around for reuse
+bool reorder_rays = true; // Sort bounce and shadow rays into a more coherent order before tracing them
+float interleaved_traversal_size = 32.0; // In MB, BVH4s larger than this interleave the traversal of rays to hide memory latency
+uint32_t interleaved_traversal_width = 16; // Number of rays whose traversals are interleaved at once, when interleaving, at most 32
+uint32_t treelet_size = 0; // Max primitives per BVH4 treelet when tracing rays treelet by treelet, 0 disables it
+bool bvh_sah_build = true; // Build BVH4s with the binned surface area heuristic, rather than splitting at centroid midpoints
+std::string bvh_cache_dir = ""; // Directory to cache built BVH4s in, keyed by a hash of their primitives' bounds, empty disables it
+float bvh_refit_max_sah_growth = 1.25; // Refit each frame's BVH4 to the previous frame's tree unless its SAH cost grows past this multiple of its cost when built, 0 disables refitting
+float presplit_max_area = 1.0 / 1024.0; // Split diceable primitives before building the BVH4 until their bounds' surface area is at most this fraction of the scene's, 0 disables it
 
 int samples_per_bucket = 1 << 18; // The number of samples to aim to take per-bucket (used in auto-sizing buckets)
 
@@ -3,6 +3,8 @@
 
 #include "numtype.h"
 
+#include <string>
+
 namespace Config
 {
 extern bool no_output;
@@ -10,6 +12,16 @@ extern float dice_rate;
 extern float min_upoly_size;
 extern uint8_t max_grid_size;
 extern float grid_cache_size;
+extern float split_cache_size;
+extern float slab_pool_size;
+extern bool reorder_rays;
+extern float interleaved_traversal_size;
+extern uint32_t interleaved_traversal_width;
+extern uint32_t treelet_size;
+extern bool bvh_sah_build;
+extern std::string bvh_cache_dir;
+extern float bvh_refit_max_sah_growth;
+extern float presplit_max_area;
 
 extern int samples_per_bucket;
 
@@ -16,6 +16,8 @@ std::atomic<uint64_t> microelement_count(0);
 std::atomic<uint64_t> microelement_min_count(99999999999999);
 std::atomic<uint64_t> microelement_max_count(0);
 std::atomic<uint64_t> cache_misses(0);
+std::atomic<uint64_t> cache_hits(0);
+std::atomic<uint64_t> ancestor_cache_hits(0);
 std::atomic<size_t> primitive_ray_tests(0);
 std::atomic<size_t> top_level_bvh_node_tests(0);
 
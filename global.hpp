@@ -19,6 +19,8 @@ extern std::atomic<uint64_t> microelement_count;
 extern std::atomic<uint64_t> microelement_min_count;
 extern std::atomic<uint64_t> microelement_max_count;
 extern std::atomic<uint64_t> cache_misses;
+extern std::atomic<uint64_t> cache_hits;
+extern std::atomic<uint64_t> ancestor_cache_hits;
 extern std::atomic<size_t> primitive_ray_tests;
 extern std::atomic<size_t> top_level_bvh_node_tests;
 
@@ -34,6 +36,8 @@ static void clear()
 	microelement_min_count = 99999999999999;
 	microelement_max_count = 0;
 	cache_misses = 0;
+	cache_hits = 0;
+	ancestor_cache_hits = 0;
 	primitive_ray_tests = 0;
 	top_level_bvh_node_tests = 0;
 
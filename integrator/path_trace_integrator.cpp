@@ -114,6 +114,7 @@ void PathTraceIntegrator::render_blocks()
 	// Ray and Intersection arrays
 	Array<Ray> rays;
 	Array<Intersection> intersections;
+	Array<uint8_t> occlusions; // Results of the shadow rays
 
 	// ids corresponding to the rays
 	Array<uint32_t> ids;
@@ -158,6 +159,10 @@ void PathTraceIntegrator::render_blocks()
 
 			int32_t so = path_n * 5; // Sample offset
 
+			// Camera rays are already coherent in sample order, but
+			// the bounces after them aren't
+			tracer.reorder_rays = Config::reorder_rays && (path_n > 0);
+
 			// Create path rays
 			//std::cout << "\tGenerating path rays" << std::endl;
 			if (path_n == 0) {
@@ -293,14 +298,14 @@ void PathTraceIntegrator::render_blocks()
 
 
 				// Trace the shadow rays
-				intersections.resize(rays.size());
-				tracer.trace(Slice<Ray>(rays), Slice<Intersection>(intersections));
+				occlusions.resize(rays.size());
+				tracer.occluded(Slice<Ray>(rays), Slice<uint8_t>(occlusions));
 
 
 				// Calculate sample colors
 				for (uint32_t i = 0; i < rays.size(); i++) {
 					const uint32_t id = ids[i];
-					if (!intersections[i].hit) {
+					if (!occlusions[i]) {
 						// Sample was lit
 						// TODO: use actual shaders here
 						float lam = 0.0f;
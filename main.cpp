@@ -143,6 +143,7 @@ int main(int argc, char **argv)
 	("output,o", BPO::value<std::string>(), "The PNG file to render to")
 	("nooutput,n", "Don't save render (for timing tests)")
 	("resolution,r", BPO::value<Resolution>()->multitoken(), "The resolution to render at, e.g. 1280 720")
+	("bvhcache", BPO::value<std::string>(), "Directory to cache built BVHs in, for faster startup on later runs")
 	;
 
 	// Collect them
@@ -193,6 +194,12 @@ int main(int argc, char **argv)
 		std::cout << "Resolution: " << resolution.x << " " << resolution.y << "\n";
 	}
 
+	// BVH cache directory
+	if (vm.count("bvhcache")) {
+		Config::bvh_cache_dir = vm["bvhcache"].as<std::string>();
+		std::cout << "BVH cache: " << Config::bvh_cache_dir << "\n";
+	}
+
 	std::cout << std::endl;
 
 
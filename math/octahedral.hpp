@@ -0,0 +1,118 @@
+/*
+ * Octahedral encoding of unit vectors.
+ *
+ * A unit vector is projected onto the octahedron |x|+|y|+|z| = 1, and
+ * the lower half of the octahedron is folded out over the upper half, so
+ * that it can be stored as two coordinates in the unit square.  Here
+ * they are stored as two 16 bit signed normalized integers, packed into
+ * a single 32 bit value.
+ *
+ * The angle between a decoded vector and the original is less than
+ * 0.0001 radians.
+ */
+
+#ifndef OCTAHEDRAL_HPP
+#define OCTAHEDRAL_HPP
+
+#include "numtype.h"
+
+#include <cmath>
+#include <x86intrin.h>
+
+#include "vector.hpp"
+#include "simd.hpp"
+
+namespace Octahedral
+{
+
+/**
+ * @brief Encodes a vector into a 32 bit octahedral representation.
+ *
+ * The vector doesn't need to be normalized, but it must not be zero
+ * length.
+ */
+static inline uint32_t encode(const Vec3 &v)
+{
+	const float inv_l1 = 1.0f / (std::abs(v.x) + std::abs(v.y) + std::abs(v.z));
+	float x = v.x * inv_l1;
+	float y = v.y * inv_l1;
+
+	// Fold the lower half over the upper half
+	if (v.z < 0.0f) {
+		const float fx = (1.0f - std::abs(y)) * (x < 0.0f ? -1.0f : 1.0f);
+		const float fy = (1.0f - std::abs(x)) * (y < 0.0f ? -1.0f : 1.0f);
+		x = fx;
+		y = fy;
+	}
+
+	// Round to nearest
+	const int16_t qx = (x * 32767.0f) + (x < 0.0f ? -0.5f : 0.5f);
+	const int16_t qy = (y * 32767.0f) + (y < 0.0f ? -0.5f : 0.5f);
+	return (uint32_t)(uint16_t)qx | ((uint32_t)(uint16_t)qy << 16);
+}
+
+/**
+ * @brief Encodes four vectors at once, given as the x, y and z components
+ * of each.
+ *
+ * The results are identical to encode() on each vector.
+ */
+static inline void encode4(const SIMD::float4 &x, const SIMD::float4 &y, const SIMD::float4 &z, uint32_t out[4])
+{
+	using namespace SIMD;
+	const __m128 sign_bit = _mm_set1_ps(-0.0f);
+	const float4 one(1.0f);
+	const float4 zero(0.0f);
+
+	const float4 ax = _mm_andnot_ps(sign_bit, x.data);
+	const float4 ay = _mm_andnot_ps(sign_bit, y.data);
+	const float4 az = _mm_andnot_ps(sign_bit, z.data);
+	const float4 inv_l1 = one / (ax + ay + az);
+	float4 px = x * inv_l1;
+	float4 py = y * inv_l1;
+
+	// Fold the lower half over the upper half.  Negative lanes get their
+	// sign bit set in +/-1.0 and +/-0.5.
+	const __m128 sign_x = _mm_and_ps(lt(px, zero).data, sign_bit);
+	const __m128 sign_y = _mm_and_ps(lt(py, zero).data, sign_bit);
+	const float4 fx = (one - float4(_mm_andnot_ps(sign_bit, py.data))) * float4(_mm_or_ps(one.data, sign_x));
+	const float4 fy = (one - float4(_mm_andnot_ps(sign_bit, px.data))) * float4(_mm_or_ps(one.data, sign_y));
+	const __m128 fold = lt(z, zero).data;
+	px = _mm_or_ps(_mm_and_ps(fold, fx.data), _mm_andnot_ps(fold, px.data));
+	py = _mm_or_ps(_mm_and_ps(fold, fy.data), _mm_andnot_ps(fold, py.data));
+
+	// Round to nearest
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 round_x = _mm_or_ps(half, _mm_and_ps(lt(px, zero).data, sign_bit));
+	const __m128 round_y = _mm_or_ps(half, _mm_and_ps(lt(py, zero).data, sign_bit));
+	const __m128i qx = _mm_cvttps_epi32(_mm_add_ps((px * 32767.0f).data, round_x));
+	const __m128i qy = _mm_cvttps_epi32(_mm_add_ps((py * 32767.0f).data, round_y));
+
+	const __m128i packed = _mm_or_si128(_mm_and_si128(qx, _mm_set1_epi32(0xffff)), _mm_slli_epi32(qy, 16));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out), packed);
+}
+
+/**
+ * @brief Decodes a 32 bit octahedral representation into a normalized
+ * vector.
+ */
+static inline Vec3 decode(const uint32_t e)
+{
+	float x = (int16_t)(e & 0xffff) * (1.0f / 32767.0f);
+	float y = (int16_t)(e >> 16) * (1.0f / 32767.0f);
+	const float z = 1.0f - std::abs(x) - std::abs(y);
+
+	// Unfold the lower half
+	if (z < 0.0f) {
+		const float ux = (1.0f - std::abs(y)) * (x < 0.0f ? -1.0f : 1.0f);
+		const float uy = (1.0f - std::abs(x)) * (y < 0.0f ? -1.0f : 1.0f);
+		x = ux;
+		y = uy;
+	}
+
+	return Vec3(x, y, z).normalized();
+}
+
+} // namespace Octahedral
+
+#endif // OCTAHEDRAL_HPP
@@ -0,0 +1,71 @@
+#include "test.hpp"
+
+#include <cmath>
+#include "numtype.h"
+#include "vector.hpp"
+#include "rng.hpp"
+#include "simd.hpp"
+#include "octahedral.hpp"
+
+/*
+ * Test suite for the octahedral vector encoding.
+ */
+BOOST_AUTO_TEST_SUITE(octahedral);
+
+// Test that the axes survive the round trip exactly
+BOOST_AUTO_TEST_CASE(axes_1)
+{
+	const Vec3 axes[6] = {Vec3(1, 0, 0), Vec3(-1, 0, 0),
+	                      Vec3(0, 1, 0), Vec3(0, -1, 0),
+	                      Vec3(0, 0, 1), Vec3(0, 0, -1)
+	                     };
+
+	for (int i = 0; i < 6; ++i) {
+		const Vec3 v = Octahedral::decode(Octahedral::encode(axes[i]));
+		BOOST_CHECK_EQUAL(v.x, axes[i].x);
+		BOOST_CHECK_EQUAL(v.y, axes[i].y);
+		BOOST_CHECK_EQUAL(v.z, axes[i].z);
+	}
+}
+
+// Test that decoded vectors are within the documented error bound
+BOOST_AUTO_TEST_CASE(error_bound_1)
+{
+	RNG rng(42);
+	float max_angle = 0.0f;
+
+	for (int i = 0; i < 100000; ++i) {
+		const Vec3 v = Vec3(rng.next_float_c(), rng.next_float_c(), rng.next_float_c()).normalized();
+		const Vec3 v2 = Octahedral::decode(Octahedral::encode(v));
+		const float angle = std::asin(std::min(1.0f, cross(v, v2).length()));
+		max_angle = std::max(max_angle, angle);
+	}
+
+	BOOST_CHECK_LT(max_angle, 0.0001f);
+}
+
+// Test that encoding four vectors at once matches encoding them one
+// at a time
+BOOST_AUTO_TEST_CASE(encode4_1)
+{
+	RNG rng(7);
+	bool same = true;
+
+	for (int i = 0; i < 10000; ++i) {
+		Vec3 v[4];
+		for (int j = 0; j < 4; ++j)
+			v[j] = Vec3(rng.next_float_c(), rng.next_float_c(), rng.next_float_c()) * (rng.next_float() * 10.0f + 0.1f);
+
+		uint32_t e[4];
+		Octahedral::encode4(SIMD::float4(v[0].x, v[1].x, v[2].x, v[3].x),
+		                    SIMD::float4(v[0].y, v[1].y, v[2].y, v[3].y),
+		                    SIMD::float4(v[0].z, v[1].z, v[2].z, v[3].z),
+		                    e);
+		for (int j = 0; j < 4; ++j)
+			same = same && (e[j] == Octahedral::encode(v[j]));
+	}
+
+	BOOST_CHECK(same);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
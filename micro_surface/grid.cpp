@@ -1,68 +1,44 @@
 #include "numtype.h"
 
+#include <algorithm>
+
+#include "config.hpp"
 #include "grid.hpp"
 
 
-bool Grid::calc_normals(Vec3 *normals)
+static size_t vert_block_size(uint32_t level, uint32_t time_count)
 {
-	Vec3 p(0,0,0);
-	Vec3 vec[4] = {Vec3(0,0,0), Vec3(0,0,0), Vec3(0,0,0), Vec3(0,0,0)};
-	bool v_avail[4] = {false, false, false, false};
-	Vec3 n[4] = {Vec3(0,0,0), Vec3(0,0,0), Vec3(0,0,0), Vec3(0,0,0)};
-	bool n_avail[4] = {false, false, false, false};
+	const size_t res = (size_t(1) << level) + 1;
+	return res * res * time_count * sizeof(Vec3);
+}
 
-	size_t upoly_i;
-	size_t i2, n_count = 0;
+SlabPool &Grid::pool()
+{
+	// Never destroyed, so that grids can still be freed during static
+	// destruction
+	static SlabPool *pool = new SlabPool(vert_block_size, Config::slab_pool_size * (1000*1000));
+	return *pool;
+}
 
+
+bool Grid::calc_normals(Vec3 *normals)
+{
+	// The normal at each vertex is the sum of the normals of the (up to
+	// four) triangles fanning around it between its neighbors.  That sum
+	// works out to the cross product of the differences between opposite
+	// neighbors.  On the edges of the grid, the missing neighbors are
+	// replaced by the vertex itself, which leaves exactly the triangles
+	// that exist.
 	for (int32_t v=0; v < res_v; v++) {
+		const int32_t v_prev = std::max(v - 1, 0);
+		const int32_t v_next = std::min(v + 1, res_v - 1);
 		for (int32_t u=0; u < res_u; u++) {
+			const int32_t u_prev = std::max(u - 1, 0);
+			const int32_t u_next = std::min(u + 1, res_u - 1);
 			for (size_t time=0; time < time_count; time++) {
-				upoly_i = (v * res_u) + u;
-
-				// Get the center point
-				p = verts[(upoly_i)*time_count+time];
-
-				// Get the four vectors out from it (or whatever subset exist)
-				if (u < (res_u-1)) {
-					vec[0] = verts[(upoly_i + 1)*time_count+time] - p;
-					v_avail[0] = true;
-				}
-
-				if (v < (res_v-1)) {
-					vec[1] = verts[(upoly_i + res_u)*time_count+time] - p;
-					v_avail[1] = true;
-				}
-
-				if (u > 0) {
-					vec[2] = verts[(upoly_i - 1)*time_count+time] - p;
-					v_avail[2] = true;
-				}
-
-				if (v > 0) {
-					vec[3] = verts[(upoly_i - res_u)*time_count+time] - p;
-					v_avail[3] = true;
-				}
-
-				// Calculate the normals
-				for (size_t i=0; i < 4; i++) {
-					i2 = (i + 1) % 4;
-
-					if (v_avail[i] && v_avail[i2]) {
-						n[i] = cross(vec[i], vec[i2]);
-						n_avail[i] = true;
-						n_count++;
-					}
-				}
-
-				// Average the normals
-				normals[upoly_i*time_count+time] = Vec3(0,0,0);
-				for (size_t i=0; i < 4; i++) {
-					if (n_avail[i])
-						normals[upoly_i*time_count+time] = normals[upoly_i*time_count+time] + n[i];
-				}
-
-				// Approximately normalize the normal
-				normals[upoly_i*time_count+time].normalize();
+				const Vec3 du = verts[((v * res_u) + u_next)*time_count+time] - verts[((v * res_u) + u_prev)*time_count+time];
+				const Vec3 dv = verts[((v_next * res_u) + u)*time_count+time] - verts[((v_prev * res_u) + u)*time_count+time];
+				normals[((v * res_u) + u)*time_count+time] = cross(du, dv).normalized();
 			}
 		}
 	}
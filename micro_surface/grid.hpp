@@ -1,10 +1,12 @@
 #ifndef GRID_HPP
 #define GRID_HPP
 
-#include <vector>
+#include <cassert>
+#include <algorithm>
 
 #include "numtype.h"
 #include "vector.hpp"
+#include "slab_pool.hpp"
 
 
 /*
@@ -16,20 +18,65 @@ struct Grid {
 	uint16_t time_count;
 
 	// Data
-	std::vector<Vec3> verts; // v1_t1, v1_t2, v1_t3, v2_t1, v2_t2, v2_t3...
+	Vec3 *verts {nullptr}; // v1_t1, v1_t2, v1_t3, v2_t1, v2_t2, v2_t3...
 	float u1, v1,
 	      u2, v2,
 	      u3, v3,
 	      u4, v4;
 	size_t face_id;
 
+	// Size class of the vertex storage in the pool
+	uint32_t pool_level {0};
+
+	/**
+	 * @brief The pool that grid vertex storage is allocated from.
+	 *
+	 * Size classes are keyed by the subdivision level of the smallest
+	 * square power-of-two grid that the grid fits in, and by the number
+	 * of time samples.
+	 */
+	static SlabPool &pool();
+
+	/**
+	 * @brief Returns the size class level of a grid of the given
+	 * resolution.
+	 */
+	static uint32_t size_level(uint16_t ru, uint16_t rv) {
+		uint32_t level = 0;
+		while ((size_t(1) << level) < size_t(std::max(ru, rv) - 1))
+			level++;
+		return level;
+	}
+
 	// Constructors
 	Grid() {}
+
+	/**
+	 * @brief Creates a grid of the given resolution and number of time
+	 * samples.  The vertices are left uninitialized.
+	 */
 	Grid(uint16_t ru, uint16_t rv, uint16_t tc):
-		res_u {ru}, res_v {rv}, time_count {tc}, verts(ru*rv*tc) {
+		res_u {ru}, res_v {rv}, time_count {tc}, pool_level {size_level(ru, rv)} {
 		assert(ru > 1);
 		assert(rv > 1);
 		assert(tc > 0);
+		verts = static_cast<Vec3*>(pool().alloc(pool_level, time_count));
+	}
+
+	Grid(const Grid&) = delete;
+	Grid& operator=(const Grid&) = delete;
+
+	Grid(Grid&& b):
+		res_u {b.res_u}, res_v {b.res_v}, time_count {b.time_count}, verts {b.verts},
+		u1 {b.u1}, v1 {b.v1}, u2 {b.u2}, v2 {b.v2},
+		u3 {b.u3}, v3 {b.v3}, u4 {b.u4}, v4 {b.v4},
+		face_id {b.face_id}, pool_level {b.pool_level} {
+		b.verts = nullptr;
+	}
+
+	~Grid() {
+		if (verts != nullptr)
+			pool().release(verts, pool_level, time_count);
 	}
 
 	// Convenience methods
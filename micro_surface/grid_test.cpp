@@ -0,0 +1,72 @@
+#include "test.hpp"
+
+#include <cmath>
+#include <vector>
+#include "numtype.h"
+#include "vector.hpp"
+#include "grid.hpp"
+
+
+// Makes a grid over [0,1]x[0,1] in x and y, with z given by f(x, y)
+template <typename F>
+static Grid make_grid(int ru, int rv, F f)
+{
+	Grid grid(ru, rv, 1);
+	for (int v = 0; v < rv; ++v) {
+		for (int u = 0; u < ru; ++u) {
+			const float x = u / float(ru - 1);
+			const float y = v / float(rv - 1);
+			grid.verts[(v * ru) + u] = Vec3(x, y, f(x, y));
+		}
+	}
+	return grid;
+}
+
+
+/*
+ * Test suite for Grid.
+ */
+BOOST_AUTO_TEST_SUITE(grid);
+
+// Test that every normal of a flat grid, including on the edges and
+// corners, is the plane's normal
+BOOST_AUTO_TEST_CASE(calc_normals_1)
+{
+	Grid grid = make_grid(9, 5, [](float x, float y) {
+		return 0.0f;
+	});
+	std::vector<Vec3> normals(9 * 5);
+	grid.calc_normals(normals.data());
+
+	for (const auto &n: normals) {
+		BOOST_CHECK_EQUAL(n.x, 0.0f);
+		BOOST_CHECK_EQUAL(n.y, 0.0f);
+		BOOST_CHECK_EQUAL(n.z, 1.0f);
+	}
+}
+
+// Test that the normals of a curved grid are close to the surface's
+// normals
+BOOST_AUTO_TEST_CASE(calc_normals_2)
+{
+	const int res = 33;
+	Grid grid = make_grid(res, res, [](float x, float y) {
+		return 0.5f * ((x * x) - (y * y));
+	});
+	std::vector<Vec3> normals(res * res);
+	grid.calc_normals(normals.data());
+
+	float min_dot = 1.0f;
+	for (int v = 0; v < res; ++v) {
+		for (int u = 0; u < res; ++u) {
+			const float x = u / float(res - 1);
+			const float y = v / float(res - 1);
+			const Vec3 expected = Vec3(-x, y, 1.0f).normalized();
+			min_dot = std::min(min_dot, dot(normals[(v * res) + u], expected));
+		}
+	}
+
+	BOOST_CHECK_GT(min_dot, 0.999f);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -2,225 +2,601 @@
 
 #include <iostream>
 #include <cmath>
+#include <limits>
+#include <algorithm>
+#include <x86intrin.h>
 
 #include "global.hpp"
 #include "config.hpp"
 
 #include "utils.hpp"
+#include "morton.hpp"
+#include "octahedral.hpp"
+
+uint32_t MicroSurface::max_level(float ray_width) const
+{
+	// Each level of the tree is two levels of a binary tree, so this
+	// stops at the first level at or below the depth a binary tree
+	// would stop at.
+	const uint32_t rdepth = 2 * std::max(0.0f, fasterlog2(root_width) - fasterlog2(ray_width*Config::dice_rate));
+	return std::min(depth, (rdepth + 1) / 2);
+}
+
+
+void MicroSurface::node_cells(size_t node, uint32_t level, size_t *u, size_t *v, size_t *du, size_t *dv) const
+{
+	// Index of the node within its level, which is its morton code
+	const size_t level_start = ((size_t(1) << (2 * level)) - 1) / 3;
+	uint32_t x, y;
+	Morton::d2xy(node - level_start, &x, &y);
+
+	const size_t size = size_t(1) << (depth - level);
+	*u = x * size;
+	*v = y * size;
+	*du = std::min(size, (res_u - 1) - *u);
+	*dv = std::min(size, (res_v - 1) - *v);
+}
 
-#define IS_LEAF    0b10000000
-#define DEPTH_MASK 0b01111111
+
+void MicroSurface::calc_uv(size_t u, size_t v, float *uv_u, float *uv_v) const
+{
+	const float alpha_u = u / (float)(res_u - 1);
+	const float alpha_v = v / (float)(res_v - 1);
+	*uv_u = lerp2d(alpha_u, alpha_v, uvs[0], uvs[2], uvs[4], uvs[6]);
+	*uv_v = lerp2d(alpha_u, alpha_v, uvs[1], uvs[3], uvs[5], uvs[7]);
+}
 
 
 bool MicroSurface::intersect_ray(const Ray &ray, float ray_width, Intersection *inter)
+{
+	Hit hit;
+	const float max_t = inter ? std::min(ray.max_t, inter->t) : ray.max_t;
+	if (!intersect_ray(ray, ray_width, max_t, &hit))
+		return false;
+
+	if (inter && !ray.is_shadow_ray)
+		calc_intersection(ray, hit, inter);
+
+	return true;
+}
+
+
+/*
+ * Returns a mask of which of a node's four children overlap the given
+ * sub-range.
+ *
+ * @param level The level of the children.
+ */
+static inline unsigned int range_mask(uint32_t node, uint32_t level, uint32_t depth, const MicroSurface::SubRange &range)
+{
+	// Position of the node within its level, and the size of its
+	// children, in cells
+	const uint32_t level_start = ((uint32_t(1) << (2 * (level - 1))) - 1) / 3;
+	uint32_t x, y;
+	Morton::d2xy(node - level_start, &x, &y);
+	const uint32_t size = uint32_t(1) << (depth - level);
+
+	// The sub-range, in cells
+	const uint32_t u_size = uint32_t(1) << (depth - range.u_splits);
+	const uint32_t v_size = uint32_t(1) << (depth - range.v_splits);
+	const uint32_t u1 = range.u_index * u_size;
+	const uint32_t v1 = range.v_index * v_size;
+	const uint32_t u2 = u1 + u_size;
+	const uint32_t v2 = v1 + v_size;
+
+	unsigned int mask = 0;
+	for (uint32_t i = 0; i < 4; ++i) {
+		const uint32_t cu = ((x * 2) + (i & 1)) * size;
+		const uint32_t cv = ((y * 2) + (i >> 1)) * size;
+		if (cu < u2 && (cu + size) > u1 && cv < v2 && (cv + size) > v1)
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+
+bool MicroSurface::intersect_ray(const Ray &ray, float ray_width, float max_t, Hit *hit_out) const
+{
+	return intersect_ray_impl<false>(ray, ray_width, max_t, SubRange(), hit_out);
+}
+
+
+bool MicroSurface::intersect_ray(const Ray &ray, float ray_width, float max_t, const SubRange &range, Hit *hit_out) const
+{
+	assert(subdivisions(range) >= 0);
+	return intersect_ray_impl<true>(ray, ray_width, max_t, range, hit_out);
+}
+
+
+template <bool RANGED>
+bool MicroSurface::intersect_ray_impl(const Ray &ray, float ray_width, float max_t, const SubRange &range, Hit *hit_out) const
 {
 	bool hit = false;
 	size_t hit_node = 0;
-	float hit_near = ray.max_t;
-	//float hit_far = ray.max_t;
-	float t = ray.max_t;
-	if (inter)
-		t = t < inter->t ? t : inter->t;
-
-	// Calculate the max depth the ray should traverse into the tree
-	const uint32_t rdepth = 2 * std::max(0.0f, fasterlog2(root_width) - fasterlog2(ray_width*Config::dice_rate));
+	uint32_t hit_level = 0;
+	BBox hit_bounds = root_bounds[0];
+	float t = max_t;
+
+	// Calculate the max level the ray should traverse into the tree.
+	// When limited to a sub-range, nodes above the sub-range's level
+	// cover cells outside of it, so those levels are never leaves.
+	uint32_t ray_max_level = max_level(ray_width);
+	const uint32_t range_level = range.max_splits();
+	if (RANGED)
+		ray_max_level = std::max(ray_max_level, range_level);
+
+	// Calculate time interpolation
+	uint32_t ti = 0;
+	float alpha = 0.0f;
+	const bool motion = calc_time_interp(time_count, ray.time, &ti, &alpha);
 
 	// Precalculated constants about the ray, for optimized BBox intersection
-	const Vec3 d_inv = ray.get_d_inverse();
+	const Vec3 d_inv_f = ray.get_d_inverse();
 	const auto d_sign = ray.get_d_sign();
+	const SIMD::float4 ray_o[3] = {ray.o[0], ray.o[1], ray.o[2]};
+	const SIMD::float4 d_inv[3] = {d_inv_f[0], d_inv_f[1], d_inv_f[2]};
 
 	assert(d_sign[0] < 2);
 	assert(d_sign[1] < 2);
 	assert(d_sign[2] < 2);
 
-// Switch between simple traversal vs fast traversal (simple = 1, fast = 0)
-#if 0
-	// Intersect with the MicroSurface
-	uint32_t todo[64];
-	size_t todo_offset = 0;
-	size_t node = 0;
-	float tnear = ray.max_t;
-	float tfar = ray.max_t;
-
-	while (true) {
-		if (intersect_node(node, ray, d_inv, d_sign, &tnear, &tfar, &t)) {
-			if (nodes[node].flags & IS_LEAF || (nodes[node].flags & DEPTH_MASK) >= rdepth) {
-				// Hit
-				hit = true;
-				hit_node = node;
-				t = tnear;
-				hit_near = tnear;
-				//hit_far = tfar;
-
-				// Early out for shadow rays
-				if (ray.is_shadow_ray)
-					break;
-
-				if (todo_offset == 0)
-					break;
-
-				node = todo[--todo_offset];
-			} else {
-				// Put far BVH node on todo stack, advance to near node
-				todo[todo_offset++] = nodes[node].child_index + time_count;
-				node = nodes[node].child_index;
-			}
-		} else {
-			if (todo_offset == 0)
-				break;
-
-			node = todo[--todo_offset];
+	if (ray_max_level == 0) {
+		// The ray is too wide to go into the tree at all, so the
+		// whole surface is a single element to it
+		const BBox b = motion ? lerp<BBox>(alpha, root_bounds[ti], root_bounds[ti+1]) : root_bounds[0];
+		float tnear, tfar;
+		if (b.intersect_ray(ray, d_inv_f, d_sign, &tnear, &tfar, &t)) {
+			hit = true;
+			t = tnear;
 		}
-	}
-#else
-	// Intersect with the MicroSurface
-	float tnear = 0.0f;
-	float tfar = ray.max_t;
-
-	// Working set
-	uint64_t todo[64];
-	float todo_t[64];
-	int32_t stackptr = 0;
-
-	// Test against the root node, and push it onto the stack
-	todo[stackptr] = 0;
-	if (intersect_node(todo[stackptr]*time_count, ray, d_inv, d_sign, &tnear, &tfar, &t)) {
-		todo_t[stackptr] = tnear;
+	} else {
+		// Working set
+		uint32_t todo[64];
+		uint32_t todo_level[64];
+		float todo_t[64];
+		int32_t stackptr = 0;
+		todo[0] = 0;
+		todo_level[0] = 0;
+		todo_t[0] = 0.0f;
+		ChildBounds child_bounds[MAX_DEPTH];
 
 		while (stackptr >= 0) {
-			// Pop off the next node to work on.
-			const int node_index = todo[stackptr];
+			// Pop off the next node to work on
+			const uint32_t node = todo[stackptr];
+			const uint32_t level = todo_level[stackptr] + 1; // Level of the node's children
 			const float near = todo_t[stackptr];
-			const MicroNode &node(nodes[node_index]);
 			stackptr--;
 
 			// If this node is further than the closest found intersection, continue
 			if (near > t)
 				continue;
 
-			// If it's a leaf, store intersection information
-			if (node.flags & IS_LEAF || (node.flags & DEPTH_MASK) >= rdepth) {
-				hit = true;
-				hit_node = node_index;
-				t = near;
-				hit_near = near;
+			// Test the ray against the node's children
+			SIMD::float4 near_hits;
+			const BBox4 &cb1 = decode_children(node, level - 1, motion, ti, child_bounds);
+			const BBox4 cb = motion ? lerp(alpha, cb1, child_bounds[level - 1].b[1]) : cb1;
+			unsigned int hit_mask = cb.intersect_ray(ray_o, d_inv, SIMD::float4(t), d_sign, &near_hits);
+			if (RANGED && level <= range_level)
+				hit_mask &= range_mask(node, level, depth, range);
+			if (hit_mask == 0)
+				continue;
+			const uint32_t first_child = (node * 4) + 1;
+
+			if (level >= ray_max_level) {
+				// The children are leaves as far as the ray is concerned,
+				// so store the nearest one hit
+				for (uint32_t i = 0; i < 4; ++i) {
+					if ((hit_mask & (1 << i)) && near_hits[i] < t) {
+						hit = true;
+						hit_node = first_child + i;
+						hit_level = level;
+						hit_bounds = cb1.get(i);
+						t = near_hits[i];
+					}
+				}
 
 				// Early out for shadow rays
-				if (ray.is_shadow_ray)
+				if (hit && ray.is_shadow_ray)
 					break;
-			} else { // Not a leaf
-				float hit_near1 = 0.0f; // Hit near 1
-				float hit_near2 = 0.0f; // Hit near 2
-				const bool hit1 = intersect_node(node.child_index, ray, d_inv, d_sign, &hit_near1, &tfar, &t);
-				const bool hit2 = intersect_node(node.child_index+time_count, ray, d_inv, d_sign, &hit_near2, &tfar, &t);
-
-				// Did we hit both nodes?
-				if (hit1 && hit2) {
-					if (hit_near1 < hit_near2) {
-						// Left child is nearer
-						// Push right first
-						todo[++stackptr] = node.child_index + time_count;
-						todo_t[stackptr] = hit_near2;
-
-						todo[++stackptr] = node.child_index;
-						todo_t[stackptr] = hit_near1;
-					} else {
-						// Right child is nearer
-						// Push left first
-						todo[++stackptr] = node.child_index;
-						todo_t[stackptr] = hit_near1;
-
-						todo[++stackptr] = node.child_index + time_count;
-						todo_t[stackptr] = hit_near2;
+			} else {
+				// Push the children that were hit from far to near, so
+				// that the nearest is worked on first
+				assert(stackptr + 4 < 64);
+				while (hit_mask != 0) {
+					uint32_t farthest = __builtin_ctz(hit_mask);
+					for (uint32_t i = farthest + 1; i < 4; ++i) {
+						if ((hit_mask & (1 << i)) && near_hits[i] > near_hits[farthest])
+							farthest = i;
 					}
-				} else if (hit1) {
-					todo[++stackptr] = node.child_index;
-					todo_t[stackptr] = hit_near1;
-				} else if (hit2) {
-					todo[++stackptr] = node.child_index + time_count;
-					todo_t[stackptr] = hit_near2;
+					hit_mask &= ~(1 << farthest);
+
+					todo[++stackptr] = first_child + farthest;
+					todo_level[stackptr] = level;
+					todo_t[stackptr] = near_hits[farthest];
 				}
 			}
 		}
 	}
-#endif
-
-	// Calculate intersection data
-	if (hit && !ray.is_shadow_ray) {
-		if (t >= inter->t)
-			return false;
-
-		// Calculate time indices and alpha
-		uint32_t t_i = 0;
-		float t_alpha = 0.0f;
-		calc_time_interp(time_count, ray.time, &t_i, &t_alpha);
-
-		// Calculate data indices
-		const uint d_iu = /*rng.next_uint()*/ 727 % nodes[hit_node].data_du;
-		const uint d_iv = /*rng.next_uint()*/ 727 % nodes[hit_node].data_dv;
-		const size_t d_index = nodes[hit_node].data_index; // Standard
-		const size_t rd_index = d_index + (d_iv * res_u) + d_iu; // Random within range
-
-		// Information about the intersection point
-		inter->t = hit_near;
-		inter->p = ray.o + (ray.d * hit_near);
-
-		// Data about the ray that caused the intersection
-		inter->in = ray.d;
-		inter->ow = ray.ow;
-		inter->dw = ray.dw;
-
-		// Surface normal
-		// TODO: differentials
-		const Vec3 n1t1 = normals[rd_index*time_count+t_i];
-		const Vec3 n2t1 = normals[(rd_index+1)*time_count+t_i];
-		const Vec3 n3t1 = normals[(rd_index+res_u)*time_count+t_i];
-		const Vec3 n4t1 = normals[(rd_index+res_u+1)*time_count+t_i];
-		//const Vec3 nt1 = lerp2d<Vec3>(rng.next_float(), rng.next_float(), n1t1, n2t1, n3t1, n4t1);
-		const Vec3 nt1 = lerp2d<Vec3>(0.5f, 0.5f, n1t1, n2t1, n3t1, n4t1);
-
-
-		if (time_count > 1) {
-			const Vec3 n1t2 = normals[rd_index*time_count+t_i+1];
-			const Vec3 n2t2 = normals[(rd_index+1)*time_count+t_i+1];
-			const Vec3 n3t2 = normals[(rd_index+res_u)*time_count+t_i+1];
-			const Vec3 n4t2 = normals[(rd_index+res_u+1)*time_count+t_i+1];
-			//const Vec3 nt2 = lerp2d<Vec3>(rng.next_float(), rng.next_float(), n1t2, n2t2, n3t2, n4t2);
-			const Vec3 nt2 = lerp2d<Vec3>(0.5f, 0.5f, n1t2, n2t2, n3t2, n4t2);
-
-
-			inter->n = lerp<Vec3>(t_alpha, nt1, nt2).normalized();
-		} else {
-			inter->n = nt1.normalized();
+
+	if (hit) {
+		hit_out->t = t;
+		hit_out->node = hit_node;
+		hit_out->level = hit_level;
+		hit_out->node_size = hit_bounds.diagonal();
+	}
+
+	return hit;
+}
+
+
+void MicroSurface::calc_intersection(const Ray &ray, const Hit &hit, Intersection *inter) const
+{
+	const float t = hit.t;
+
+	// Calculate time indices and alpha
+	uint32_t t_i = 0;
+	float t_alpha = 0.0f;
+	calc_time_interp(time_count, ray.time, &t_i, &t_alpha);
+
+	// Calculate data indices
+	size_t data_u, data_v, data_du, data_dv;
+	node_cells(hit.node, hit.level, &data_u, &data_v, &data_du, &data_dv);
+	const uint d_iu = /*rng.next_uint()*/ 727 % data_du;
+	const uint d_iv = /*rng.next_uint()*/ 727 % data_dv;
+	const size_t d_index = (data_v * res_u) + data_u; // Standard
+	const size_t rd_index = d_index + (d_iv * res_u) + d_iu; // Random within range
+
+	// Information about the intersection point
+	inter->t = t;
+	inter->p = ray.o + (ray.d * t);
+
+	// Data about the ray that caused the intersection
+	inter->in = ray.d;
+	inter->ow = ray.ow;
+	inter->dw = ray.dw;
+
+	// Surface normal
+	// TODO: differentials
+	const Vec3 n1t1 = Octahedral::decode(normals[rd_index*time_count+t_i]);
+	const Vec3 n2t1 = Octahedral::decode(normals[(rd_index+1)*time_count+t_i]);
+	const Vec3 n3t1 = Octahedral::decode(normals[(rd_index+res_u)*time_count+t_i]);
+	const Vec3 n4t1 = Octahedral::decode(normals[(rd_index+res_u+1)*time_count+t_i]);
+	//const Vec3 nt1 = lerp2d<Vec3>(rng.next_float(), rng.next_float(), n1t1, n2t1, n3t1, n4t1);
+	const Vec3 nt1 = lerp2d<Vec3>(0.5f, 0.5f, n1t1, n2t1, n3t1, n4t1);
+
+
+	if (time_count > 1) {
+		const Vec3 n1t2 = Octahedral::decode(normals[rd_index*time_count+t_i+1]);
+		const Vec3 n2t2 = Octahedral::decode(normals[(rd_index+1)*time_count+t_i+1]);
+		const Vec3 n3t2 = Octahedral::decode(normals[(rd_index+res_u)*time_count+t_i+1]);
+		const Vec3 n4t2 = Octahedral::decode(normals[(rd_index+res_u+1)*time_count+t_i+1]);
+		//const Vec3 nt2 = lerp2d<Vec3>(rng.next_float(), rng.next_float(), n1t2, n2t2, n3t2, n4t2);
+		const Vec3 nt2 = lerp2d<Vec3>(0.5f, 0.5f, n1t2, n2t2, n3t2, n4t2);
+
+
+		inter->n = lerp<Vec3>(t_alpha, nt1, nt2).normalized();
+	} else {
+		inter->n = nt1.normalized();
+	}
+
+
+	const float dl = std::max(ray.width(t) * Config::dice_rate * 1.5f, hit.node_size);
+	inter->offset = inter->n * dl * 1.0f; // Origin offset for next ray
+	inter->backfacing = dot(inter->n, ray.d.normalized()) > 0.0f; // Whether the hit was on the back of the surface
+	// UVs
+	// TODO: differentials and correct coordinates for texturing
+	calc_uv(data_u, data_v, &inter->u, &inter->v);
+
+	// Color
+	inter->col = Color(inter->u, inter->v, 0.0f);
+}
+
+
+bool MicroSurface::occluded(const Ray &ray, float ray_width) const
+{
+	return occluded_impl<false>(ray, ray_width, SubRange());
+}
+
+
+bool MicroSurface::occluded(const Ray &ray, float ray_width, const SubRange &range) const
+{
+	assert(subdivisions(range) >= 0);
+	return occluded_impl<true>(ray, ray_width, range);
+}
+
+
+template <bool RANGED>
+bool MicroSurface::occluded_impl(const Ray &ray, float ray_width, const SubRange &range) const
+{
+	// Calculate the max level the ray should traverse into the tree,
+	// which is at least the level of the sub-range, as in
+	// intersect_ray_impl()
+	uint32_t ray_max_level = max_level(ray_width);
+	const uint32_t range_level = range.max_splits();
+	if (RANGED)
+		ray_max_level = std::max(ray_max_level, range_level);
+
+	// Calculate time interpolation
+	uint32_t ti = 0;
+	float alpha = 0.0f;
+	const bool motion = calc_time_interp(time_count, ray.time, &ti, &alpha);
+
+	// Precalculated constants about the ray, for optimized BBox intersection
+	const Vec3 d_inv_f = ray.get_d_inverse();
+	const auto d_sign = ray.get_d_sign();
+	const SIMD::float4 ray_o[3] = {ray.o[0], ray.o[1], ray.o[2]};
+	const SIMD::float4 d_inv[3] = {d_inv_f[0], d_inv_f[1], d_inv_f[2]};
+	const SIMD::float4 max_t {ray.max_t};
+
+	if (ray_max_level == 0) {
+		const BBox b = motion ? lerp<BBox>(alpha, root_bounds[ti], root_bounds[ti+1]) : root_bounds[0];
+		float tnear, tfar;
+		return b.intersect_ray(ray, d_inv_f, d_sign, &tnear, &tfar);
+	}
+
+	// Working set.  Any hit will do, so there's no need to visit
+	// the nodes in front-to-back order.
+	uint32_t todo[64];
+	uint32_t todo_level[64];
+	int32_t stackptr = 0;
+	todo[0] = 0;
+	todo_level[0] = 0;
+	ChildBounds child_bounds[MAX_DEPTH];
+
+	while (stackptr >= 0) {
+		const uint32_t node = todo[stackptr];
+		const uint32_t level = todo_level[stackptr] + 1; // Level of the node's children
+		stackptr--;
+
+		SIMD::float4 near_hits;
+		const BBox4 &cb1 = decode_children(node, level - 1, motion, ti, child_bounds);
+		const BBox4 cb = motion ? lerp(alpha, cb1, child_bounds[level - 1].b[1]) : cb1;
+		unsigned int hit_mask = cb.intersect_ray(ray_o, d_inv, max_t, d_sign, &near_hits);
+		if (RANGED && level <= range_level)
+			hit_mask &= range_mask(node, level, depth, range);
+		if (hit_mask == 0)
+			continue;
+
+		// The ray hit a leaf, so it's occluded
+		if (level >= ray_max_level)
+			return true;
+
+		assert(stackptr + 4 < 64);
+		for (uint32_t i = 0; i < 4; ++i) {
+			if (hit_mask & (1 << i)) {
+				todo[++stackptr] = (node * 4) + 1 + i;
+				todo_level[stackptr] = level;
+			}
 		}
+	}
 
+	return false;
+}
 
-		const float dl = std::max(ray.width(t) * Config::dice_rate * 1.5f, nodes[hit_node].bounds.diagonal());
-		inter->offset = inter->n * dl * 1.0f; // Origin offset for next ray
-		inter->backfacing = dot(inter->n, ray.d.normalized()) > 0.0f; // Whether the hit was on the back of the surface
-		// UVs
-		// TODO: differentials and correct coordinates for texturing
-		inter->u = uvs[d_index*2];
-		inter->v = uvs[d_index*2+1];
 
-		// Color
-		inter->col = Color(inter->u, inter->v, 0.0f);
+// Layout of a MicroSurface's storage block: the nodes, then the root
+// bounds, then the normals, each starting on a 16 byte boundary.  The
+// normals get room for the largest grid that fits a tree of the given
+// depth.
+struct StorageLayout {
+	size_t root_bounds_offset;
+	size_t normals_offset;
+	size_t size;
+
+	StorageLayout(uint32_t depth, uint32_t time_count) {
+		const size_t side = size_t(1) << depth;
+		const size_t node_count = ((side * side) - 1) / 3;
+		root_bounds_offset = align16(sizeof(QBBox4) * node_count * time_count);
+		normals_offset = root_bounds_offset + align16(sizeof(BBox) * time_count);
+		size = normals_offset + align16(sizeof(uint32_t) * (side + 1) * (side + 1) * time_count);
 	}
 
-	return hit;
+	static size_t align16(size_t n) {
+		return (n + 15) & ~size_t(15);
+	}
+};
+
+static size_t storage_block_size(uint32_t depth, uint32_t time_count)
+{
+	return StorageLayout(depth, time_count).size;
 }
 
+SlabPool &MicroSurface::pool()
+{
+	// Never destroyed, so that MicroSurfaces still in the cache during
+	// static destruction can be freed
+	static SlabPool *pool = new SlabPool(storage_block_size, Config::slab_pool_size * (1000*1000));
+	return *pool;
+}
+
+void MicroSurface::release_storage()
+{
+	if (storage == nullptr)
+		return;
+
+	pool().release(storage, depth, time_count);
+	storage = nullptr;
+	nodes = nullptr;
+	root_bounds = nullptr;
+	normals = nullptr;
+}
 
-struct GridBVHBuildEntry {
-	bool first; // Used to tell if it's the first or second child.
-	size_t i;
 
-	size_t u_start, u_end;
-	size_t v_start, v_end;
+// Scratch space for building MicroSurfaces.  It's kept around between
+// builds, so that building a MicroSurface doesn't have to allocate
+// anything but the MicroSurface's own storage.
+struct BuildScratch {
+	std::vector<float> planes; // Grid vertices of one time sample, see GridPlanes
+	std::vector<BBox4> full_nodes; // Unquantized tree nodes
+	std::vector<BBox4> decoded; // Decoded child bounds of the nodes whose children are nodes
 };
+static thread_local BuildScratch build_scratch;
+
+
+// The x, y and z coordinates of a grid's vertices, each in its own
+// plane of rows.  Each row is padded with a copy of its first vertex
+// at index -1, and with copies of its last vertex after its end.
+struct GridPlanes {
+	float *data;
+	size_t row_count;
+	size_t row_stride;
+
+	float *row(size_t axis, size_t v) const {
+		return data + (((axis * row_count) + v) * row_stride) + 1;
+	}
+};
+
+
+static inline SIMD::float4 loadu(const float *p)
+{
+	return SIMD::float4(_mm_loadu_ps(p));
+}
+
+
+static inline SIMD::float4 select(const SIMD::float4 &mask, const SIMD::float4 &a, const SIMD::float4 &b)
+{
+	return SIMD::float4(_mm_or_ps(_mm_and_ps(mask.data, a.data), _mm_andnot_ps(mask.data, b.data)));
+}
+
+
+/*
+ * Computes the octahedral encoded normals of one time sample of a grid,
+ * four vertices at a time.
+ *
+ * The normal at each vertex is the sum of the normals of the (up to four)
+ * triangles fanning around it between its neighbors, which works out to
+ * the cross product of the differences between opposite neighbors.  The
+ * padding of the rows and clamping of the row indices stand in for the
+ * missing neighbors on the edges, the same as in Grid::calc_normals().
+ */
+static void calc_normals(const GridPlanes &planes, size_t res_u, size_t res_v, size_t time_count, size_t ti, uint32_t *normals)
+{
+	using SIMD::float4;
+
+	for (size_t v = 0; v < res_v; v++) {
+		const size_t v_prev = v > 0 ? v - 1 : 0;
+		const size_t v_next = std::min(v + 1, res_v - 1);
+		const float *r[3], *r_prev[3], *r_next[3];
+		for (size_t a = 0; a < 3; a++) {
+			r[a] = planes.row(a, v);
+			r_prev[a] = planes.row(a, v_prev);
+			r_next[a] = planes.row(a, v_next);
+		}
+
+		for (size_t u = 0; u < res_u; u += 4) {
+			float4 du[3], dv[3];
+			for (size_t a = 0; a < 3; a++) {
+				du[a] = loadu(r[a] + u + 1) - loadu(r[a] + u - 1);
+				dv[a] = loadu(r_next[a] + u) - loadu(r_prev[a] + u);
+			}
+			const float4 nx = (du[1] * dv[2]) - (du[2] * dv[1]);
+			const float4 ny = (du[2] * dv[0]) - (du[0] * dv[2]);
+			const float4 nz = (du[0] * dv[1]) - (du[1] * dv[0]);
+
+			uint32_t n[4];
+			Octahedral::encode4(nx, ny, nz, n);
+			const size_t lanes = std::min<size_t>(4, res_u - u);
+			for (size_t l = 0; l < lanes; l++)
+				normals[((v * res_u) + u + l) * time_count + ti] = n[l];
+		}
+	}
+}
+
+
+/*
+ * Computes the bounds of the children of the deepest tree nodes, i.e.
+ * of the grid cells, for one time sample.
+ *
+ * The cells are done four at a time along a row, for a pair of rows at
+ * once.  Each pair of rows makes a row of nodes, and the first and last
+ * two cells of each four make the children of two neighboring nodes.
+ * Cells outside the grid get inverted bounds that no ray can hit.
+ * They're finite rather than infinite, so that interpolating them for
+ * motion blur can't produce NaNs.
+ */
+static void calc_leaf_bounds(const GridPlanes &planes, size_t res_u, size_t res_v, uint32_t depth, size_t time_count, size_t ti, BBox4 *full_nodes)
+{
+	using SIMD::float4;
+
+	const size_t side = size_t(1) << depth;
+	const size_t first = ((side * side / 4) - 1) / 3;
+	const float4 big(std::numeric_limits<float>::max());
+	const float4 neg_big(-std::numeric_limits<float>::max());
+
+	for (size_t y = 0; y < (side / 2); y++) {
+		// The three rows of vertices around the two rows of cells.  Rows
+		// past the end of the grid are clamped to its last row, since
+		// the cells they make are outside anyway.
+		const float *rows[3][3];
+		for (size_t a = 0; a < 3; a++) {
+			for (size_t r = 0; r < 3; r++)
+				rows[a][r] = planes.row(a, std::min((y * 2) + r, res_v - 1));
+		}
+		const __m128 row1_outside = _mm_castsi128_ps(_mm_set1_epi32((y * 2) >= (res_v - 1) ? -1 : 0));
+		const __m128 row2_outside = _mm_castsi128_ps(_mm_set1_epi32(((y * 2) + 1) >= (res_v - 1) ? -1 : 0));
+
+		for (size_t u = 0; u < side; u += 4) {
+			const float4 u_outside = gte(float4(float(u), float(u + 1), float(u + 2), float(u + 3)), float4(float(res_u - 1)));
+			const float4 outside1 = _mm_or_ps(u_outside.data, row1_outside);
+			const float4 outside2 = _mm_or_ps(u_outside.data, row2_outside);
+
+			const size_t x = u / 2;
+			const bool has_node2 = (x + 1) < (side / 2);
+			BBox4 &node1 = full_nodes[(first + Morton::xy2d(x, y)) * time_count + ti];
+			BBox4 &node2 = full_nodes[(first + Morton::xy2d(has_node2 ? x + 1 : x, y)) * time_count + ti];
+
+			for (size_t a = 0; a < 3; a++) {
+				const float4 p1 = loadu(rows[a][0] + u);
+				const float4 p2 = loadu(rows[a][0] + u + 1);
+				const float4 p3 = loadu(rows[a][1] + u);
+				const float4 p4 = loadu(rows[a][1] + u + 1);
+				const float4 p5 = loadu(rows[a][2] + u);
+				const float4 p6 = loadu(rows[a][2] + u + 1);
+				const float4 mid_min = min(p3, p4);
+				const float4 mid_max = max(p3, p4);
+				const float4 min1 = select(outside1, big, min(min(p1, p2), mid_min));
+				const float4 max1 = select(outside1, neg_big, max(max(p1, p2), mid_max));
+				const float4 min2 = select(outside2, big, min(min(p5, p6), mid_min));
+				const float4 max2 = select(outside2, neg_big, max(max(p5, p6), mid_max));
+
+				// Node 2 is written first, so that node 1 wins when
+				// they're the same node
+				node2.bounds[a*2] = _mm_movehl_ps(min2.data, min1.data);
+				node2.bounds[a*2+1] = _mm_movehl_ps(max2.data, max1.data);
+				node1.bounds[a*2] = _mm_movelh_ps(min1.data, min2.data);
+				node1.bounds[a*2+1] = _mm_movelh_ps(max1.data, max2.data);
+			}
+		}
+	}
+}
+
+
+/*
+ * Merges each of four nodes' children's bounds, giving the bounds of
+ * the children of their parent node.
+ */
+static BBox4 merge_children(const BBox4 *children[4])
+{
+	BBox4 result;
+	for (size_t k = 0; k < 6; k++) {
+		__m128 c0 = children[0]->bounds[k].data;
+		__m128 c1 = children[1]->bounds[k].data;
+		__m128 c2 = children[2]->bounds[k].data;
+		__m128 c3 = children[3]->bounds[k].data;
+		_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+		if (k % 2 == 0)
+			result.bounds[k] = _mm_min_ps(_mm_min_ps(c0, c1), _mm_min_ps(c2, c3));
+		else
+			result.bounds[k] = _mm_max_ps(_mm_max_ps(c0, c1), _mm_max_ps(c2, c3));
+	}
+	return result;
+}
+
 
 void MicroSurface::init_from_grid(Grid *grid)
 {
+	release_storage();
+
 	time_count = grid->time_count;
 	res_u = grid->res_u;
 	res_v = grid->res_v;
@@ -237,9 +613,15 @@ void MicroSurface::init_from_grid(Grid *grid)
 	// Store face ID
 	face_id = grid->face_id;
 
-	// Calculate uvs
-	uvs.resize(grid->res_u * grid->res_v * 2);
-	grid->calc_uvs(&(uvs[0]));
+	// Store the corner uvs, which the rest are interpolated from
+	uvs[0] = grid->u1;
+	uvs[1] = grid->v1;
+	uvs[2] = grid->u2;
+	uvs[3] = grid->v2;
+	uvs[4] = grid->u3;
+	uvs[5] = grid->v3;
+	uvs[6] = grid->u4;
+	uvs[7] = grid->v4;
 
 	// Calculate displacements
 	// TODO: Use shaders for displacements
@@ -253,168 +635,96 @@ void MicroSurface::init_from_grid(Grid *grid)
 	}
 	*/
 
-	// Calculate surface normals
-	normals.resize(grid->res_u * grid->res_v * grid->time_count);
-	grid->calc_normals(&(normals[0]));
-
-	////////////////////////////////
-	// WIP: Build MicroSurface tree
-	size_t trav_count = 0;
-	uint8_t depth = 0; // For tracking the depth of each node
-
-	nodes.resize(grid->res_u * grid->res_v * grid->time_count * 2);
-	size_t next_node_i = time_count;
-
-	GridBVHBuildEntry todo[64];
-	// Prepare root todo item
-	todo[0].i = 0;
-	todo[0].u_start = 0;
-	todo[0].u_end = grid->res_u - 2;
-	todo[0].v_start = 0;
-	todo[0].v_end = grid->res_v - 2;
-
-	bool down = true; // Whether we're going up or down the stack
-	size_t i = 0;
-	while (true) {
-		trav_count++;
-		// Going down
-		if (down) {
-			// Clear flags
-			nodes[todo[i].i].flags = 0;
-			// Store the depth of the node
-			nodes[todo[i].i].flags = depth;
-
-			// Calculate data indices
-			nodes[todo[i].i].data_index = todo[i].v_start * res_u + todo[i].u_start;
-			nodes[todo[i].i].data_du = 1 + todo[i].u_end - todo[i].u_start;
-			nodes[todo[i].i].data_dv = 1 + todo[i].v_end - todo[i].v_start;
-
-			// If leaf
-			if (todo[i].u_start == todo[i].u_end && todo[i].v_start == todo[i].v_end) {
-				// Set flags
-				nodes[todo[i].i].flags |= IS_LEAF;
-
-				// Build bboxes
-				const size_t u = todo[i].u_start;
-				const size_t v = todo[i].v_start;
-				const size_t vert1_i = (v * grid->res_u + u) * time_count;
-				const size_t vert2_i = (v * grid->res_u + u + 1) * time_count;
-				const size_t vert3_i = ((v+1) * grid->res_u + u) * time_count;
-				const size_t vert4_i = ((v+1) * grid->res_u + u + 1) * time_count;
-
-				for (size_t ti = 0; ti < time_count; ti++) {
-					BBox bb;
-
-					// Min
-					bb.min =             grid->verts[vert1_i+ti];
-					bb.min = min(bb.min, grid->verts[vert2_i+ti]);
-					bb.min = min(bb.min, grid->verts[vert3_i+ti]);
-					bb.min = min(bb.min, grid->verts[vert4_i+ti]);
-
-					// Max
-					bb.max =             grid->verts[vert1_i+ti];
-					bb.max = max(bb.max, grid->verts[vert2_i+ti]);
-					bb.max = max(bb.max, grid->verts[vert3_i+ti]);
-					bb.max = max(bb.max, grid->verts[vert4_i+ti]);
-
-					nodes[todo[i].i+ti].bounds = bb;
-				}
-
-				// If root, finished
-				if (i == 0)
-					break;
-
-				// If first child, go to second child
-				if (todo[i].first == true) {
-					down = true;
-					i++;
-				}
-				// If second child, go to parent
-				else {
-					down = false;
-					i -= 3;
-					depth--;
-				}
+	// Build the MicroSurface tree, from the bottom up.  Grids that don't
+	// have a power-of-two number of cells on each side are padded out
+	// with empty cells.
+	depth = 1;
+	while ((size_t(1) << depth) < (std::max(res_u, res_v) - 1))
+		depth++;
+	const size_t side = size_t(1) << depth;
+	assert(depth <= MAX_DEPTH);
+
+	const size_t node_count = ((side * side) - 1) / 3;
+	const size_t inner_count = ((side * side / 4) - 1) / 3; // Nodes whose children are nodes too
+	const StorageLayout layout(depth, time_count);
+	storage = pool().alloc(depth, time_count);
+	nodes = static_cast<QBBox4*>(storage);
+	root_bounds = reinterpret_cast<BBox*>(static_cast<char*>(storage) + layout.root_bounds_offset);
+	normals = reinterpret_cast<uint32_t*>(static_cast<char*>(storage) + layout.normals_offset);
+
+	// Lay out the grid vertices of each time sample in planes of x, y
+	// and z, with one row per row of the grid.  Each row gets an extra
+	// copy of its first vertex before it and copies of its last vertex
+	// after it, which lets the normal and bounds passes below run over
+	// whole SIMD widths without special cases for the edges.
+	const size_t row_width = (std::max(res_u, side) + 3) & ~size_t(3);
+	const size_t row_stride = row_width + 4;
+	build_scratch.planes.resize(row_stride * res_v * 3);
+	build_scratch.full_nodes.resize(node_count * time_count);
+	build_scratch.decoded.resize(inner_count * time_count);
+	float *const planes = build_scratch.planes.data();
+	BBox4 *const full_nodes = build_scratch.full_nodes.data();
+	BBox4 *const decoded = build_scratch.decoded.data();
+	const GridPlanes grid_planes {planes, res_v, row_stride};
+
+	for (size_t ti = 0; ti < time_count; ti++) {
+		for (size_t v = 0; v < res_v; v++) {
+			float *const r[3] = {grid_planes.row(0, v), grid_planes.row(1, v), grid_planes.row(2, v)};
+			for (size_t u = 0; u < res_u; u++) {
+				const Vec3 &p = grid->verts[((v * res_u) + u) * time_count + ti];
+				r[0][u] = p.x;
+				r[1][u] = p.y;
+				r[2][u] = p.z;
 			}
-			// If not leaf
-			else {
-				// Determine split axis
-				const bool split_u = (todo[i].u_end - todo[i].u_start) > (todo[i].v_end - todo[i].v_start);
-
-				// Store first child's node index
-				nodes[todo[i].i].child_index = next_node_i;
-
-				// Create children's todos
-				todo[i+2].i = next_node_i;
-				todo[i+2].first = true;
-				next_node_i += time_count;
-				todo[i+3].i = next_node_i;
-				todo[i+3].first = false;
-				next_node_i += time_count;
-
-				// Fill in uv extents for each child
-				if (split_u == true) {
-					// Keep v extents
-					todo[i+2].v_start = todo[i+3].v_start = todo[i].v_start;
-					todo[i+2].v_end = todo[i+3].v_end = todo[i].v_end;
-
-					// Split on u
-					todo[i+2].u_start = todo[i].u_start;
-					todo[i+2].u_end = (todo[i].u_start + todo[i].u_end) / 2;
-
-					todo[i+3].u_start = (todo[i].u_start + todo[i].u_end) / 2 + 1;
-					todo[i+3].u_end = todo[i].u_end;
-				} else {
-					// Keep u extents
-					todo[i+2].u_start = todo[i+3].u_start = todo[i].u_start;
-					todo[i+2].u_end = todo[i+3].u_end = todo[i].u_end;
-
-					// Split on v
-					todo[i+2].v_start = todo[i].v_start;
-					todo[i+2].v_end = (todo[i].v_start + todo[i].v_end) / 2;
-
-					todo[i+3].v_start = (todo[i].v_start + todo[i].v_end) / 2 + 1;
-					todo[i+3].v_end = todo[i].v_end;
-				}
-
-				// Go to first child
-				down = true;
-				i += 2;
-				depth++;
+			for (size_t a = 0; a < 3; a++) {
+				r[a][-1] = r[a][0];
+				std::fill(r[a] + res_u, r[a] + row_width + 3, r[a][res_u - 1]);
 			}
 		}
-		// Going up
-		else {
-			// Merge children's BBoxes into this node's BBoxes
-			const size_t self_i = todo[i].i;
-			const size_t child1_i = nodes[todo[i].i].child_index;
-			const size_t child2_i = nodes[todo[i].i].child_index + time_count;
-			for (size_t ti = 0; ti < time_count; ti++) {
-				nodes[self_i+ti].bounds = nodes[child1_i+ti].bounds;
-				nodes[self_i+ti].bounds.merge_with(nodes[child2_i+ti].bounds);
-			}
 
-			// If root node, we're done
-			if (i == 0)
-				break;
-
-			// If first child, move to second child
-			if (todo[i].first == true) {
-				down = true;
-				i++;
-			}
-			// If second child, move to parent
-			else {
-				down = false;
-				i -= 3;
-				depth--;
+		calc_normals(grid_planes, res_u, res_v, time_count, ti, normals);
+		calc_leaf_bounds(grid_planes, res_u, res_v, depth, time_count, ti, full_nodes);
+
+		// Each node's children's bounds are the merged bounds of their
+		// own children
+		for (uint32_t level = depth - 1; level > 0; level--) {
+			const size_t first = ((size_t(1) << (2 * (level - 1))) - 1) / 3;
+			const size_t count = size_t(1) << (2 * (level - 1));
+			for (size_t i = first; i < (first + count); i++) {
+				const BBox4 *children[4];
+				for (size_t c = 0; c < 4; c++)
+					children[c] = &(full_nodes[((i * 4) + 1 + c) * time_count + ti]);
+				full_nodes[i * time_count + ti] = merge_children(children);
 			}
 		}
+
+		BBox bb = full_nodes[ti].get(0);
+		for (int c = 1; c < 4; c++)
+			bb.merge_with(full_nodes[ti].get(c));
+		root_bounds[ti] = bb;
 	}
 
+	// Quantize the tree from the top down, each node's children relative
+	// to the node's own decoded bounds, since that's what traversal will
+	// have on hand.  Decoded bounds always contain the original bounds,
+	// so they're valid parents for the next level down.
+	for (size_t ti = 0; ti < time_count; ti++) {
+		nodes[ti] = QBBox4(root_bounds[ti], full_nodes[ti]);
+		if (inner_count > 0)
+			decoded[ti] = nodes[ti].decode(root_bounds[ti]);
+	}
+	for (size_t i = 1; i < node_count; i++) {
+		const size_t parent = (i - 1) / 4;
+		const int lane = (i - 1) % 4;
+		for (size_t ti = 0; ti < time_count; ti++) {
+			const BBox4 &parent_bounds = decoded[parent * time_count + ti];
+			nodes[i * time_count + ti] = QBBox4(parent_bounds, lane, full_nodes[i * time_count + ti]);
+			if (i < inner_count)
+				decoded[i * time_count + ti] = nodes[i * time_count + ti].decode(parent_bounds, lane);
+		}
+	}
 
-	root_width = nodes[0].bounds.diagonal();
-	//std::cout << res_u*res_v << ": " << trav_count << ", " << trav_count / (float)(res_u*res_v) << std::endl;
+	root_width = root_bounds[0].diagonal();
 
 }
 
@@ -3,7 +3,7 @@
 
 #include "numtype.h"
 
-#include <vector>
+#include <algorithm>
 
 #include "vector.hpp"
 #include "bbox.hpp"
@@ -12,25 +12,7 @@
 #include "intersection.hpp"
 #include "utils.hpp"
 #include "rng.hpp"
-
-
-/**
- * @brief A node in the MicroSurface tree.
- *
- * The MicroSurface tree is essentially a BVH, except where the BBoxes
- * of the leaf nodes _are_ the geometry to be tested against.
- */
-struct MicroNode {
-	BBox bounds;
-
-	uint32_t child_index;
-
-	uint16_t data_index; // Index into geometry data
-	uint8_t data_du; // Deltas for the extent of geometry data that this node covers
-	uint8_t data_dv;
-
-	uint8_t flags;
-};
+#include "slab_pool.hpp"
 
 
 /**
@@ -38,16 +20,40 @@ struct MicroNode {
  *
  * All surfaces are eventually converted to a MicroSurface before direct
  * ray testing.
+ *
+ * MicroSurfaces are stored compactly, so that the grid cache can hold
+ * as many of them as possible.  The cost is some loss of precision:
+ *  - Tree bounds are quantized to 8 bits relative to their parent node,
+ *    so each box is inflated by less than 1/255 of its parent's extent
+ *    on each side.  Hit points, which lie on the boxes, are off by at
+ *    most that much more than with exact bounds, which is around 1% of
+ *    the size of the hit node.
+ *  - Normals are octahedral encoded, with an error under 0.0001 radians.
+ *  - UVs are interpolated from the grid's corners, which is exact up
+ *    to float rounding.
  */
 class MicroSurface
 {
-	// MicroSurface tree
-	std::vector<MicroNode> nodes;
+	// MicroSurface tree.  A 4-wide BVH over the grid cells, indexed
+	// implicitly like a heap: the children of node i are nodes 4i+1
+	// through 4i+4, and the nodes of each level are in morton order.
+	// Each node stores the bounds of its four children, one QBBox4 per
+	// time sample, quantized relative to the node's own (decoded) bounds.
+	// The children of the deepest nodes are the grid cells themselves, so
+	// they aren't stored as nodes.
+	//
+	// The nodes, root bounds and normals all live in a single block
+	// of storage from the MicroSurface pool, whose size class is the
+	// tree depth and number of time samples.
+	void *storage {nullptr};
+	QBBox4 *nodes {nullptr};
+	BBox *root_bounds {nullptr}; // Bounds of the whole tree, one per time sample
+	uint32_t depth; // The level of the grid cells in the tree
 	size_t res_u, res_v;
 
 	// Important geometry information
-	std::vector<Vec3> normals;
-	std::vector<float> uvs;
+	uint32_t *normals {nullptr}; // Octahedral encoded
+	float uvs[8]; // At the corners: u1, v1, u2, v2, u3, v3, u4, v4
 	size_t face_id;
 
 	// Number of time samples
@@ -56,31 +62,153 @@ class MicroSurface
 	// Max width of the surface at the root node
 	float root_width;
 
+	// How long it took to create this MicroSurface, in seconds
+	float dice_cost {0.0f};
+
 	// Random number generator
 	RNG rng;
 
+	// The most levels a tree can have, given the max grid resolution
+	static constexpr uint32_t MAX_DEPTH = 16;
+
+	// Decoded bounds of a node's children, at the two time samples
+	// being interpolated.  During traversal there's one of these per
+	// level, holding the bounds of the children of the last node
+	// visited on that level.  Since traversal is depth-first, that's
+	// the parent of any node on the next level that's still waiting to
+	// be visited.
+	struct ChildBounds {
+		// In a union so that it's left uninitialized, which keeps
+		// declaring a whole stack of them cheap
+		union {
+			BBox4 b[2];
+		};
+		ChildBounds() {}
+	};
+
 	/**
-	 * @brief Calculates ray-bbox intersection with a node in the
-	 * MicroSurface tree.
+	 * @brief Decodes the bounds of a node's children into
+	 * child_bounds[level].
+	 *
+	 * @param level The level of the node.
+	 * @param child_bounds The decoded bounds for each level, filled in
+	 *                     for the levels above the node.
+	 *
+	 * @return The bounds at the first of the time samples.
 	 */
-	bool intersect_node(size_t node, const Ray &ray, const Vec3 d_inv, const std::array<uint32_t, 3> d_sign, float *tnear, float *tfar, float *t) {
-		uint32_t ti = 0;
-		float alpha = 0.0f;
-		if (calc_time_interp(time_count, ray.time, &ti, &alpha)) {
-			const BBox b = lerp<BBox>(alpha, nodes[node+ti].bounds, nodes[node+ti+1].bounds);
-			return b.intersect_ray(ray, d_inv, d_sign, tnear, tfar, t);
+	const BBox4 &decode_children(size_t node, uint32_t level, bool motion, uint32_t ti, ChildBounds child_bounds[]) const {
+		const size_t i = node * time_count + ti;
+		ChildBounds &cb = child_bounds[level];
+		if (level == 0) {
+			cb.b[0] = nodes[i].decode(root_bounds[ti]);
+			if (motion)
+				cb.b[1] = nodes[i+1].decode(root_bounds[ti+1]);
 		} else {
-			return nodes[node+ti].bounds.intersect_ray(ray, d_inv, d_sign, tnear, tfar, t);
+			const ChildBounds &parent = child_bounds[level - 1];
+			const int lane = (node - 1) % 4;
+			cb.b[0] = nodes[i].decode(parent.b[0], lane);
+			if (motion)
+				cb.b[1] = nodes[i+1].decode(parent.b[1], lane);
 		}
+		return cb.b[0];
 	}
 
+	/**
+	 * @brief Returns the max level the given ray should traverse into
+	 * the tree, based on the ray's width.
+	 */
+	uint32_t max_level(float ray_width) const;
+
+	/**
+	 * @brief Finds the grid cells covered by a node of the tree.  The node
+	 * may be at the level of the grid cells.
+	 *
+	 * @param[out] u,v The first cell covered.
+	 * @param[out] du,dv The number of cells covered in u and v.
+	 */
+	void node_cells(size_t node, uint32_t level, size_t *u, size_t *v, size_t *du, size_t *dv) const;
+
+	/**
+	 * @brief Computes the uv coordinates of a grid vertex.
+	 */
+	void calc_uv(size_t u, size_t v, float *uv_u, float *uv_v) const;
+
+	/**
+	 * @brief Gives the storage back to the pool, if there is any.
+	 */
+	void release_storage();
+
 public:
+	/**
+	 * @brief The minimal record of a ray hit, from which full
+	 * intersection data can be computed later with calc_intersection().
+	 */
+	struct Hit {
+		float t;
+		uint32_t node; // Index of the node that was hit
+		uint32_t level; // Tree level of that node
+		float node_size; // Diagonal of the hit node's bounds
+	};
+
+	/**
+	 * @brief The pool that MicroSurface storage is allocated from.
+	 *
+	 * Size classes are keyed by tree depth, which is the subdivision
+	 * level of the grid rounded up to a power of two, and by the number
+	 * of time samples.  Storage freed by evicted MicroSurfaces is reused
+	 * by the next MicroSurfaces of the same class.
+	 */
+	static SlabPool &pool();
+
+	/**
+	 * @brief A part of the surface, as left by splitting its patch in
+	 * half u_splits times in u and v_splits times in v.  The part is
+	 * the (u_index, v_index)th of the resulting pieces, counting from
+	 * the low end of u and v.
+	 *
+	 * These are exactly the parts covered by sub-primitives of a
+	 * primitive that splits at its parametric midpoints, so a
+	 * MicroSurface of a primitive can stand in for those of its
+	 * sub-primitives.
+	 */
+	struct SubRange {
+		uint32_t u_splits {0}, v_splits {0};
+		uint32_t u_index {0}, v_index {0};
+
+		/**
+		 * @brief Returns the sub-range of the given half of this
+		 * sub-range, split on u (axis 0) or v (axis 1).
+		 */
+		SubRange half(int axis, uint32_t i) const {
+			SubRange r = *this;
+			if (axis == 0) {
+				r.u_splits++;
+				r.u_index = (u_index * 2) + i;
+			} else {
+				r.v_splits++;
+				r.v_index = (v_index * 2) + i;
+			}
+			return r;
+		}
+
+		uint32_t max_splits() const {
+			return std::max(u_splits, v_splits);
+		}
+	};
+
 	// Constructors
 	MicroSurface() {}
 	MicroSurface(Grid *grid) {
 		init_from_grid(grid);
 	}
 
+	MicroSurface(const MicroSurface&) = delete;
+	MicroSurface& operator=(const MicroSurface&) = delete;
+
+	~MicroSurface() {
+		release_storage();
+	}
+
 
 	/**
 	 * @brief Initializes the MicroSurface from a grid.
@@ -99,6 +227,19 @@ public:
 		return intlog2(res_u);
 	}
 
+	/**
+	 * @brief Returns the number of subdivisions of the given sub-range of
+	 * this MicroSurface, in the direction it was split the most.  That is,
+	 * what a MicroSurface diced from the sub-range's sub-primitive would
+	 * need to have at least as many cells on each side.
+	 *
+	 * @return The number of subdivisions, or -1 if the sub-range is
+	 *         smaller than a single cell.
+	 */
+	int subdivisions(const SubRange &range) const {
+		return int(depth) - int(range.max_splits());
+	}
+
 	/**
 	 * @brief Intersects a ray with the MicroSurface.
 	 *
@@ -111,18 +252,90 @@ public:
 	 */
 	bool intersect_ray(const Ray &ray, float width, Intersection *inter);
 
+	/**
+	 * @brief Finds the closest hit of a ray with the MicroSurface,
+	 * without computing any intersection data.
+	 *
+	 * @param max_t Only hits closer than this are considered.
+	 * @param[out] hit Filled in on a hit, untouched otherwise.
+	 *
+	 * @return True on a hit, false on a miss.
+	 */
+	bool intersect_ray(const Ray &ray, float width, float max_t, Hit *hit) const;
+
+	/**
+	 * @brief Like intersect_ray() above, but only considers the given
+	 * sub-range of the surface.
+	 *
+	 * The sub-range must have a non-negative subdivisions(range).  The
+	 * ray is traversed down to at least the level of the sub-range, so
+	 * the hit node is always within it.
+	 */
+	bool intersect_ray(const Ray &ray, float width, float max_t, const SubRange &range, Hit *hit) const;
+
+	/**
+	 * @brief Computes the full intersection data for a hit found
+	 * by intersect_ray().
+	 *
+	 * The ray must be the same one that produced the hit.
+	 */
+	void calc_intersection(const Ray &ray, const Hit &hit, Intersection *inter) const;
+
+	/**
+	 * @brief Tests whether a ray hits the MicroSurface anywhere along its
+	 * length.
+	 *
+	 * Unlike intersect_ray(), this doesn't look for the closest hit or
+	 * compute any intersection data, so it can stop at the first leaf
+	 * node the ray hits.  The ray's is_shadow_ray flag is ignored.
+	 *
+	 * @return True if the ray is occluded, false otherwise.
+	 */
+	bool occluded(const Ray &ray, float width) const;
+
+	/**
+	 * @brief Like occluded() above, but only considers the given
+	 * sub-range of the surface.
+	 */
+	bool occluded(const Ray &ray, float width, const SubRange &range) const;
+
+
+	/**
+	 * @brief Records how long it took to create this MicroSurface,
+	 * in seconds.
+	 */
+	void set_dice_cost(float cost) {
+		dice_cost = cost;
+	}
+
+	/**
+	 * @brief Returns how long it took to create this MicroSurface,
+	 * in seconds.
+	 */
+	float get_dice_cost() const {
+		return dice_cost;
+	}
 
 	/**
 	 * @brief Returns how much memory this MicroSurface occupies.
 	 */
 	size_t bytes() const {
 		const size_t class_size = sizeof(MicroSurface);
-		const size_t nodes_size = sizeof(MicroNode) * nodes.size();
-		const size_t normals_size = sizeof(Vec3) * normals.size();
-		const size_t uvs_size = sizeof(float) * uvs.size();
+		const size_t storage_size = (storage == nullptr) ? 0 : pool().block_bytes(depth, time_count);
 
-		return class_size + nodes_size + normals_size + uvs_size;
+		return class_size + storage_size;
 	}
+
+private:
+	/**
+	 * @brief Implementations of intersect_ray() and occluded().  When
+	 * RANGED is true, only the cells in the given sub-range are tested,
+	 * otherwise the sub-range is ignored.
+	 */
+	template <bool RANGED>
+	bool intersect_ray_impl(const Ray &ray, float width, float max_t, const SubRange &range, Hit *hit) const;
+	template <bool RANGED>
+	bool occluded_impl(const Ray &ray, float width, const SubRange &range) const;
 };
 
 
@@ -131,4 +344,9 @@ static inline size_t size_in_bytes(const MicroSurface& data)
 	return data.bytes();
 }
 
+static inline float eviction_cost(const MicroSurface& data)
+{
+	return data.get_dice_cost();
+}
+
 #endif // MICRO_SURFACE_HPP
\ No newline at end of file
@@ -1,11 +1,82 @@
 #include "numtype.h"
 
 #include <functional>
+#include <unordered_map>
+#include <future>
+#include <mutex>
 
 #include "config.hpp"
+#include "global.hpp"
+#include "timer.hpp"
 #include "micro_surface_cache.hpp"
 
 namespace MicroSurfaceCache
 {
-LRUCache<Key, MicroSurface> cache(Config::grid_cache_size * (1000*1000));
+ConcurrentCache<Key, MicroSurface, Eviction> cache(Config::grid_cache_size * (1000*1000));
+
+// Registry of the MicroSurfaces currently being diced, so that threads
+// missing on the same key can wait on one dicing instead of each
+// doing their own.
+static std::mutex in_flight_lock;
+static std::unordered_map<Key, std::shared_future<std::shared_ptr<MicroSurface>>> in_flight;
+
+
+std::shared_ptr<MicroSurface> get_or_dice(const Key& key, size_t subdivisions, const std::function<std::shared_ptr<MicroSurface>(size_t)>& dice)
+{
+	while (true) {
+		std::unique_lock<std::mutex> lock(in_flight_lock);
+
+		// Another thread may have finished dicing it in the meantime
+		std::shared_ptr<MicroSurface> micro_surface = cache.get(key);
+		if (micro_surface && micro_surface->subdivisions() >= subdivisions) {
+			Global::Stats::cache_hits++;
+			return micro_surface;
+		}
+
+		// If another thread is already dicing it, wait for its result
+		const auto itr = in_flight.find(key);
+		if (itr != in_flight.end()) {
+			auto result = itr->second;
+			lock.unlock();
+
+			micro_surface = result.get();
+			if (micro_surface->subdivisions() >= subdivisions) {
+				Global::Stats::cache_hits++;
+				return micro_surface;
+			}
+
+			// Not high enough resolution, try again
+			continue;
+		}
+
+		// Otherwise dice it ourselves
+		std::promise<std::shared_ptr<MicroSurface>> promise;
+		in_flight.emplace(key, promise.get_future().share());
+		lock.unlock();
+
+		// If dicing fails, the key is taken out of the registry so later
+		// requests try again, and threads already waiting on it get the
+		// exception too
+		Global::Stats::cache_misses++;
+		try {
+			Timer<> timer;
+			micro_surface = dice(subdivisions);
+			micro_surface->set_dice_cost(timer.time());
+			cache.put(micro_surface, key);
+		} catch (...) {
+			lock.lock();
+			in_flight.erase(key);
+			lock.unlock();
+			promise.set_exception(std::current_exception());
+			throw;
+		}
+
+		lock.lock();
+		in_flight.erase(key);
+		lock.unlock();
+		promise.set_value(micro_surface);
+
+		return micro_surface;
+	}
+}
 }
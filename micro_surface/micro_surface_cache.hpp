@@ -6,8 +6,12 @@
 #include <functional>
 
 #include "micro_surface.hpp"
-#include "lru_cache.hpp"
+#include "concurrent_cache.hpp"
 
+// Uncomment to evict MicroSurfaces based on how expensive they were
+// to dice relative to their size (GreedyDual-Size-Frequency), rather
+// than on recency alone (CLOCK).
+//#define MICRO_SURFACE_CACHE_COST_AWARE
 
 namespace MicroSurfaceCache
 {
@@ -24,7 +28,32 @@ struct Key {
 	}
 };
 
-extern LRUCache<Key, MicroSurface> cache;
+#ifdef MICRO_SURFACE_CACHE_COST_AWARE
+typedef GDSFEviction Eviction;
+#else
+typedef ClockEviction Eviction;
+#endif
+
+extern ConcurrentCache<Key, MicroSurface, Eviction> cache;
+
+/**
+ * @brief Fetches the MicroSurface for the given key from the cache,
+ * dicing and caching a new one if the cached one doesn't exist or is
+ * of lower resolution than needed.
+ *
+ * If multiple threads need to dice the same key at the same time, only
+ * one of them dices and the rest wait for and share its result.  If
+ * dice throws, the exception is passed on to the waiting threads as
+ * well, and the next call for the key tries dicing again.
+ *
+ * @param key The key of the MicroSurface.
+ * @param subdivisions The minimum number of subdivisions needed.
+ * @param dice Function that dices a new MicroSurface with the given
+ *             number of subdivisions.
+ *
+ * @returns A MicroSurface with at least the requested number of subdivisions.
+ */
+std::shared_ptr<MicroSurface> get_or_dice(const Key& key, size_t subdivisions, const std::function<std::shared_ptr<MicroSurface>(size_t)>& dice);
 }
 
 
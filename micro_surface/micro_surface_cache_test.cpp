@@ -0,0 +1,37 @@
+#include "test.hpp"
+
+#include <memory>
+#include <stdexcept>
+#include "numtype.h"
+#include "vector.hpp"
+#include "bilinear.hpp"
+#include "micro_surface.hpp"
+#include "micro_surface_cache.hpp"
+
+
+BOOST_AUTO_TEST_SUITE(micro_surface_cache);
+
+// Test that a failed dicing doesn't leave the key stuck, so the next
+// request for it dices again instead of failing
+BOOST_AUTO_TEST_CASE(get_or_dice_1)
+{
+	using namespace MicroSurfaceCache;
+	const Key key(~uint64_t(0), 1);
+
+	Bilinear patch(Vec3(0.0f, 0.0f, 0.0f), Vec3(1.0f, 0.0f, 0.0f), Vec3(1.0f, 1.0f, 0.0f), Vec3(0.0f, 1.0f, 0.0f));
+	patch.finalize();
+
+	BOOST_CHECK_THROW(get_or_dice(key, 2, [](size_t) -> std::shared_ptr<MicroSurface> {
+		throw std::runtime_error("dicing failed");
+	}), std::runtime_error);
+
+	std::shared_ptr<MicroSurface> micro_surface;
+	BOOST_CHECK_NO_THROW(micro_surface = get_or_dice(key, 2, [&](size_t subdivisions) {
+		return patch.dice(subdivisions);
+	}));
+	BOOST_CHECK(micro_surface && micro_surface->subdivisions() >= 2);
+
+	cache.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END();
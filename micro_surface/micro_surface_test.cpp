@@ -0,0 +1,147 @@
+#include "test.hpp"
+
+#include <cmath>
+#include <limits>
+#include "numtype.h"
+#include "vector.hpp"
+#include "ray.hpp"
+#include "intersection.hpp"
+#include "rng.hpp"
+#include "grid.hpp"
+#include "micro_surface.hpp"
+
+
+// Makes a grid on the plane z = 0.25x + 0.5y over [0,1]x[0,1] in x and y
+static Grid make_plane_grid(int ru, int rv, int time_count)
+{
+	Grid grid(ru, rv, time_count);
+	grid.u1 = 0.0f;
+	grid.v1 = 0.0f;
+	grid.u2 = 1.0f;
+	grid.v2 = 0.0f;
+	grid.u3 = 0.0f;
+	grid.v3 = 1.0f;
+	grid.u4 = 1.0f;
+	grid.v4 = 1.0f;
+	grid.face_id = 0;
+	for (int v = 0; v < rv; ++v) {
+		for (int u = 0; u < ru; ++u) {
+			const float x = u / float(ru - 1);
+			const float y = v / float(rv - 1);
+			for (int t = 0; t < time_count; ++t)
+				grid.verts[((v * ru) + u) * time_count + t] = Vec3(x, y, (0.25f * x) + (0.5f * y));
+		}
+	}
+	return grid;
+}
+
+// Makes a ray pointing straight down at the given x and y
+static Ray down_ray(float x, float y)
+{
+	Ray ray;
+	ray.o = Vec3(x, y, 10.0f);
+	ray.d = Vec3(0.0f, 0.0f, -1.0f);
+	ray.time = 0.5f;
+	ray.ow = 0.0f;
+	ray.dw = 0.0f;
+	ray.max_t = std::numeric_limits<float>::infinity();
+	ray.is_shadow_ray = false;
+	ray.finalize();
+	return ray;
+}
+
+
+/*
+ * Test suite for MicroSurface.
+ */
+BOOST_AUTO_TEST_SUITE(micro_surface);
+
+// Test that rays hit a surface within the grid cell they should, and
+// get its normal.  Tests grids with and without a power-of-two number of
+// cells, and with and without motion blur.
+BOOST_AUTO_TEST_CASE(intersect_ray_1)
+{
+	const int res[3][3] = {{17, 17, 1}, {10, 7, 1}, {6, 13, 2}};
+	const Vec3 normal = Vec3(-0.25f, -0.5f, 1.0f).normalized();
+
+	for (const auto &r: res) {
+		Grid grid = make_plane_grid(r[0], r[1], r[2]);
+		MicroSurface surface(&grid);
+		RNG rng(11);
+
+		int hits = 0;
+		float max_t_err = 0.0f;
+		float min_dot = 1.0f;
+		for (int i = 0; i < 1000; ++i) {
+			const float x = (rng.next_float() * 0.98f) + 0.01f;
+			const float y = (rng.next_float() * 0.98f) + 0.01f;
+			Intersection inter;
+			if (surface.intersect_ray(down_ray(x, y), 0.0001f, &inter)) {
+				++hits;
+				max_t_err = std::max(max_t_err, std::abs(inter.t - (10.0f - (0.25f * x) - (0.5f * y))));
+				min_dot = std::min(min_dot, dot(inter.n, normal));
+			}
+		}
+
+		BOOST_CHECK_EQUAL(hits, 1000);
+		const float cell_dz = (0.25f / (r[0] - 1)) + (0.5f / (r[1] - 1));
+		BOOST_CHECK_LT(max_t_err, cell_dz * 1.05f);
+		BOOST_CHECK_GT(min_dot, 0.9999f);
+	}
+}
+
+// Test that rays outside of a surface miss it
+BOOST_AUTO_TEST_CASE(intersect_ray_2)
+{
+	Grid grid = make_plane_grid(10, 7, 1);
+	MicroSurface surface(&grid);
+
+	BOOST_CHECK(!surface.intersect_ray(down_ray(1.1f, 0.5f), 0.0001f, nullptr));
+	BOOST_CHECK(!surface.intersect_ray(down_ray(0.5f, 1.1f), 0.0001f, nullptr));
+	BOOST_CHECK(!surface.intersect_ray(down_ray(-0.1f, 0.5f), 0.0001f, nullptr));
+	BOOST_CHECK(!surface.occluded(down_ray(1.1f, 1.1f), 0.0001f));
+}
+
+// Test that rays only hit the sub-range they're limited to, no matter
+// how wide they are
+BOOST_AUTO_TEST_CASE(intersect_ray_sub_range_1)
+{
+	Grid grid = make_plane_grid(17, 17, 1);
+	MicroSurface surface(&grid);
+
+	// x in [0.5, 1], y in [0.75, 1]
+	const MicroSurface::SubRange range = MicroSurface::SubRange().half(0, 1).half(1, 1).half(1, 1);
+	BOOST_CHECK_EQUAL(surface.subdivisions(range), 2);
+
+	RNG rng(12);
+	bool correct = true;
+	bool in_range = true;
+	for (int i = 0; i < 1000; ++i) {
+		const float x = (rng.next_float() * 0.98f) + 0.01f;
+		const float y = (rng.next_float() * 0.98f) + 0.01f;
+		const Ray ray = down_ray(x, y);
+
+		// Stay clear of the sub-range's edges, where bounds overlap
+		const bool inside = x > 0.52f && y > 0.77f;
+		const bool outside = x < 0.48f || y < 0.73f;
+
+		for (float width: {0.0001f, 10.0f}) {
+			MicroSurface::Hit hit;
+			const bool was_hit = surface.intersect_ray(ray, width, ray.max_t, range, &hit);
+			const bool occluded = surface.occluded(ray, width, range);
+			if ((inside && !was_hit) || (outside && was_hit) || was_hit != occluded)
+				correct = false;
+
+			if (was_hit) {
+				Intersection inter;
+				surface.calc_intersection(ray, hit, &inter);
+				in_range = in_range && inter.u >= 0.5f && inter.v >= 0.75f;
+			}
+		}
+	}
+
+	BOOST_CHECK(correct);
+	BOOST_CHECK(in_range);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -99,6 +99,7 @@ std::unique_ptr<Renderer> Parser::parse_next_frame()
 
 
 	// Populate scene
+	bool more_frames = false;
 	while (true) {
 		if (!getline(psy_file, line))
 			break;
@@ -120,11 +121,20 @@ std::unique_ptr<Renderer> Parser::parse_next_frame()
 			scene->add_finite_light(parse_sphere_light());
 		} else if (line.find("Frame") == 0) {
 			ungetline(psy_file);
+			more_frames = true;
 			break;
 		}
 	}
 
+	// Frames of an animation usually have the same primitives in the
+	// same order, just moved, so try refitting the previous frame's BVH.
+	// This frame's is only kept around if there's a next frame to refit.
+	if (prev_world)
+		scene->world.refit_from(prev_world);
+	if (more_frames)
+		scene->world.keep_topology();
 	scene->finalize();
+	prev_world = scene->world.topology();
 
 	std::unique_ptr<Renderer> renderer(new Renderer(scene.release(), res_x, res_y, spp, seed, output_path));
 
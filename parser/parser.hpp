@@ -16,6 +16,7 @@
 class Parser
 {
 	std::ifstream psy_file;
+	std::shared_ptr<const BVH4::Topology> prev_world; // The previous frame's BVH, for refitting the next one's
 
 	// Methods
 
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <cmath>
 #include "bicubic.hpp"
+#include "dicing.hpp"
 #include "grid.hpp"
 #include "config.hpp"
 #include "global.hpp"
@@ -15,7 +16,7 @@ Bicubic::Bicubic(Vec3 v1,  Vec3 v2,  Vec3 v3,  Vec3 v4,
                  Vec3 v9,  Vec3 v10, Vec3 v11, Vec3 v12,
                  Vec3 v13, Vec3 v14, Vec3 v15, Vec3 v16)
 {
-	verts.resize(1);
+	verts.init(1);
 
 	verts[0][0]  = v1;
 	verts[0][1]  = v2;
@@ -47,7 +48,7 @@ void Bicubic::add_time_sample(Vec3 v1,  Vec3 v2,  Vec3 v3,  Vec3 v4,
                               Vec3 v13, Vec3 v14, Vec3 v15, Vec3 v16)
 {
 	const auto i = verts.size();
-	verts.resize(verts.size()+1);
+	verts.init(verts.size()+1);
 
 	verts[i][0]  = v1;
 	verts[i][1]  = v2;
@@ -112,14 +113,9 @@ void Bicubic::finalize()
 
 //////////////////////////////////////////////////////////////
 
-size_t Bicubic::subdiv_estimate(float width) const
+float Bicubic::log_width() const
 {
-	// Since we want to end up with the log-base-2 of
-	// the division anyway, we just do the log first and
-	// subtract.  Using a very approximate log2, but in
-	// practice it works very well.
-	const float rate = log_widest - fasterlog2(width * Config::dice_rate) + 1.0f;
-	return std::max(rate, 0.0f);
+	return log_widest;
 }
 
 
@@ -129,10 +125,10 @@ BBoxT &Bicubic::bounds()
 }
 
 
-int Bicubic::split(std::unique_ptr<DiceableSurfacePrimitive> primitives[])
+int Bicubic::split(DiceableSurfacePrimitive *primitives[], MemoryArena &arena)
 {
-	auto patch1 = new Bicubic();
-	auto patch2 = new Bicubic();
+	auto patch1 = arena.make<Bicubic>();
+	auto patch2 = arena.make<Bicubic>();
 
 	// Split
 	if (longest_u > longest_v) {
@@ -289,15 +285,21 @@ int Bicubic::split(std::unique_ptr<DiceableSurfacePrimitive> primitives[])
 	patch1->finalize();
 	patch2->finalize();
 
-	primitives[0] = std::unique_ptr<DiceableSurfacePrimitive>(patch1);
-	primitives[1] = std::unique_ptr<DiceableSurfacePrimitive>(patch2);
+	primitives[0] = patch1;
+	primitives[1] = patch2;
 
 	return 2;
 }
 
-std::unique_ptr<DiceableSurfacePrimitive> Bicubic::copy()
+int Bicubic::split_axis() const
 {
-	auto patch = new Bicubic();
+	// Same choice as in split()
+	return (longest_u > longest_v) ? 0 : 1;
+}
+
+DiceableSurfacePrimitive *Bicubic::copy(MemoryArena &arena)
+{
+	auto patch = arena.make<Bicubic>();
 
 	// Copy verts
 	patch->verts = verts;
@@ -312,8 +314,9 @@ std::unique_ptr<DiceableSurfacePrimitive> Bicubic::copy()
 	patch->bbox = bbox;
 	patch->longest_u = longest_u;
 	patch->longest_v = longest_v;
+	patch->log_widest = log_widest;
 
-	return std::unique_ptr<DiceableSurfacePrimitive>(patch);
+	return patch;
 }
 
 
@@ -330,54 +333,6 @@ std::shared_ptr<MicroSurface> Bicubic::dice(size_t subdivisions)
 	return micro;
 }
 
-inline void eval_cubic_bezier_curve(int vert_count, int stride, Vec3 output[], Vec3 v0, Vec3 v1, Vec3 v2, Vec3 v3)
-{
-	const double dt = 1.0 / (vert_count - 1);
-
-	// Differentials for x
-	double dx0 = v0[0];
-	double dx1 = (double(v1[0]) - v0[0]) * 3 * dt;
-	double dx2 = ((double(v0[0]) * 6) - (double(v1[0]) * 12) + (double(v2[0]) * 6)) * dt * dt;
-	double dx3 = ((double(v0[0]) * -6) + (double(v1[0]) * 18) - (double(v2[0]) * 18) + (double(v3[0]) * 6)) * dt * dt * dt;
-
-	// Differentials for y
-	double dy0 = v0[1];
-	double dy1 = (double(v1[1]) - v0[1]) * 3 * dt;
-	double dy2 = ((double(v0[1]) * 6) - (double(v1[1]) * 12) + (double(v2[1]) * 6)) * dt * dt;
-	double dy3 = ((double(v0[1]) * -6) + (double(v1[1]) * 18) - (double(v2[1]) * 18) + (double(v3[1]) * 6)) * dt * dt * dt;
-
-	// Differentials for z
-	double dz0 = v0[2];
-	double dz1 = (double(v1[2]) - v0[2]) * 3 * dt;
-	double dz2 = ((double(v0[2]) * 6) - (double(v1[2]) * 12) + (double(v2[2]) * 6)) * dt * dt;
-	double dz3 = ((double(v0[2]) * -6) + (double(v1[2]) * 18) - (double(v2[2]) * 18) + (double(v3[2]) * 6)) * dt * dt * dt;
-
-	// To avoid divisions in inner loop
-	const double inv_6 = 1.0 / 6.0;
-	const double inv_2 = 1.0 / 2.0;
-
-	// Go!
-	output[0] = Vec3(dx0, dy0, dz0);
-	for (int i = 1; i < vert_count; ++i) {
-		// Find next point
-		dx0 = dx0 + dx1 + (dx2 * inv_2) + (dx3 * inv_6);
-		dy0 = dy0 + dy1 + (dy2 * inv_2) + (dy3 * inv_6);
-		dz0 = dz0 + dz1 + (dz2 * inv_2) + (dx3 * inv_6);
-
-		// Store point
-		output[i*stride] = Vec3(dx0, dy0, dz0);
-
-		// Update differentials
-		dx1 += dx2 + (dx3 * inv_2);
-		dx2 += dx3;
-		dy1 += dy2 + (dy3 * inv_2);
-		dy2 += dy3;
-		dz1 += dz2 + (dz3 * inv_2);
-		dz2 += dz3;
-	}
-}
-
-
 /*
  * Dice the patch into a micropoly grid.
  * ru and rv are the resolution of the grid in vertices
@@ -399,25 +354,24 @@ Grid *Bicubic::grid_dice(const int ru, const int rv)
 	grid->u4 = u_max;
 	grid->v4 = v_max;
 
+	// Basis weights along u and v
+	std::vector<SIMD::float4> u_weights;
+	std::vector<SIMD::float4> v_weights;
+	Dicing::cubic_bezier_weights(ru, &u_weights);
+	Dicing::cubic_bezier_weights(rv, &v_weights);
+
 	std::vector<Vec3> vs(rv*4); // Hold v-dicing before doing u-dicing
 
 	// Dice for each time sample
 	for (int time = 0; time < verts.size(); time++) {
 		// Dice along v-columns
-		eval_cubic_bezier_curve(rv, 4, vs.data()+0, verts[time][0], verts[time][4], verts[time][8], verts[time][12]);
-		eval_cubic_bezier_curve(rv, 4, vs.data()+1, verts[time][1], verts[time][5], verts[time][9], verts[time][13]);
-		eval_cubic_bezier_curve(rv, 4, vs.data()+2, verts[time][2], verts[time][6], verts[time][10], verts[time][14]);
-		eval_cubic_bezier_curve(rv, 4, vs.data()+3, verts[time][3], verts[time][7], verts[time][11], verts[time][15]);
+		for (int i = 0; i < 4; ++i)
+			Dicing::eval_row<4>(rv, v_weights.data(), verts[time].data()+i, 4, vs.data()+i, 4);
 
 		//i = (ru*y+x) * grid->time_count + time;
 		// Dice along u-rows
-		for (int v = 0; v < rv; ++v) {
-			eval_cubic_bezier_curve(ru, grid->time_count, grid->verts.data()+(ru*v*grid->time_count)+time,
-			                        vs[(v*4)],
-			                        vs[(v*4)+1],
-			                        vs[(v*4)+2],
-			                        vs[(v*4)+3]);
-		}
+		for (int v = 0; v < rv; ++v)
+			Dicing::eval_row<4>(ru, u_weights.data(), vs.data()+(v*4), 1, grid->verts+(ru*v*grid->time_count)+time, grid->time_count);
 	}
 
 	return grid;
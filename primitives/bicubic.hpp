@@ -9,6 +9,7 @@
 #include "vector.hpp"
 #include "grid.hpp"
 #include "primitive.hpp"
+#include "timebox.hpp"
 
 /*
  * A bicubic bezier patch.
@@ -25,9 +26,9 @@
 class Bicubic: public DiceableSurfacePrimitive
 {
 public:
-	std::vector<std::array<Vec3, 16>> verts;
-	float u_min, v_min, u_max, v_max;
-	float longest_u, longest_v;
+	TimeBox<std::array<Vec3, 16>> verts;
+	float u_min {0.0f}, v_min {0.0f}, u_max {1.0f}, v_max {1.0f};
+	float longest_u {0.0f}, longest_v {0.0f};
 	float log_widest = 0.0f;  // Log base 2 of the widest part of the patch, for fast subdivision rate estimates
 
 	BBoxT bbox;
@@ -48,9 +49,10 @@ public:
 
 	virtual BBoxT &bounds();
 
-	virtual int split(std::unique_ptr<DiceableSurfacePrimitive> primitives[]);
-	virtual std::unique_ptr<DiceableSurfacePrimitive> copy();
-	virtual size_t subdiv_estimate(float width) const;
+	virtual int split(DiceableSurfacePrimitive *primitives[], MemoryArena &arena);
+	virtual int split_axis() const;
+	virtual DiceableSurfacePrimitive *copy(MemoryArena &arena);
+	virtual float log_width() const;
 	virtual std::shared_ptr<MicroSurface> dice(size_t subdivisions);
 };
 
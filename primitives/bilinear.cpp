@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <cmath>
 #include "bilinear.hpp"
+#include "dicing.hpp"
 #include "grid.hpp"
 #include "config.hpp"
 #include "global.hpp"
@@ -66,14 +67,9 @@ void Bilinear::add_time_sample(Vec3 v1, Vec3 v2, Vec3 v3, Vec3 v4)
 
 //////////////////////////////////////////////////////////////
 
-size_t Bilinear::subdiv_estimate(float width) const
+float Bilinear::log_width() const
 {
-	// Since we want to end up with the log-base-2 of
-	// the division anyway, we just do the log first and
-	// subtract.  Using a very approximate log2, but in
-	// practice it works fine.
-	const float rate = log_widest - fasterlog2(width * Config::dice_rate) + 1.0f;
-	return std::max(rate, 0.0f);
+	return log_widest;
 }
 
 
@@ -83,10 +79,10 @@ BBoxT &Bilinear::bounds()
 }
 
 
-int Bilinear::split(std::unique_ptr<DiceableSurfacePrimitive> primitives[])
+int Bilinear::split(DiceableSurfacePrimitive *primitives[], MemoryArena &arena)
 {
-	auto patch1 = new Bilinear();
-	auto patch2 = new Bilinear();
+	auto patch1 = arena.make<Bilinear>();
+	auto patch2 = arena.make<Bilinear>();
 
 	// Split
 	if (longest_u > longest_v) {
@@ -144,15 +140,21 @@ int Bilinear::split(std::unique_ptr<DiceableSurfacePrimitive> primitives[])
 	patch1->finalize();
 	patch2->finalize();
 
-	primitives[0] = std::unique_ptr<DiceableSurfacePrimitive>(patch1);
-	primitives[1] = std::unique_ptr<DiceableSurfacePrimitive>(patch2);
+	primitives[0] = patch1;
+	primitives[1] = patch2;
 
 	return 2;
 }
 
-std::unique_ptr<DiceableSurfacePrimitive> Bilinear::copy()
+int Bilinear::split_axis() const
 {
-	auto patch = new Bilinear();
+	// Same choice as in split()
+	return (longest_u > longest_v) ? 0 : 1;
+}
+
+DiceableSurfacePrimitive *Bilinear::copy(MemoryArena &arena)
+{
+	auto patch = arena.make<Bilinear>();
 
 	// Copy verts
 	patch->verts = verts;
@@ -167,8 +169,9 @@ std::unique_ptr<DiceableSurfacePrimitive> Bilinear::copy()
 	patch->bbox = bbox;
 	patch->longest_u = longest_u;
 	patch->longest_v = longest_v;
+	patch->log_widest = log_widest;
 
-	return std::unique_ptr<DiceableSurfacePrimitive>(patch);
+	return patch;
 }
 
 
@@ -207,51 +210,23 @@ Grid *Bilinear::grid_dice(const int ru, const int rv)
 	grid->u4 = u_max;
 	grid->v4 = v_max;
 
-	// Generate verts
-	Vec3 du1;
-	Vec3 du2;
-	Vec3 dv;
-	Vec3 p1, p2, p3;
-	int x, y;
-	int i, time;
+	// Basis weights along u and v
+	std::vector<SIMD::float4> u_weights;
+	std::vector<SIMD::float4> v_weights;
+	Dicing::linear_weights(ru, &u_weights);
+	Dicing::linear_weights(rv, &v_weights);
+
+	std::vector<Vec3> vs(rv*2); // Hold v-dicing before doing u-dicing
+
 	// Dice for each time sample
-	for (time = 0; time < verts.size(); time++) {
-		// Deltas
-		du1.x = (verts[time][1].x - verts[time][0].x) / (ru-1);
-		du1.y = (verts[time][1].y - verts[time][0].y) / (ru-1);
-		du1.z = (verts[time][1].z - verts[time][0].z) / (ru-1);
-
-		du2.x = (verts[time][2].x - verts[time][3].x) / (ru-1);
-		du2.y = (verts[time][2].y - verts[time][3].y) / (ru-1);
-		du2.z = (verts[time][2].z - verts[time][3].z) / (ru-1);
-
-		// Starting points
-		p1 = verts[time][0];
-
-		p2 = verts[time][3];
-
-		// Walk along u
-		for (x=0; x < ru; x++) {
-			// Deltas
-			dv = (p2 - p1) / (rv-1);
-
-			// Starting point
-			p3 = p1;
-
-			// Walk along v
-			for (y=0; y < rv; y++) {
-				// Set grid vertex coordinates
-				i = (ru*y+x) * grid->time_count + time;
-				grid->verts[i] = p3;
-
-				// Update point
-				p3 = p3 + dv;
-			}
-
-			// Update points
-			p1 = p1 + du1;
-			p2 = p2 + du2;
-		}
+	for (int time = 0; time < verts.size(); time++) {
+		// Dice along the v edges
+		Dicing::eval_row<2>(rv, v_weights.data(), &(verts[time][0]), 3, vs.data(), 2);
+		Dicing::eval_row<2>(rv, v_weights.data(), &(verts[time][1]), 1, vs.data()+1, 2);
+
+		// Dice along u-rows
+		for (int v = 0; v < rv; ++v)
+			Dicing::eval_row<2>(ru, u_weights.data(), vs.data()+(v*2), 1, grid->verts+(ru*v*grid->time_count)+time, grid->time_count);
 	}
 
 	return grid;
@@ -0,0 +1,148 @@
+/*
+ * SIMD kernels for dicing patches into micropolygon grids.
+ *
+ * Rather than stepping along each row with forward differences, which
+ * accumulates error at every step and so needs double precision, each
+ * vertex is evaluated directly as a weighted sum of the row's control
+ * points.  The basis weights only depend on the position along the row,
+ * so they're tabulated once per dicing and shared by all rows and time
+ * samples.  Each vertex's error is then independent of the grid
+ * resolution, and single precision is enough.
+ *
+ * Four vertices of a row are evaluated at once, one per SIMD lane.
+ */
+
+#ifndef DICING_HPP
+#define DICING_HPP
+
+#include "numtype.h"
+
+#include <algorithm>
+#include <vector>
+#include <x86intrin.h>
+
+#include "simd.hpp"
+#include "vector.hpp"
+
+namespace Dicing
+{
+
+/**
+ * @brief Number of float4 weights in a basis table for rows of
+ * vert_count vertices with the given number of control points.
+ */
+static inline size_t weight_table_size(int vert_count, int ctrl_count)
+{
+	return ((vert_count + 3) / 4) * ctrl_count;
+}
+
+/**
+ * @brief Tabulates the linear basis weights for rows of vert_count
+ * evenly spaced vertices.
+ *
+ * The weights of vertices 4g to 4g+3 for control point k are in
+ * weights[(g*2)+k].  The first and last vertices get exactly the
+ * weights of the end points.
+ */
+static inline void linear_weights(int vert_count, std::vector<SIMD::float4> *weights)
+{
+	weights->resize(weight_table_size(vert_count, 2));
+	const float dt = 1.0f / (vert_count - 1);
+
+	for (int g = 0; g < (vert_count + 3) / 4; ++g) {
+		float w[2][4];
+		for (int l = 0; l < 4; ++l) {
+			const int i = std::min((g * 4) + l, vert_count - 1);
+			const float t = (i == vert_count - 1) ? 1.0f : i * dt;
+			w[0][l] = 1.0f - t;
+			w[1][l] = t;
+		}
+		for (int k = 0; k < 2; ++k)
+			(*weights)[(g*2)+k] = SIMD::float4(w[k][0], w[k][1], w[k][2], w[k][3]);
+	}
+}
+
+/**
+ * @brief Tabulates the cubic bezier (Bernstein) basis weights for rows of
+ * vert_count evenly spaced vertices.
+ *
+ * The layout is the same as for linear_weights(), with four control
+ * points per group instead of two.
+ */
+static inline void cubic_bezier_weights(int vert_count, std::vector<SIMD::float4> *weights)
+{
+	weights->resize(weight_table_size(vert_count, 4));
+	const float dt = 1.0f / (vert_count - 1);
+
+	for (int g = 0; g < (vert_count + 3) / 4; ++g) {
+		float w[4][4];
+		for (int l = 0; l < 4; ++l) {
+			const int i = std::min((g * 4) + l, vert_count - 1);
+			const float t = (i == vert_count - 1) ? 1.0f : i * dt;
+			const float s = 1.0f - t;
+			w[0][l] = s * s * s;
+			w[1][l] = 3.0f * s * s * t;
+			w[2][l] = 3.0f * s * t * t;
+			w[3][l] = t * t * t;
+		}
+		for (int k = 0; k < 4; ++k)
+			(*weights)[(g*4)+k] = SIMD::float4(w[k][0], w[k][1], w[k][2], w[k][3]);
+	}
+}
+
+/**
+ * @brief Evaluates a row of vertices from its control points.
+ *
+ * @param vert_count Number of vertices in the row.
+ * @param weights Basis weight table for the row, as created by
+ *                linear_weights() or cubic_bezier_weights().
+ * @param ctrl The row's CTRL_COUNT control points.
+ * @param ctrl_stride Distance between consecutive control points in ctrl.
+ * @param[out] out Where to store the first vertex.
+ * @param stride Distance between consecutive vertices in out.
+ */
+template <int CTRL_COUNT>
+static inline void eval_row(int vert_count, const SIMD::float4 weights[], const Vec3 ctrl[], int ctrl_stride, Vec3 out[], int stride)
+{
+	using SIMD::float4;
+	static_assert(sizeof(Vec3) == sizeof(float) * 3, "eval_row() assumes tightly packed vertices");
+
+	const int full_groups = (stride == 1) ? (vert_count / 4) : 0;
+	const int group_count = (vert_count + 3) / 4;
+
+	for (int g = 0; g < group_count; ++g) {
+		const float4 *w = weights + (g * CTRL_COUNT);
+		float4 x = w[0] * ctrl[0].x;
+		float4 y = w[0] * ctrl[0].y;
+		float4 z = w[0] * ctrl[0].z;
+		for (int k = 1; k < CTRL_COUNT; ++k) {
+			const Vec3 &c = ctrl[k * ctrl_stride];
+			x = x + (w[k] * c.x);
+			y = y + (w[k] * c.y);
+			z = z + (w[k] * c.z);
+		}
+
+		if (g < full_groups) {
+			// Transpose the four vertices into xyz order and store them
+			// with three writes
+			const __m128 xy_lo = _mm_unpacklo_ps(x.data, y.data); // x0 y0 x1 y1
+			const __m128 xy_hi = _mm_unpackhi_ps(x.data, y.data); // x2 y2 x3 y3
+			const __m128 zx_0 = _mm_shuffle_ps(z.data, x.data, _MM_SHUFFLE(1, 1, 0, 0)); // z0 z0 x1 x1
+			const __m128 yz_1 = _mm_shuffle_ps(y.data, z.data, _MM_SHUFFLE(1, 1, 1, 1)); // y1 y1 z1 z1
+			const __m128 zx_2 = _mm_shuffle_ps(z.data, x.data, _MM_SHUFFLE(3, 3, 2, 2)); // z2 z2 x3 x3
+			const __m128 yz_3 = _mm_shuffle_ps(y.data, z.data, _MM_SHUFFLE(3, 3, 3, 3)); // y3 y3 z3 z3
+			float *o = &(out[g * 4].x);
+			_mm_storeu_ps(o, _mm_shuffle_ps(xy_lo, zx_0, _MM_SHUFFLE(2, 0, 1, 0)));
+			_mm_storeu_ps(o + 4, _mm_shuffle_ps(yz_1, xy_hi, _MM_SHUFFLE(1, 0, 2, 0)));
+			_mm_storeu_ps(o + 8, _mm_shuffle_ps(zx_2, yz_3, _MM_SHUFFLE(2, 0, 2, 0)));
+		} else {
+			const int lanes = std::min(4, vert_count - (g * 4));
+			for (int l = 0; l < lanes; ++l)
+				out[((g * 4) + l) * stride] = Vec3(x[l], y[l], z[l]);
+		}
+	}
+}
+
+} // namespace Dicing
+
+#endif // DICING_HPP
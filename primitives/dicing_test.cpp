@@ -0,0 +1,237 @@
+#include "test.hpp"
+
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "numtype.h"
+#include "vector.hpp"
+#include "rng.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+#include "config.hpp"
+#include "grid.hpp"
+#include "bilinear.hpp"
+#include "bicubic.hpp"
+
+
+// Exact evaluation of a cubic bezier patch, in double precision
+static void eval_bicubic(const Vec3 p[16], double u, double v, double out[3])
+{
+	const double bu[4] = {(1-u)*(1-u)*(1-u), 3*(1-u)*(1-u)*u, 3*(1-u)*u*u, u*u*u};
+	const double bv[4] = {(1-v)*(1-v)*(1-v), 3*(1-v)*(1-v)*v, 3*(1-v)*v*v, v*v*v};
+	for (int a = 0; a < 3; ++a) {
+		out[a] = 0.0;
+		for (int j = 0; j < 4; ++j)
+			for (int k = 0; k < 4; ++k)
+				out[a] += bv[j] * bu[k] * p[(j*4)+k][a];
+	}
+}
+
+// Exact evaluation of a bilinear patch, in double precision
+static void eval_bilinear(const Vec3 p[4], double u, double v, double out[3])
+{
+	for (int a = 0; a < 3; ++a) {
+		const double e1 = p[0][a] + ((double(p[1][a]) - p[0][a]) * u);
+		const double e2 = p[3][a] + ((double(p[2][a]) - p[3][a]) * u);
+		out[a] = e1 + ((e2 - e1) * v);
+	}
+}
+
+// Scalar double precision forward differencing of a cubic bezier
+// curve, as the grid dicing used to be done.  Only used as a baseline
+// for the benchmark.
+static void scalar_cubic_bezier_curve(int vert_count, int stride, Vec3 output[], const Vec3 &v0, const Vec3 &v1, const Vec3 &v2, const Vec3 &v3)
+{
+	const double dt = 1.0 / (vert_count - 1);
+	double d0[3], d1[3], d2[3], d3[3];
+	for (int a = 0; a < 3; ++a) {
+		d0[a] = v0[a];
+		d1[a] = (double(v1[a]) - v0[a]) * 3 * dt;
+		d2[a] = ((double(v0[a]) * 6) - (double(v1[a]) * 12) + (double(v2[a]) * 6)) * dt * dt;
+		d3[a] = ((double(v0[a]) * -6) + (double(v1[a]) * 18) - (double(v2[a]) * 18) + (double(v3[a]) * 6)) * dt * dt * dt;
+	}
+
+	output[0] = v0;
+	for (int i = 1; i < vert_count; ++i) {
+		for (int a = 0; a < 3; ++a) {
+			d0[a] += d1[a] + (d2[a] * 0.5) + (d3[a] * (1.0 / 6.0));
+			d1[a] += d2[a] + (d3[a] * 0.5);
+			d2[a] += d3[a];
+		}
+		output[i*stride] = Vec3(d0[0], d0[1], d0[2]);
+	}
+}
+
+static void scalar_bicubic_dice(const Vec3 p[16], Grid *grid)
+{
+	const int ru = grid->res_u;
+	const int rv = grid->res_v;
+	std::vector<Vec3> vs(rv*4);
+	for (int i = 0; i < 4; ++i)
+		scalar_cubic_bezier_curve(rv, 4, vs.data()+i, p[i], p[i+4], p[i+8], p[i+12]);
+	for (int v = 0; v < rv; ++v)
+		scalar_cubic_bezier_curve(ru, 1, grid->verts+(ru*v), vs[(v*4)], vs[(v*4)+1], vs[(v*4)+2], vs[(v*4)+3]);
+}
+
+static Vec3 random_vec(RNG &rng, float scale)
+{
+	return Vec3(rng.next_float_c() * scale, rng.next_float_c() * scale, rng.next_float_c() * scale);
+}
+
+static Bicubic random_bicubic(RNG &rng, float scale)
+{
+	Vec3 p[16];
+	for (int i = 0; i < 16; ++i)
+		p[i] = random_vec(rng, scale);
+	return Bicubic(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+	               p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
+}
+
+// Largest distance of the diced grid's vertices from the exact
+// surface, relative to the given scale
+template <typename EVAL>
+static double max_rel_error(const Grid &grid, int time, float scale, EVAL eval)
+{
+	double max_err = 0.0;
+	for (int y = 0; y < grid.res_v; ++y) {
+		for (int x = 0; x < grid.res_u; ++x) {
+			double e[3];
+			eval(double(x) / (grid.res_u - 1), double(y) / (grid.res_v - 1), e);
+			const Vec3 &g = grid.verts[((grid.res_u*y)+x)*grid.time_count + time];
+			for (int a = 0; a < 3; ++a)
+				max_err = std::max(max_err, std::abs(g[a] - e[a]) / scale);
+		}
+	}
+	return max_err;
+}
+
+
+/*
+ * Test suite for grid dicing.
+ */
+BOOST_AUTO_TEST_SUITE(dicing);
+
+// Test that the grid corners are exactly the patch corners
+BOOST_AUTO_TEST_CASE(corners_1)
+{
+	RNG rng(1);
+	Bicubic bicubic = random_bicubic(rng, 10.0f);
+	Bilinear bilinear(random_vec(rng, 10.0f), random_vec(rng, 10.0f), random_vec(rng, 10.0f), random_vec(rng, 10.0f));
+
+	for (int s = 0; s <= 6; ++s) {
+		const int r = (1 << s) + 1;
+		std::unique_ptr<Grid> g1(bicubic.grid_dice(r, r));
+		std::unique_ptr<Grid> g2(bilinear.grid_dice(r, r));
+		const auto &p1 = bicubic.verts[0];
+		const auto &p2 = bilinear.verts[0];
+
+		BOOST_CHECK(g1->verts[0] == p1[0]);
+		BOOST_CHECK(g1->verts[r-1] == p1[3]);
+		BOOST_CHECK(g1->verts[r*(r-1)] == p1[12]);
+		BOOST_CHECK(g1->verts[(r*r)-1] == p1[15]);
+
+		BOOST_CHECK(g2->verts[0] == p2[0]);
+		BOOST_CHECK(g2->verts[r-1] == p2[1]);
+		BOOST_CHECK(g2->verts[r*(r-1)] == p2[3]);
+		BOOST_CHECK(g2->verts[(r*r)-1] == p2[2]);
+	}
+}
+
+// Test that bicubic grids are accurate at all resolutions, including
+// ones that aren't a multiple of the SIMD width
+BOOST_AUTO_TEST_CASE(bicubic_1)
+{
+	RNG rng(2);
+	double max_err = 0.0;
+
+	for (int n = 0; n < 20; ++n) {
+		Bicubic bicubic = random_bicubic(rng, 10.0f);
+		for (int ru = 2; ru <= 67; ru += 5) {
+			const int rv = 69 - ru;
+			std::unique_ptr<Grid> grid(bicubic.grid_dice(ru, rv));
+			max_err = std::max(max_err, max_rel_error(*grid, 0, 10.0f, [&](double u, double v, double *out) {
+				eval_bicubic(bicubic.verts[0].data(), u, v, out);
+			}));
+		}
+	}
+
+	BOOST_CHECK_LT(max_err, 1e-5);
+}
+
+// Test that bilinear grids are accurate at all resolutions
+BOOST_AUTO_TEST_CASE(bilinear_1)
+{
+	RNG rng(3);
+	double max_err = 0.0;
+
+	for (int n = 0; n < 20; ++n) {
+		Bilinear bilinear(random_vec(rng, 10.0f), random_vec(rng, 10.0f), random_vec(rng, 10.0f), random_vec(rng, 10.0f));
+		for (int ru = 2; ru <= 67; ru += 5) {
+			const int rv = 69 - ru;
+			std::unique_ptr<Grid> grid(bilinear.grid_dice(ru, rv));
+			max_err = std::max(max_err, max_rel_error(*grid, 0, 10.0f, [&](double u, double v, double *out) {
+				eval_bilinear(bilinear.verts[0].data(), u, v, out);
+			}));
+		}
+	}
+
+	BOOST_CHECK_LT(max_err, 1e-5);
+}
+
+// Test that each time sample is diced into its own slots
+BOOST_AUTO_TEST_CASE(time_samples_1)
+{
+	RNG rng(4);
+	Bicubic bicubic = random_bicubic(rng, 10.0f);
+	Vec3 p[16];
+	for (int i = 0; i < 16; ++i)
+		p[i] = bicubic.verts[0][i] + Vec3(100.0f, 0.0f, 0.0f);
+	bicubic.add_time_sample(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+	                        p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
+
+	std::unique_ptr<Grid> grid(bicubic.grid_dice(9, 17));
+	for (int t = 0; t < 2; ++t) {
+		const double err = max_rel_error(*grid, t, 10.0f, [&](double u, double v, double *out) {
+			eval_bicubic(bicubic.verts[t].data(), u, v, out);
+		});
+		BOOST_CHECK_LT(err, 1e-5);
+	}
+}
+
+// Reports how many grids per second are diced at each subdivision level.
+// Doesn't test anything, so it's disabled by default.  Run it with
+// --run_test=dicing/dicing_benchmark.
+BOOST_AUTO_TEST_CASE(dicing_benchmark, * boost::unit_test::disabled())
+{
+	RNG rng(5);
+	Bicubic bicubic = random_bicubic(rng, 10.0f);
+	Bilinear bilinear(random_vec(rng, 10.0f), random_vec(rng, 10.0f), random_vec(rng, 10.0f), random_vec(rng, 10.0f));
+
+	BOOST_TEST_MESSAGE("Grid dicing, grids per second:");
+	BOOST_TEST_MESSAGE("    subdivs  bilinear  bicubic  bicubic (scalar)");
+	for (size_t s = 0; s <= intlog2(Config::max_grid_size); ++s) {
+		const int r = (1 << s) + 1;
+		const int count = std::max(16, (1 << 20) / (r * r));
+
+		Timer<> timer;
+		for (int i = 0; i < count; ++i)
+			delete bilinear.grid_dice(r, r);
+		const float bilinear_rate = count / timer.time();
+
+		timer.reset();
+		for (int i = 0; i < count; ++i)
+			delete bicubic.grid_dice(r, r);
+		const float bicubic_rate = count / timer.time();
+
+		timer.reset();
+		for (int i = 0; i < count; ++i) {
+			Grid grid(r, r, 1);
+			scalar_bicubic_dice(bicubic.verts[0].data(), &grid);
+		}
+		const float scalar_rate = count / timer.time();
+
+		BOOST_TEST_MESSAGE("    " << s << "  " << bilinear_rate << "  " << bicubic_rate << "  " << scalar_rate);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END();
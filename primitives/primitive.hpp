@@ -11,6 +11,9 @@
 #include "intersection.hpp"
 #include "bbox.hpp"
 #include "micro_surface.hpp"
+#include "memory_arena.hpp"
+#include "config.hpp"
+#include "utils.hpp"
 
 
 /**
@@ -44,7 +47,8 @@ class Primitive: public Boundable
 {
 public:
 	size_t uid; // Unique ID, used by Scene and Tracer for various purposes
-	// Sub-classes don't need to worry about it.
+	uint64_t uid2 {1}; // Sub-ID of a primitive split off of the one with the above uid, 1 if unsplit
+	// Sub-classes don't need to worry about them.
 
 	virtual ~Primitive() {}
 
@@ -78,16 +82,42 @@ class DiceableSurfacePrimitive: public Primitive
 public:
 	virtual ~DiceableSurfacePrimitive() {}
 
+	/**
+	 * @brief Returns the log base 2 of the widest extent of the primitive.
+	 *
+	 * This is all subdiv_estimate() needs from the primitive, so it can
+	 * be stored (e.g. in a cache) to estimate subdivisions for the
+	 * primitive without needing the primitive itself.
+	 */
+	virtual float log_width() const = 0;
+
 	/**
 	 * @brief Returns the number of subdivisions necessary to achieve the
 	 * given target width of microgeometry.
 	 */
-	virtual size_t subdiv_estimate(float width) const = 0;
+	size_t subdiv_estimate(float width) const {
+		return subdiv_estimate_from_log_width(log_width(), width);
+	}
 
 	/**
-	 * @brief Returns a pointer to a heap-allocated duplicate of the primitive.
+	 * @brief Returns the number of subdivisions necessary to achieve the
+	 * given target width of microgeometry, for a primitive with the given
+	 * log_width().
 	 */
-	virtual std::unique_ptr<DiceableSurfacePrimitive> copy() = 0;
+	static size_t subdiv_estimate_from_log_width(float log_width, float width) {
+		// Since we want to end up with the log-base-2 of
+		// the division anyway, we just do the log first and
+		// subtract.  Using a very approximate log2, but in
+		// practice it works fine.
+		const float rate = log_width - fasterlog2(width * Config::dice_rate) + 1.0f;
+		return std::max(rate, 0.0f);
+	}
+
+	/**
+	 * @brief Returns a pointer to a duplicate of the primitive, allocated
+	 * in the given arena.
+	 */
+	virtual DiceableSurfacePrimitive *copy(MemoryArena &arena) = 0;
 
 	/**
 	 * @brief Splits a primitive into two or more sub-primitives.  Splitting MUST be
@@ -95,6 +125,8 @@ public:
 	 * same output primitives in the same order.
 	 *
 	 * Places pointers to the primitives in the given primitives pointer array.
+	 * The new primitives are allocated in the given arena, and live until
+	 * it is reset.
 	 *
 	 * @warning To implementors: the implementation of this method must allow
 	 * the primitive itself to be replaced by one of the new primitives.  So make
@@ -103,7 +135,20 @@ public:
 	 *
 	 * @return The number of new primitives generated from the split
 	 */
-	virtual int split(std::unique_ptr<DiceableSurfacePrimitive> primitives[]) = 0;
+	virtual int split(DiceableSurfacePrimitive *primitives[], MemoryArena &arena) = 0;
+
+	/**
+	 * @brief Returns the parametric axis that split() splits the primitive
+	 * on: 0 for u and 1 for v.
+	 *
+	 * This is only for primitives that split into exactly two halves at
+	 * the parametric midpoint of the axis, with the low half first and
+	 * the same parameterization as the primitive.  All other primitives
+	 * should return -1, which is the default.
+	 */
+	virtual int split_axis() const {
+		return -1;
+	}
 
 	/**
 	 * @brief Dices the surface into a MicroSurface.
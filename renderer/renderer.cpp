@@ -21,9 +21,21 @@
 #include "config.hpp"
 #include "global.hpp"
 #include "micro_surface_cache.hpp"
+#include "micro_surface.hpp"
+#include "grid.hpp"
 
 #define GAMMA 2.2
 
+static void print_slab_pool_stats(const char *name, const SlabPool &pool)
+{
+	std::cout << name << " pool idle bytes: " << pool.idle_size() << std::endl;
+	for (const auto &s: pool.stats()) {
+		std::cout << "    level " << s.level << ", " << s.time_count << " time samples, " << s.block_bytes << " byte blocks: "
+		          << s.allocs << " allocs, " << s.reuses << " reused, " << s.discards << " discarded, "
+		          << s.peak_live << " peak live, " << s.idle << " idle" << std::endl;
+	}
+}
+
 void write_png_from_film(Film<Color> *image, std::string path, float min_time=4.0)
 {
 	static Timer<> timer;
@@ -52,6 +64,8 @@ bool Renderer::render(int thread_count)
 
 	// Clear rendering statistics
 	Global::Stats::clear();
+	MicroSurface::pool().clear_stats();
+	Grid::pool().clear_stats();
 
 	RNG rng;
 	std::unique_ptr<Film<Color>> image {new Film<Color>(res_x, res_y,
@@ -92,7 +106,9 @@ bool Renderer::render(int thread_count)
 #endif
 	std::cout << "Primitive-ray tests during rendering: " << Global::Stats::primitive_ray_tests << std::endl;
 	std::cout << "Splits during rendering: " << Global::Stats::split_count << std::endl;
+	std::cout << "MicroSurface cache hits during rendering: " << Global::Stats::cache_hits << std::endl;
 	std::cout << "MicroSurface cache misses during rendering: " << Global::Stats::cache_misses << std::endl;
+	std::cout << "MicroSurface cache hits on an ancestor during rendering: " << Global::Stats::ancestor_cache_hits << std::endl;
 	std::cout << "MicroSurfaces generated during rendering: " << Global::Stats::microsurface_count << std::endl;
 	std::cout << "MicroSurface elements generated during rendering: " << Global::Stats::microelement_count << std::endl;
 	std::cout << "Average MicroSurface elements per MicroSurface: " <<  Global::Stats::microelement_count / static_cast<float>(Global::Stats::microsurface_count) << std::endl;
@@ -100,6 +116,8 @@ bool Renderer::render(int thread_count)
 	std::cout << "Maximum MicroSurface elements per MicroSurface: " <<  Global::Stats::microelement_max_count << std::endl;
 	std::cout << "NaN's encountered: " <<  Global::Stats::nan_count << std::endl;
 	std::cout << "Bad Inf's encountered: " <<  Global::Stats::inf_count << std::endl;
+	print_slab_pool_stats("MicroSurface", MicroSurface::pool());
+	print_slab_pool_stats("Grid", Grid::pool());
 #endif
 
 	std::cout << "Render time (seconds): " << timer.time() << std::endl;
@@ -18,6 +18,8 @@
 #include "prim_array.hpp"
 #include "primitive.hpp"
 #include "light.hpp"
+#include "memory_arena.hpp"
+#include "config.hpp"
 
 /**
  * @brief A 3D scene for rendering.
@@ -30,9 +32,13 @@
  * structures, etc.) before being passed off for rendering.
  */
 struct Scene {
+	static constexpr int PRESPLIT_MAX_DEPTH = 8; // Max splits of a primitive in presplit()
+
 	std::unique_ptr<Camera> camera;
 	std::vector<std::unique_ptr<Primitive>> primitives;
 	std::vector<std::unique_ptr<Light>> finite_lights;
+	MemoryArena presplit_arena; // Owns the sub-primitives made by presplit()
+	std::vector<Primitive*> world_primitives; // The primitives actually in the world BVH
 	BVH4 world;
 
 	Scene() {}
@@ -49,9 +55,68 @@ struct Scene {
 		finite_lights.push_back(std::move(light));
 	}
 
+	/**
+	 * @brief Splits diceable primitives that are large relative to the
+	 * scene into sub-primitives, and fills in world_primitives.
+	 *
+	 * A big patch (e.g. a ground plane) can only be bound loosely by the
+	 * BVH4, overlapping much of the rest of the scene, and every ray that
+	 * gets near it has to split it down in the tracer.  Splitting it once
+	 * up front instead gives the BVH4 tight bounds to work with.
+	 *
+	 * Primitives are split until their bounds' surface area is at most
+	 * Config::presplit_max_area times the scene's.  The sub-primitives
+	 * keep the uid of the primitive they were split from, and get the
+	 * uid2 the tracer would have given them, so they're cached the same
+	 * way as if they had been split during tracing.
+	 */
+	void presplit() {
+		world_primitives.clear();
+		presplit_arena.reset();
+
+		BBox scene_bounds;
+		for (auto &p: primitives)
+			scene_bounds.merge_with(p->bounds().at_time(0.5));
+		const float max_area = scene_bounds.surface_area() * Config::presplit_max_area;
+
+		MemoryArena arena;
+		std::vector<std::pair<DiceableSurfacePrimitive*, uint64_t>> stack;
+		for (auto &p: primitives) {
+			auto diceable = dynamic_cast<DiceableSurfacePrimitive*>(p.get());
+			if (max_area <= 0.0f || !diceable || diceable->bounds().at_time(0.5).surface_area() <= max_area) {
+				world_primitives.push_back(p.get());
+				continue;
+			}
+
+			// Split depth-first, so the sub-primitives come out in the
+			// same order every time
+			arena.reset();
+			stack.emplace_back(diceable, 1);
+			while (!stack.empty()) {
+				DiceableSurfacePrimitive *prim = stack.back().first;
+				const uint64_t uid2 = stack.back().second;
+				stack.pop_back();
+
+				if (prim->bounds().at_time(0.5).surface_area() <= max_area || uid2 >= (uint64_t(1) << (PRESPLIT_MAX_DEPTH * 2))) {
+					DiceableSurfacePrimitive *sub = prim->copy(presplit_arena);
+					sub->uid = p->uid;
+					sub->uid2 = uid2;
+					world_primitives.push_back(sub);
+					continue;
+				}
+
+				DiceableSurfacePrimitive *children[4];
+				const int child_count = prim->split(children, arena);
+				for (int i = child_count - 1; i >= 0; --i)
+					stack.emplace_back(children[i], (uid2 << 2) | i);
+			}
+		}
+	}
+
 	// Finalizes the scene for rendering
 	void finalize() {
-		world.add_primitives(&primitives);
+		presplit();
+		world.add_primitives(world_primitives);
 		world.finalize();
 	}
 };
@@ -0,0 +1,112 @@
+#include "test.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "numtype.h"
+#include "vector.hpp"
+#include "rng.hpp"
+#include "bilinear.hpp"
+#include "memory_arena.hpp"
+#include "config.hpp"
+#include "scene.hpp"
+
+
+// Adds a large ground plane followed by a scattering of small patches
+// above it, returning the ground plane
+static Bilinear *fill_scene(Scene &scene)
+{
+	Bilinear *ground = new Bilinear(Vec3(-100.0f, 0.0f, -100.0f), Vec3(100.0f, 0.0f, -100.0f), Vec3(100.0f, 0.0f, 100.0f), Vec3(-100.0f, 0.0f, 100.0f));
+	ground->finalize();
+	scene.add_primitive(std::unique_ptr<Primitive>(ground));
+
+	RNG rng(7);
+	for (int i = 0; i < 50; ++i) {
+		const Vec3 p(rng.next_float_c() * 90.0f, 1.0f + rng.next_float() * 50.0f, rng.next_float_c() * 90.0f);
+		Bilinear *patch = new Bilinear(p, p + Vec3(1.0f, 0.0f, 0.0f), p + Vec3(1.0f, 1.0f, 0.0f), p + Vec3(0.0f, 1.0f, 0.0f));
+		patch->finalize();
+		scene.add_primitive(std::unique_ptr<Primitive>(patch));
+	}
+
+	return ground;
+}
+
+
+/*
+ * Test suite for Scene.
+ */
+BOOST_AUTO_TEST_SUITE(scene);
+
+// Test that a large patch is split into sub-patches covering it, which
+// match what splitting down their uid2 paths in the tracer produces, and
+// that small patches are left alone
+BOOST_AUTO_TEST_CASE(presplit_1)
+{
+	Scene scene;
+	Bilinear *ground = fill_scene(scene);
+	scene.presplit();
+
+	std::vector<Primitive*> pieces;
+	size_t unsplit_count = 0;
+	for (auto p: scene.world_primitives) {
+		if (p->uid == ground->uid)
+			pieces.push_back(p);
+		else if (p->uid2 == 1)
+			++unsplit_count;
+	}
+	BOOST_CHECK_EQUAL(unsplit_count, scene.primitives.size() - 1);
+	BOOST_CHECK(pieces.size() > 1);
+
+	BBox pieces_bounds;
+	std::vector<uint64_t> uid2s;
+	bool match = true;
+	MemoryArena arena;
+	for (auto piece: pieces) {
+		pieces_bounds.merge_with(piece->bounds().at_time(0.5));
+		uid2s.push_back(piece->uid2);
+
+		int depth = 0;
+		for (uint64_t i = piece->uid2; i > 1; i >>= 2)
+			++depth;
+		DiceableSurfacePrimitive *prim = ground;
+		for (int level = depth - 1; level >= 0; --level) {
+			DiceableSurfacePrimitive *children[4];
+			prim->split(children, arena);
+			prim = children[(piece->uid2 >> (level * 2)) & 3];
+		}
+		const BBox a = prim->bounds().at_time(0.5);
+		const BBox b = piece->bounds().at_time(0.5);
+		match = match && a.min.x == b.min.x && a.min.z == b.min.z && a.max.x == b.max.x && a.max.z == b.max.z;
+	}
+	BOOST_CHECK(match);
+
+	std::sort(uid2s.begin(), uid2s.end());
+	BOOST_CHECK(std::adjacent_find(uid2s.begin(), uid2s.end()) == uid2s.end());
+
+	const BBox ground_bounds = ground->bounds().at_time(0.5);
+	BOOST_CHECK_EQUAL(pieces_bounds.min.x, ground_bounds.min.x);
+	BOOST_CHECK_EQUAL(pieces_bounds.min.z, ground_bounds.min.z);
+	BOOST_CHECK_EQUAL(pieces_bounds.max.x, ground_bounds.max.x);
+	BOOST_CHECK_EQUAL(pieces_bounds.max.z, ground_bounds.max.z);
+}
+
+// Test that a presplit_max_area of zero disables pre-splitting
+BOOST_AUTO_TEST_CASE(presplit_2)
+{
+	const float max_area = Config::presplit_max_area;
+	Config::presplit_max_area = 0.0f;
+
+	Scene scene;
+	fill_scene(scene);
+	scene.presplit();
+
+	BOOST_CHECK_EQUAL(scene.world_primitives.size(), scene.primitives.size());
+	bool same = true;
+	for (size_t i = 0; i < scene.primitives.size(); ++i)
+		same = same && scene.world_primitives[i] == scene.primitives[i].get();
+	BOOST_CHECK(same);
+
+	Config::presplit_max_area = max_area;
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,9 @@
+#include "numtype.h"
+
+#include "config.hpp"
+#include "split_cache.hpp"
+
+namespace SplitCache
+{
+ConcurrentCache<Key, SplitNode> cache(Config::split_cache_size * (1000*1000));
+}
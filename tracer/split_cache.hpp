@@ -0,0 +1,45 @@
+#ifndef SPLIT_CACHE_HPP
+#define SPLIT_CACHE_HPP
+
+#include "numtype.h"
+
+#include <array>
+
+#include "bbox.hpp"
+#include "concurrent_cache.hpp"
+#include "micro_surface_cache.hpp"
+
+
+/**
+ * @brief Cache of the results of splitting diceable surface primitives.
+ *
+ * Keyed the same way as the MicroSurfaceCache: uid1 is the root
+ * primitive's uid, and uid2 identifies the path of splits taken to get to
+ * a sub-primitive.  Each entry stores what the tracer needs from the
+ * children of a split in order to traverse into them: their bounds and
+ * their subdivision estimate parameter.  With that, the tracer can
+ * descend to a cached MicroSurface without re-splitting the primitive.
+ */
+namespace SplitCache
+{
+typedef MicroSurfaceCache::Key Key;
+
+struct SplitNode {
+	int child_count {0};
+	std::array<BBoxT, 4> bounds;
+	std::array<float, 4> log_widths; // DiceableSurfacePrimitive::log_width() of each child
+	int split_axis {-1}; // DiceableSurfacePrimitive::split_axis() of the split primitive
+};
+
+static inline size_t size_in_bytes(const SplitNode& node)
+{
+	size_t size = sizeof(SplitNode);
+	for (int i = 0; i < node.child_count; ++i)
+		size += sizeof(BBox) * node.bounds[i].bbox.size();
+	return size;
+}
+
+extern ConcurrentCache<Key, SplitNode> cache;
+}
+
+#endif // SPLIT_CACHE_HPP
@@ -6,40 +6,107 @@
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <atomic>
 #include <assert.h>
 
 #include "global.hpp"
+#include "config.hpp"
 #include "array.hpp"
 #include "slice.hpp"
-#include "counting_sort.hpp"
+#include "radix_sort.hpp"
+#include "morton.hpp"
 #include "utils.hpp"
 #include "low_level.hpp"
+#include "work_stealing.hpp"
+#include "memory_arena.hpp"
 
 #include "micro_surface.hpp"
 #include "micro_surface_cache.hpp"
+#include "split_cache.hpp"
 
 #include "ray.hpp"
 #include "intersection.hpp"
 #include "scene.hpp"
 
 #define RAY_STATE_SIZE scene->world.ray_state_size()
-#define MAX_POTINT 1u
+#define MAX_POTINT 4u
 #define RAY_JOB_SIZE (1024*4)
 
 
 uint32_t Tracer::trace(const Slice<Ray> rays_, Slice<Intersection> intersections_)
+{
+	intersections.init_from(intersections_);
+	occlusion_results = Slice<uint8_t>();
+	occlusion_only = false;
+
+	return trace_rays(rays_);
+}
+
+
+uint32_t Tracer::occluded(const Slice<Ray> rays_, Slice<uint8_t> occluded_)
+{
+	occlusion_results.init_from(occluded_);
+	intersections = Slice<Intersection>();
+	occlusion_only = true;
+
+	return trace_rays(rays_);
+}
+
+
+uint32_t Tracer::trace_rays(const Slice<Ray> rays_)
 {
 	Global::Stats::rays_shot += rays_.size();
-	// Get rays
-	rays.init_from(rays_);
 
-	// Get and initialize intersections
-	intersections.init_from(intersections_);
-	std::fill(intersections.begin(), intersections.end(), Intersection());
+	if (!reorder_rays || rays_.size() < 2) {
+		rays.init_from(rays_);
+		trace_batch();
+		return rays.size();
+	}
 
+	// Trace the rays in sorted order, and then scatter the results
+	// back to the order they were given in
+	sort_rays(rays_);
+	rays.init_from(sorted_rays);
+	if (occlusion_only) {
+		Slice<uint8_t> results = occlusion_results;
+		sorted_occlusion_results.resize(rays.size());
+		occlusion_results.init_from(sorted_occlusion_results);
+		trace_batch();
+		for (size_t i = 0; i < rays.size(); i++)
+			results[(uint32_t)ray_keys[i]] = sorted_occlusion_results[i];
+		occlusion_results = results;
+	} else {
+		Slice<Intersection> results = intersections;
+		sorted_intersections.resize(rays.size());
+		intersections.init_from(sorted_intersections);
+		trace_batch();
+		for (size_t i = 0; i < rays.size(); i++)
+			results[(uint32_t)ray_keys[i]] = sorted_intersections[i];
+		intersections = results;
+	}
+
+	return rays.size();
+}
+
+
+void Tracer::trace_batch()
+{
 	// Print number of rays being traced
 	//std::cout << "\tTracing " << rays.size() << " rays" << std::endl;
 
+	// Initialize results
+	if (occlusion_only)
+		std::fill_n(occlusion_results.begin(), occlusion_results.size(), 0);
+	else
+		std::fill_n(intersections.begin(), intersections.size(), Intersection());
+
+	// Clear out deferred hits
+	if (!occlusion_only) {
+		deferred_hits.resize(rays.size());
+		for (auto& d: deferred_hits)
+			d.surface.reset();
+	}
+
 	// Allocate and clear out ray states
 	states.resize(rays.size()*RAY_STATE_SIZE);
 	std::fill(states.begin(), states.end(), 0);
@@ -48,57 +115,309 @@ uint32_t Tracer::trace(const Slice<Ray> rays_, Slice<Intersection> intersections
 	rays_active.resize(rays.size());
 	std::fill(rays_active.begin(), rays_active.end(), true);
 
-	// Allocate potential intersection buffer
-	potential_intersections.resize(rays.size()*MAX_POTINT);
+	// Make sure there's a scratch arena for each worker
+	while (arenas.size() < (size_t)std::max(thread_count, 1))
+		arenas.emplace_back();
+
+	if (scene->world.treelet_count() > 1) {
+		trace_by_treelet();
+	} else {
+		// Trace potential intersections, dropping finished rays from the
+		// list of rays to trace after each pass
+		ray_list.resize(rays.size());
+		for (size_t i = 0; i < rays.size(); i++)
+			ray_list[i] = i;
+		while (accumulate_potential_intersections(false)) {
+			trace_potential_intersections();
+			ray_list.erase(std::remove_if(ray_list.begin(), ray_list.end(), [this](uint32_t i) {
+				return !rays_active[i];
+			}), ray_list.end());
+		}
+	}
+
+	if (!occlusion_only)
+		resolve_deferred_hits();
+}
+
 
-	// Trace potential intersections
-	while (accumulate_potential_intersections()) {
-		trace_potential_intersections();
+void Tracer::resolve_deferred_hits()
+{
+	// Each ray's hit is resolved independently, so jobs of rays can
+	// be handed out to the worker threads freely
+	const size_t job_count = (rays.size() + RAY_JOB_SIZE - 1) / RAY_JOB_SIZE;
+	std::atomic<size_t> next_job {0};
+	run_workers([this, job_count, &next_job](size_t) {
+		for (size_t job = next_job++; job < job_count; job = next_job++) {
+			const size_t job_end = std::min(rays.size(), (job + 1) * RAY_JOB_SIZE);
+			for (size_t i = job * RAY_JOB_SIZE; i < job_end; i++) {
+				DeferredHit& d = deferred_hits[i];
+				if (d.surface) {
+					d.surface->calc_intersection(rays[i], d.hit, &(intersections[i]));
+					d.surface.reset();
+				}
+			}
+		}
+	});
+}
+
+
+void Tracer::trace_by_treelet()
+{
+	// Queue all rays at the treelet their traversal starts in
+	const uint treelet_count = scene->world.treelet_count();
+	treelet_queues.resize(treelet_count);
+	for (auto& queue: treelet_queues)
+		queue.clear();
+	for (size_t i = 0; i < rays.size(); i++)
+		treelet_queues[scene->world.ray_treelet(&(states[i*RAY_STATE_SIZE]))].push_back(i);
+
+	// Sweep over the treelets until all the queues are empty.  Rays
+	// mostly move on to treelets later in the order, so a sweep gets
+	// most of them quite far.
+	bool queued = true;
+	while (queued) {
+		queued = false;
+		for (uint t = 0; t < treelet_count; t++) {
+			if (treelet_queues[t].empty())
+				continue;
+			queued = true;
+
+			// Trace the treelet's rays until they've all left it
+			ray_list.swap(treelet_queues[t]);
+			treelet_queues[t].clear();
+			while (!ray_list.empty()) {
+				if (accumulate_potential_intersections(true))
+					trace_potential_intersections();
+
+				size_t kept = 0;
+				for (const uint32_t i: ray_list) {
+					const uint next = scene->world.ray_treelet(&(states[i*RAY_STATE_SIZE]));
+					if (!rays_active[i] || next == Collection::NO_TREELET)
+						continue;
+					else if (next == t)
+						ray_list[kept++] = i;
+					else
+						treelet_queues[next].push_back(i);
+				}
+				ray_list.resize(kept);
+			}
+		}
+	}
+}
+
+
+void Tracer::sort_rays(const Slice<Ray> rays_)
+{
+	const size_t ray_count = rays_.size();
+
+	// Find the bounds of the ray origins
+	Vec3 o_min = rays_[0].o;
+	Vec3 o_max = rays_[0].o;
+	for (size_t i = 1; i < ray_count; i++) {
+		o_min = min(o_min, rays_[i].o);
+		o_max = max(o_max, rays_[i].o);
 	}
 
-	return rays.size();
+	// Quantize the origins to 9 bits per axis within those bounds, which
+	// leaves room above their morton code for the three octant bits
+	constexpr uint32_t O_RES = (1 << 9) - 1;
+	const Vec3 extent = o_max - o_min;
+	const Vec3 o_scale {extent.x > 0.0f ? O_RES / extent.x : 0.0f,
+	                    extent.y > 0.0f ? O_RES / extent.y : 0.0f,
+	                    extent.z > 0.0f ? O_RES / extent.z : 0.0f};
+
+	ray_keys.resize(ray_count);
+	ray_keys_scratch.resize(ray_count);
+	for (size_t i = 0; i < ray_count; i++) {
+		const Vec3 o = (rays_[i].o - o_min) * o_scale;
+		const uint32_t x = std::min<uint32_t>(O_RES, o.x);
+		const uint32_t y = std::min<uint32_t>(O_RES, o.y);
+		const uint32_t z = std::min<uint32_t>(O_RES, o.z);
+		const auto d_sign = rays_[i].get_d_sign();
+		const uint32_t octant = d_sign[0] | (d_sign[1] << 1) | (d_sign[2] << 2);
+		const uint32_t key = (octant << 27) | Morton::xyz2d(x, y, z);
+		ray_keys[i] = ((uint64_t)key << 32) | i;
+	}
+
+	// Sort them.  The sort is stable, so rays with the same key stay
+	// in their original order.
+	RadixSort::parallel_sort(ray_keys.data(), ray_keys_scratch.data(), ray_count, (8u << 27) - 1, [](uint64_t k) {
+		return (uint32_t)(k >> 32);
+	}, worker_pool());
+
+	sorted_rays.resize(ray_count);
+	for (size_t i = 0; i < ray_count; i++)
+		sorted_rays[i] = rays_[(uint32_t)ray_keys[i]];
+}
+
+
+WorkerPool& Tracer::worker_pool()
+{
+	const size_t worker_count = std::max(thread_count, 1);
+	if (!workers || workers->size() != worker_count)
+		workers.reset(new WorkerPool(worker_count));
+	return *workers;
+}
+
+
+void Tracer::run_workers(const std::function<void(size_t)>& worker)
+{
+	if (thread_count <= 1) {
+		worker(0);
+		return;
+	}
+
+	worker_pool().run(worker);
 }
 
 
-size_t Tracer::accumulate_potential_intersections()
+size_t Tracer::accumulate_potential_intersections(bool treelet_bound)
 {
-	// Clear out potential intersection buffer
-	potential_intersections.resize(rays.size()*MAX_POTINT);
-	for (auto& potint: potential_intersections)
-		potint.valid = false;
+	const size_t job_count = (ray_list.size() + RAY_JOB_SIZE - 1) / RAY_JOB_SIZE;
+	potint_ids.resize(rays.size()*MAX_POTINT);
+	potint_ts.resize(rays.size()*MAX_POTINT);
+	potint_counts.resize(rays.size());
+	potint_job_counts.resize(job_count*MAX_POTINT);
+	potint_slot_starts.resize(MAX_POTINT+1);
 
 	// Trace scene acceleration structure to accumulate
-	// potential intersections
-	size_t potint_ids[MAX_POTINT];
-	for (size_t i = 0; i < rays.size(); i++) {
-		if (rays_active[i]) {
-			const size_t pc = scene->world.get_potential_intersections(rays[i], intersections[i].t, MAX_POTINT, potint_ids, &(states[i*RAY_STATE_SIZE]));
-			rays_active[i] = (pc > 0);
-
-			for (size_t j = 0; j < pc; j++) {
-				potential_intersections[(i*MAX_POTINT)+j].valid = true;
-				potential_intersections[(i*MAX_POTINT)+j].object_id = potint_ids[j];
-				potential_intersections[(i*MAX_POTINT)+j].ray_index = i;
+	// potential intersections.  Each ray only writes to its own
+	// potential intersection slots, so jobs of rays can be handed
+	// out to the worker threads freely.  Each job also counts its
+	// potential intersections in each slot, for compaction below.
+	//
+	// Within each job the active rays are handed to the acceleration
+	// structure all at once, which lets it interleave their traversals.
+	std::atomic<size_t> next_job {0};
+	run_workers([this, job_count, treelet_bound, &next_job](size_t) {
+		std::vector<size_t> ids(RAY_JOB_SIZE*MAX_POTINT);
+		std::vector<float> ts(RAY_JOB_SIZE*MAX_POTINT);
+		std::vector<uint> counts(RAY_JOB_SIZE);
+		std::vector<uint32_t> batch;
+		std::vector<const Ray*> batch_rays;
+		std::vector<float> batch_tmaxes;
+		std::vector<void*> batch_states;
+
+		for (size_t job = next_job++; job < job_count; job = next_job++) {
+			size_t slot_counts[MAX_POTINT] = {};
+			const size_t job_end = std::min(ray_list.size(), (job + 1) * RAY_JOB_SIZE);
+
+			// Gather the job's active rays
+			batch.clear();
+			batch_rays.clear();
+			batch_tmaxes.clear();
+			batch_states.clear();
+			for (size_t k = job * RAY_JOB_SIZE; k < job_end; k++) {
+				const size_t i = ray_list[k];
+				potint_counts[i] = 0;
+				if (!rays_active[i])
+					continue;
+				batch.push_back(i);
+				batch_rays.push_back(&(rays[i]));
+				batch_tmaxes.push_back(closest_hit_t(i));
+				batch_states.push_back(&(states[i*RAY_STATE_SIZE]));
+			}
+
+			// Trace them
+			scene->world.get_potential_intersections_batch(batch.size(), batch_rays.data(), batch_tmaxes.data(), MAX_POTINT, ids.data(), ts.data(), counts.data(), batch_states.data(), treelet_bound);
+
+			for (size_t r = 0; r < batch.size(); r++) {
+				const size_t i = batch[r];
+				const size_t pc = counts[r];
+				// A ray that stopped at a treelet boundary isn't
+				// finished, even if it didn't find anything
+				rays_active[i] = (pc > 0) || (treelet_bound && scene->world.ray_treelet(batch_states[r]) != Collection::NO_TREELET);
+				for (size_t j = 0; j < pc; j++) {
+					potint_ids[(i*MAX_POTINT)+j] = ids[(r*MAX_POTINT)+j];
+					potint_ts[(i*MAX_POTINT)+j] = ts[(r*MAX_POTINT)+j];
+					slot_counts[j]++;
+				}
+				potint_counts[i] = pc;
 			}
+
+			for (size_t j = 0; j < MAX_POTINT; j++)
+				potint_job_counts[(j*job_count)+job] = slot_counts[j];
+		}
+	});
+
+	// Compute where each job's potential intersections go in the
+	// compacted buffer.  The buffer is ordered by slot first, so that
+	// each slot can be traced as a separate pass, and then by ray.
+	size_t potint_count = 0;
+	for (size_t j = 0; j < MAX_POTINT; j++) {
+		potint_slot_starts[j] = potint_count;
+		for (size_t job = 0; job < job_count; job++) {
+			const size_t count = potint_job_counts[(j*job_count)+job];
+			potint_job_counts[(j*job_count)+job] = potint_count;
+			potint_count += count;
 		}
 	}
+	potint_slot_starts[MAX_POTINT] = potint_count;
 
-	// Compact the potential intersections to only the valid ones
-	const auto last = std::partition(potential_intersections.begin(), potential_intersections.end(), [](const PotentialInter& p) {
-		return p.valid;
-	});
-	size_t potint_count = std::distance(potential_intersections.begin(), last);
+	// Compact the potential intersections into the buffer
 	potential_intersections.resize(potint_count);
+	potint_scratch.resize(potint_count);
+	next_job = 0;
+	run_workers([this, job_count, &next_job](size_t) {
+		for (size_t job = next_job++; job < job_count; job = next_job++) {
+			const size_t job_end = std::min(ray_list.size(), (job + 1) * RAY_JOB_SIZE);
+			for (size_t j = 0; j < MAX_POTINT; j++) {
+				size_t out = potint_job_counts[(j*job_count)+job];
+				for (size_t k = job * RAY_JOB_SIZE; k < job_end; k++) {
+					const size_t i = ray_list[k];
+					if (potint_counts[i] > j) {
+						potential_intersections[out].object_id = potint_ids[(i*MAX_POTINT)+j];
+						potential_intersections[out].ray_index = i;
+						++out;
+					}
+				}
+			}
+		}
+	});
 
-	// Sort potential intersections by primitive id
-	std::sort(potential_intersections.begin(), potential_intersections.end());
+	// Sort each slot's potential intersections by primitive id.  The
+	// sort is stable, so within each primitive they stay in ray order.
+	const uint32_t max_id = scene->world.max_primitive_id();
+	for (size_t j = 0; j < MAX_POTINT; j++) {
+		const size_t start = potint_slot_starts[j];
+		RadixSort::parallel_sort(potential_intersections.data() + start, potint_scratch.data() + start, potint_slot_starts[j+1] - start, max_id, [](const PotentialInter& p) {
+			return p.object_id;
+		}, worker_pool());
+	}
 
 	// Return the total number of potential intersections accumulated
 	return potint_count;
 }
 
 
-std::vector<PotentialInter>::iterator Tracer::trace_diceable_surface(std::vector<PotentialInter>::iterator start, std::vector<PotentialInter>::iterator end)
+/**
+ * Re-creates the sub-primitive of the given root primitive identified by
+ * uid2, by splitting down the path that uid2 encodes.  The root may
+ * itself be a sub-primitive (see Scene::presplit()), in which case uid2
+ * must be one of its descendants.
+ */
+static DiceableSurfacePrimitive* split_down_to(DiceableSurfacePrimitive& root, uint64_t uid2, MemoryArena& arena)
+{
+	// Each split appends two bits to the uid2 of the parent, below a
+	// leading 1 bit.
+	int depth = 0;
+	for (uint64_t i = uid2; i > root.uid2; i >>= 2)
+		++depth;
+
+	DiceableSurfacePrimitive* primitive = &root;
+	for (int level = depth - 1; level >= 0; --level) {
+		const int child = (uid2 >> (level * 2)) & 3;
+		DiceableSurfacePrimitive* children[4];
+		primitive->split(children, arena);
+		primitive = children[child];
+	}
+	Global::Stats::split_count += depth;
+
+	return primitive;
+}
+
+
+std::vector<PotentialInter>::iterator Tracer::trace_diceable_surface(std::vector<PotentialInter>::iterator start, std::vector<PotentialInter>::iterator end, size_t slot, MemoryArena& arena)
 {
 #define STACK_SIZE 32
 
@@ -107,21 +426,64 @@ std::vector<PotentialInter>::iterator Tracer::trace_diceable_surface(std::vector
 
 	const size_t max_subdivs = intlog2(Config::max_grid_size);
 	const size_t prim_id = start->object_id;
+	DiceableSurfacePrimitive& root = *dynamic_cast<DiceableSurfacePrimitive*>(&(scene->world.get_primitive(prim_id)));
+
+	// Whether the potint's ray could still hit the primitive closer than
+	// its current closest hit
+	auto is_live = [&](const PotentialInter& potint) {
+		return rays_active[potint.ray_index] && potint_ts[(potint.ray_index*MAX_POTINT)+slot] <= closest_hit_t(potint.ray_index);
+	};
+
+	// Find out how many potints we're dealing with, and bail out early
+	// if they've all been culled by closer hits
+	int potint_count = 0;
+	bool any_live = false;
+	for (auto itr = start; (itr != end) && (itr->object_id == prim_id); ++itr) {
+		++potint_count;
+		any_live = any_live || is_live(*itr);
+	}
+	if (!any_live)
+		return start + potint_count;
 
 	// UID's
-	const size_t uid1 = scene->world.get_primitive(prim_id).uid; // Main UID
+	const size_t uid1 = root.uid; // Main UID
 	size_t uid2_stack[STACK_SIZE]; // Sub-UID
-	uid2_stack[0] = 1;
-
-	// Stack
-	std::unique_ptr<DiceableSurfacePrimitive> primitive_stack[STACK_SIZE];
-	primitive_stack[0] = (dynamic_cast<DiceableSurfacePrimitive*>(&(scene->world.get_primitive(prim_id)))->copy());
+	uid2_stack[0] = root.uid2;
+
+	// Stack.  Sub-primitives are only created when they're actually
+	// needed for splitting or dicing.  Otherwise their bounds and
+	// subdivision estimates come from the split cache.  Sub-primitives
+	// live in the arena, which is emptied for each call.  Each stack
+	// entry also marks the arena as it was when the entry was pushed,
+	// and popping the entry rewinds the arena to it.  That frees the
+	// entry's whole subtree, so the arena only ever holds the
+	// sub-primitives along the current path and their siblings.
+	arena.reset();
+	DiceableSurfacePrimitive* primitive_stack[STACK_SIZE] = {};
+	MemoryArena::Mark arena_mark_stack[STACK_SIZE];
+	arena_mark_stack[0] = arena.mark();
+	std::shared_ptr<SplitCache::SplitNode> split_node_stack[STACK_SIZE]; // Keeps the bounds alive
+	const BBoxT* bounds_stack[STACK_SIZE];
+	float log_width_stack[STACK_SIZE];
+	bounds_stack[0] = &(root.bounds());
+	log_width_stack[0] = root.log_width();
 	int stack_i = 0;
 
-	// Find out how many potints we're dealing with
-	int potint_count = 0;
-	for (auto itr = start; (itr != end) && (itr->object_id == prim_id); ++itr)
-		++potint_count;
+	// The finest cached MicroSurface among each primitive's ancestors
+	// (or the primitive itself), and the sub-range of it that the
+	// primitive covers.  When it's fine enough, rays are tested against
+	// its sub-range instead of dicing the primitive itself.
+	std::shared_ptr<MicroSurface> ancestor_stack[STACK_SIZE];
+	MicroSurface::SubRange range_stack[STACK_SIZE];
+
+	// Fetches the primitive at the given stack index, creating it if necessary
+	auto get_primitive = [&](int i) -> DiceableSurfacePrimitive& {
+		if (uid2_stack[i] == root.uid2)
+			return root;
+		if (!primitive_stack[i])
+			primitive_stack[i] = split_down_to(root, uid2_stack[i], arena);
+		return *(primitive_stack[i]);
+	};
 
 	// Stacks of start/end iterators for partitioning the potints as we
 	// dive deeper into the traversal
@@ -132,7 +494,8 @@ std::vector<PotentialInter>::iterator Tracer::trace_diceable_surface(std::vector
 
 	// Traversal
 	while (stack_i >= 0) {
-		DiceableSurfacePrimitive& primitive = *(primitive_stack[stack_i]); // Shorthand reference to potint's primitive
+		const BBoxT& bounds = *(bounds_stack[stack_i]);
+		const float log_width = log_width_stack[stack_i];
 
 		// Fetch the current primitive's microgeo cache if it exists
 		std::shared_ptr<MicroSurface> micro_surface = cache.get(Key(uid1, uid2_stack[stack_i]));
@@ -141,62 +504,143 @@ std::vector<PotentialInter>::iterator Tracer::trace_diceable_surface(std::vector
 		size_t current_subdivs = 0;
 		if (micro_surface)
 			current_subdivs = micro_surface->subdivisions();
+		bool micro_surface_used = false;
+
+		// The primitive's own MicroSurface replaces the ancestor's if
+		// it's at least as fine
+		std::shared_ptr<MicroSurface>& ancestor = ancestor_stack[stack_i];
+		MicroSurface::SubRange& range = range_stack[stack_i];
+		if (micro_surface && (!ancestor || int(current_subdivs) >= ancestor->subdivisions(range))) {
+			ancestor = micro_surface;
+			range = MicroSurface::SubRange();
+		}
 
-		// Test potints against primitive, marking for deeper traversal
-		// if they can't be directly tested
+		// Whether there's room on the stack and in the uid2 to split further
+		const bool can_split = (stack_i + 4 <= STACK_SIZE) && (uid2_stack[stack_i] < (uint64_t(1) << 60));
+
+		// Test potints against primitive.  Potints that are finished with
+		// this primitive are moved to the front of the range, and those
+		// that can't be directly tested are left at the back for deeper
+		// traversal.
+		auto finished_end = potint_starts[stack_i];
 		for (auto pitr = potint_starts[stack_i]; pitr != potint_ends[stack_i]; ++pitr) {
 			// Setup
-			pitr->tag = 0; // No traversing deeper by default
-			const Ray& ray = rays[pitr->ray_index];  // Shorthand reference to potint's ray
-			Intersection& inter = intersections[pitr->ray_index]; // Shorthand reference to potint's intersection
-
-			// If the potint intersects with the primitive's bbox
+			bool traverse_deeper = false;
+			const size_t ray_i = pitr->ray_index;
+			const Ray& ray = rays[ray_i];  // Shorthand reference to potint's ray
+
+			// If the potint's ray is still active and intersects with the
+			// primitive's bbox closer than its current closest hit.
+			// (Shadow rays may have been deactivated by a hit in an
+			// earlier slot.)  Rays that only enter the bbox beyond their
+			// closest hit are dropped without dicing or splitting.
 			float tnear, tfar;
-			if (primitive.bounds().intersect_ray(ray, &tnear, &tfar)) {
+			if (is_live(*pitr) && bounds.intersect_ray(ray, &tnear, &tfar) && tnear <= closest_hit_t(ray_i)) {
 				// Calculate the width of the ray within the bounding box
 				const float width = ray.min_width(tnear, tfar);
 
 				// Calculate the number of subdivisions necessary for this ray
-				const size_t subdivs = primitive.subdiv_estimate(width);
-
-				// If it's under the max subdivisions allowed, test
-				// against primitive
-				if (subdivs <= max_subdivs) {
-					// If we're missing a cached microsurface or it's not high resolution enough,
-					// dice a new one
-					if (micro_surface == nullptr || subdivs > current_subdivs) {
-						micro_surface = primitive.dice(subdivs);
-						current_subdivs = subdivs;
+				size_t subdivs = DiceableSurfacePrimitive::subdiv_estimate_from_log_width(log_width, width);
+
+				// If it's under the max subdivisions allowed (or we can't
+				// split any further), test against primitive
+				if (subdivs <= max_subdivs || !can_split) {
+					subdivs = std::min(subdivs, max_subdivs);
+
+					// If we're missing a cached microsurface or it's
+					// not high resolution enough, test against the
+					// ancestor's if that is, or else dice a new one
+					const bool use_ancestor = (micro_surface == nullptr || subdivs > current_subdivs) && ancestor && ancestor != micro_surface && ancestor->subdivisions(range) >= int(subdivs);
+					if (use_ancestor) {
+						Global::Stats::ancestor_cache_hits++;
+					} else if (micro_surface == nullptr || subdivs > current_subdivs) {
+						micro_surface = get_or_dice(Key(uid1, uid2_stack[stack_i]), subdivs, [&](size_t s) {
+							return get_primitive(stack_i).dice(s);
+						});
+						current_subdivs = micro_surface->subdivisions();
+						micro_surface_used = true;
+					} else if (!micro_surface_used) {
+						Global::Stats::cache_hits++;
+						micro_surface_used = true;
 					}
-
-					// Test against the ray
-					if (ray.is_shadow_ray) {
-						inter.hit |= micro_surface->intersect_ray(ray, width, nullptr);
-						rays_active[pitr->ray_index] = !inter.hit; // Early out for shadow rays
+					const std::shared_ptr<MicroSurface>& surface = use_ancestor ? ancestor : micro_surface;
+
+					// Test against the ray.  Any hit is enough to
+					// finish off occlusion rays, so they're deactivated
+					// right away.
+					if (occlusion_only || ray.is_shadow_ray) {
+						const bool occluded = use_ancestor ? surface->occluded(ray, width, range) : surface->occluded(ray, width);
+						if (occluded) {
+							if (occlusion_only)
+								occlusion_results[ray_i] = true;
+							else
+								intersections[ray_i].hit = true;
+							rays_active[ray_i] = false;
+						}
 					} else {
-						inter.hit |= micro_surface->intersect_ray(ray, width, &inter);
-						pitr->nearest_hit_t = inter.t;
+						// Only record the hit for now.  Its
+						// intersection data is computed once the
+						// closest hit is known, in
+						// resolve_deferred_hits().
+						Intersection& inter = intersections[ray_i];
+						const float max_t = std::min(ray.max_t, inter.t);
+						MicroSurface::Hit hit;
+						const bool was_hit = use_ancestor ? surface->intersect_ray(ray, width, max_t, range, &hit) : surface->intersect_ray(ray, width, max_t, &hit);
+						if (was_hit) {
+							inter.hit = true;
+							inter.t = hit.t;
+							deferred_hits[ray_i].surface = surface;
+							deferred_hits[ray_i].hit = hit;
+						}
 					}
 				}
 				// If it's over the max subdivisions allowed, mark for deeper traversal
 				else {
-					pitr->tag = 1;
+					traverse_deeper = true;
 				}
 			}
+
+			if (!traverse_deeper)
+				std::iter_swap(finished_end++, pitr);
 		}
 
-		// Filter potints based on whether they need deeper traversal
-		potint_starts[stack_i] = std::partition(potint_starts[stack_i], potint_ends[stack_i], [this](const PotentialInter& p) {
-			return p.tag == 0 || this->rays_active[p.ray_index] == false;
-		});
+		// Only the potints that need deeper traversal remain
+		potint_starts[stack_i] = finished_end;
 
 		// If any potints left, traverse down the stack via splitting
 		if (potint_starts[stack_i] != potint_ends[stack_i]) {
-			std::unique_ptr<DiceableSurfacePrimitive> new_prims[4];
-			// Split the primitive
-			const int new_count = primitive.split(new_prims);
-
 			const auto parent_uid2 = uid2_stack[stack_i];
+			std::shared_ptr<SplitCache::SplitNode> split_node = SplitCache::cache.get(Key(uid1, parent_uid2));
+			DiceableSurfacePrimitive* new_prims[4] = {};
+
+			// Split the primitive if the split isn't cached
+			if (!split_node) {
+				const int split_axis = get_primitive(stack_i).split_axis();
+				const int new_count = get_primitive(stack_i).split(new_prims, arena);
+				++split_count;
+
+				split_node = std::make_shared<SplitCache::SplitNode>();
+				split_node->child_count = new_count;
+				split_node->split_axis = split_axis;
+				for (int i = 0; i < new_count; ++i) {
+					split_node->bounds[i].copy(new_prims[i]->bounds());
+					split_node->log_widths[i] = new_prims[i]->log_width();
+				}
+				SplitCache::cache.put(split_node, Key(uid1, parent_uid2));
+			}
+
+			// Everything allocated so far, including the children, stays
+			// alive until the children are popped
+			const MemoryArena::Mark children_mark = arena.mark();
+
+			// The children inherit the ancestor MicroSurface, if their
+			// sub-ranges of it are known and not smaller than a cell
+			std::shared_ptr<MicroSurface> child_ancestor;
+			const MicroSurface::SubRange parent_range = range_stack[stack_i];
+			if (split_node->split_axis >= 0 && ancestor_stack[stack_i] && ancestor_stack[stack_i]->subdivisions(parent_range) > 0)
+				child_ancestor = ancestor_stack[stack_i];
+
+			const int new_count = split_node->child_count;
 			for (int i = 0; i < new_count; ++i) {
 				const int ii = stack_i + i;
 
@@ -205,7 +649,14 @@ std::vector<PotentialInter>::iterator Tracer::trace_diceable_surface(std::vector
 				potint_ends[ii] = potint_ends[stack_i];
 
 				// Update primitive stack
-				std::swap(primitive_stack[ii], new_prims[i]);
+				primitive_stack[ii] = new_prims[i];
+				arena_mark_stack[ii] = children_mark;
+				split_node_stack[ii] = split_node;
+				bounds_stack[ii] = &(split_node->bounds[i]);
+				log_width_stack[ii] = split_node->log_widths[i];
+				ancestor_stack[ii] = child_ancestor;
+				if (child_ancestor)
+					range_stack[ii] = parent_range.half(split_node->split_axis, i);
 
 				// Update uid stack
 				uid2_stack[ii] = (parent_uid2 << 2) | i;
@@ -216,6 +667,10 @@ std::vector<PotentialInter>::iterator Tracer::trace_diceable_surface(std::vector
 		}
 		// If not any potints left, move up the stack
 		else {
+			primitive_stack[stack_i] = nullptr;
+			arena.rewind(arena_mark_stack[stack_i]);
+			split_node_stack[stack_i].reset();
+			ancestor_stack[stack_i].reset();
 			stack_i--;
 		}
 	}
@@ -229,20 +684,33 @@ std::vector<PotentialInter>::iterator Tracer::trace_diceable_surface(std::vector
 
 void Tracer::trace_potential_intersections()
 {
-	for (auto itr = potential_intersections.begin(); itr != potential_intersections.end(); ++itr) {
-		// Prefetch memory for next iteration, to hide memory latency
-		//prefetch_L3(&(potential_intersections[i+2]));
-		//prefetch_L3(&(rays[potential_intersections[i+1].ray_index]));
-		//prefetch_L3(&(intersections[potential_intersections[i+1].ray_index]));
-
-		// Shorthand references
-		//auto& primitive = scene->world.get_primitive(potential_intersections[i].object_id);
-
-		itr = trace_diceable_surface(itr, potential_intersections.end()) - 1;
+	// Trace each slot's potential intersections as a separate pass, so
+	// that each ray's potential intersections are tested in the order
+	// they were found.
+	for (size_t j = 0; j < MAX_POTINT; j++) {
+		const size_t slot_start = potint_slot_starts[j];
+		const size_t slot_end = potint_slot_starts[j+1];
+
+		// Find the start of each per-object group of potential intersections
+		potint_groups.clear();
+		for (size_t i = slot_start; i < slot_end; ++i) {
+			if (i == slot_start || potential_intersections[i].object_id != potential_intersections[i-1].object_id)
+				potint_groups.push_back(i);
+		}
+		potint_groups.push_back(slot_end);
+
+		// Trace the groups.  Within a slot there is at most one potential
+		// intersection per ray, so no two groups share a ray, and the
+		// groups can be traced in any order and on any thread without
+		// affecting the results.
+		WorkStealingRange groups(potint_groups.size() - 1, thread_count);
+		run_workers([this, &groups, j](size_t worker) {
+			size_t group;
+			while (groups.next(worker, &group)) {
+				trace_diceable_surface(potential_intersections.begin() + potint_groups[group], potential_intersections.begin() + potint_groups[group+1], j, arenas[worker]);
+			}
+		});
 	}
 
 	Global::Stats::primitive_ray_tests += potential_intersections.size();
 }
-
-
-
@@ -6,10 +6,14 @@
 #define TRACER_HPP
 
 #include <vector>
+#include <functional>
+#include <memory>
 
 #include "numtype.h"
 #include "array.hpp"
 #include "slice.hpp"
+#include "memory_arena.hpp"
+#include "worker_pool.hpp"
 
 
 
@@ -17,6 +21,7 @@
 #include "intersection.hpp"
 #include "potentialinter.hpp"
 #include "scene.hpp"
+#include "micro_surface.hpp"
 
 
 /**
@@ -40,28 +45,77 @@
  * queue_rays(), and then trace them all by calling trace_rays().  The
  * resulting intersection data is stored in the rays' data structures directly.
  * Wash, rinse, repeat.
+ *
+ * A single Tracer can also spread one large batch of rays over several
+ * threads by giving it a thread count greater than one.  The results are
+ * identical to tracing the batch on a single thread, as long as nothing
+ * is evicted from the MicroSurfaceCache along the way.  Which
+ * MicroSurfaces get evicted depends on the timing of the threads, and a
+ * ray that finds a finer MicroSurface still cached is tested against it
+ * instead of a freshly diced one, which can change its hit distance
+ * slightly.
+ *
+ * Setting reorder_rays makes the Tracer sort each batch by origin and
+ * direction before tracing it, which helps incoherent batches (e.g.
+ * diffuse bounces).  The results are still returned in the order the
+ * rays were given in.
  */
 class Tracer
 {
 public:
 	Scene *scene;
+	int thread_count; // Number of threads to trace each batch of rays with
 	Slice<const Ray> rays; // Rays to trace
 	Slice<Intersection> intersections; // Resulting intersections
+	Slice<uint8_t> occlusion_results; // Resulting occlusion flags, when only testing for occlusion
+	bool occlusion_only {false}; // Whether the current rays are only being tested for occlusion
+	bool reorder_rays {false}; // Whether to sort each batch of rays into a more coherent order before tracing it
+	std::vector<uint64_t> ray_keys; // Sort key (upper 32 bits) and original index (lower 32 bits) of each ray, when reordering
+	std::vector<uint64_t> ray_keys_scratch; // Scratch space for sorting ray_keys
+	Array<Ray> sorted_rays; // The rays in their sorted order, when reordering
+	Array<Intersection> sorted_intersections; // Intersections of sorted_rays, before being scattered back
+	Array<uint8_t> sorted_occlusion_results; // Occlusion flags of sorted_rays, before being scattered back
 	std::vector<uint8_t> rays_active;
+	std::vector<uint32_t> ray_list; // Indices of the rays to trace in the current pass
+	std::vector<std::vector<uint32_t>> treelet_queues; // Rays waiting to be traced in each treelet of the scene
 	Array<uint8_t> states; // Ray states, for interrupting and resuming traversal
 	std::vector<PotentialInter> potential_intersections; // "Potential intersection" buffer
+	std::vector<PotentialInter> potint_scratch; // Scratch space for sorting the potential intersection buffer
+	std::vector<uint32_t> potint_ids; // Object ids found for each ray in the current pass
+	std::vector<float> potint_ts; // Distance at which each ray enters the bounds of each of its object ids
+	std::vector<uint8_t> potint_counts; // Number of object ids found for each ray in the current pass
+	std::vector<size_t> potint_job_counts; // Per-job, per-slot counts, for compacting the potential intersections
+	std::vector<size_t> potint_slot_starts; // Start index of each slot's potential intersections
+	std::vector<size_t> potint_groups; // Start index of each per-object group of potential intersections within a slot
+	std::vector<MemoryArena> arenas; // Per-worker scratch memory for splitting primitives
+	std::unique_ptr<WorkerPool> workers; // Threads for run_workers(), created on first use
+
+	/**
+	 * @brief The closest hit found so far for a ray, whose intersection
+	 * data hasn't been computed yet.
+	 *
+	 * Holding on to the MicroSurface keeps it alive even if it's evicted
+	 * from the cache before the hit is resolved.
+	 */
+	struct DeferredHit {
+		std::shared_ptr<MicroSurface> surface;
+		MicroSurface::Hit hit;
+	};
+	std::vector<DeferredHit> deferred_hits; // Closest hit of each ray, resolved once tracing is done
 
-	Tracer(Scene *scene_): scene {scene_} {}
+	Tracer(Scene *scene_, int thread_count_=1): scene {scene_}, thread_count {thread_count_} {}
 
 	// Copy constructor
-	Tracer(const Tracer& b): scene {b.scene} {}
+	Tracer(const Tracer& b): scene {b.scene}, thread_count {b.thread_count}, reorder_rays {b.reorder_rays} {}
 
 	// Move constructor
-	Tracer(const Tracer&& b): scene {b.scene} {}
+	Tracer(const Tracer&& b): scene {b.scene}, thread_count {b.thread_count}, reorder_rays {b.reorder_rays} {}
 
 	// Assignment
 	Tracer& operator=(const Tracer& b) {
 		scene = b.scene;
+		thread_count = b.thread_count;
+		reorder_rays = b.reorder_rays;
 
 		return *this;
 	}
@@ -75,25 +129,130 @@ public:
 	 */
 	uint32_t trace(const Slice<Ray> rays_, Slice<Intersection> intersections_);
 
+	/**
+	 * Tests whether the provided rays are occluded, i.e. whether they hit
+	 * anything at all along their length.
+	 *
+	 * This is cheaper than trace(), since it doesn't need to find the
+	 * closest hit of each ray or compute any intersection data, and
+	 * each ray is finished as soon as anything is found to block it.
+	 * All rays are treated as shadow rays, regardless of their
+	 * is_shadow_ray flag.
+	 *
+	 * @param [in] rays_ The rays to be tested.
+	 * @param [out] occluded_ Set to true for each ray that's occluded,
+	 *                        false for the rest.
+	 */
+	uint32_t occluded(const Slice<Ray> rays_, Slice<uint8_t> occluded_);
+
 private:
 	/**
-	 * Accumulates potential intersections into the potential_inters buffer.
-	 * The buffer is sized appropriately and sorted by the time this method
-	 * finished.
+	 * Traces the provided rays, once the output slices have been set up
+	 * by trace() or occluded().
+	 */
+	uint32_t trace_rays(const Slice<Ray> rays_);
+
+	/**
+	 * Traces the rays currently in the rays slice, writing the results
+	 * directly to the intersections or occlusion_results slice.
+	 */
+	void trace_batch();
+
+	/**
+	 * Traces the rays one treelet of the scene at a time, instead of
+	 * all at once.  Each treelet's rays are traced until they leave it,
+	 * and are then queued at the treelet they enter next.  That way the
+	 * primitives of a treelet, and their microsurfaces, only need to be
+	 * loaded into the caches once for all of its rays.
+	 */
+	void trace_by_treelet();
+
+	/**
+	 * Fills in the intersections of all rays that have a deferred hit,
+	 * and releases the hits' MicroSurfaces.
+	 *
+	 * During tracing only the minimal data needed to find the closest
+	 * hit is recorded, so that intersection data isn't computed over and
+	 * over for hits that are later superseded by closer ones.
+	 */
+	void resolve_deferred_hits();
+
+	/**
+	 * Sorts the given rays into sorted_rays, ordered primarily by the
+	 * octant their direction points into and secondarily by the morton
+	 * code of their origin within the bounds of all the origins.  Rays
+	 * that are near each other and point in similar directions tend to
+	 * visit the same parts of the scene, so tracing them together makes
+	 * better use of the caches.
+	 *
+	 * The original index of the ray at each sorted position is left
+	 * in the lower 32 bits of ray_keys.
+	 */
+	void sort_rays(const Slice<Ray> rays_);
+
+	/**
+	 * Returns the distance to the closest hit found so far for the ray
+	 * with the given index.  Potential intersections beyond it can be
+	 * skipped.
+	 */
+	float closest_hit_t(size_t ray_i) const {
+		return occlusion_only ? rays[ray_i].max_t : intersections[ray_i].t;
+	}
+
+	/**
+	 * Returns the pool of thread_count workers (including the calling
+	 * thread), creating it if necessary.  The same threads are reused
+	 * for every parallel phase of every batch.
+	 */
+	WorkerPool& worker_pool();
+
+	/**
+	 * Runs the given function on thread_count threads (including the
+	 * calling thread), passing each its worker index, and waits for all of
+	 * them to finish.
+	 */
+	void run_workers(const std::function<void(size_t)>& worker);
+
+	/**
+	 * Accumulates potential intersections of the rays in ray_list into
+	 * the potential_inters buffer.  The buffer is sized appropriately and
+	 * sorted by the time this method finished.
+	 *
+	 * Each ray gets up to MAX_POTINT potential intersections per call, in
+	 * the order the acceleration structure finds them.  The n'th potential
+	 * intersection of each ray goes in the n'th "slot".  The buffer holds
+	 * the slots one after another, each sorted by object id.
+	 *
+	 * The thread count has no effect on the results.  MAX_POTINT does:
+	 * it changes the order objects are diced in, which can change hit
+	 * distances in the last few bits.
+	 *
+	 * @param treelet_bound Whether to stop each ray at the boundary of the
+	 *                      treelet it's in.
 	 *
 	 * @returns The total number of potential intersections accumulated.
 	 */
-	size_t accumulate_potential_intersections();
+	size_t accumulate_potential_intersections(bool treelet_bound);
 
 	/**
-	 * Traces all of the potential intersections in the potential_inters buffer.
-	 * This method assumes the the buffer is properly sorted by object id,
-	 * and that it is sized properly so that there are no empty potential
-	 * intersections.
+	 * Traces all of the potential intersections in the potential_inters buffer,
+	 * one slot at a time.  This method assumes the the buffer is laid out
+	 * as described in accumulate_potential_intersections().
 	 */
 	void trace_potential_intersections();
 
-	std::vector<PotentialInter>::iterator trace_diceable_surface(std::vector<PotentialInter>::iterator potints, std::vector<PotentialInter>::iterator end);
+	/**
+	 * Traces the potential intersections in the given range that belong
+	 * to the range's first object, which must be a DiceableSurfacePrimitive.
+	 * Potential intersections whose rays already have a hit closer than
+	 * where they enter the object (or any part of it) are skipped.
+	 *
+	 * @param slot The slot the potential intersections are from, for
+	 *             looking up their entry distances in potint_ts.
+	 *
+	 * @returns An iterator to the first potential intersection not traced.
+	 */
+	std::vector<PotentialInter>::iterator trace_diceable_surface(std::vector<PotentialInter>::iterator potints, std::vector<PotentialInter>::iterator end, size_t slot, MemoryArena& arena);
 };
 
 #endif // TRACER_HPP
@@ -0,0 +1,186 @@
+#include "test.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "numtype.h"
+#include "vector.hpp"
+#include "ray.hpp"
+#include "rng.hpp"
+#include "array.hpp"
+#include "slice.hpp"
+#include "bilinear.hpp"
+#include "micro_surface_cache.hpp"
+#include "global.hpp"
+#include "config.hpp"
+#include "scene.hpp"
+#include "tracer.hpp"
+
+
+// Fills a scene with a large ground plane and a scattering of tilted
+// patches above it
+static void fill_scene(Scene &scene)
+{
+	Bilinear *ground = new Bilinear(Vec3(-100.0f, 0.0f, -100.0f), Vec3(100.0f, 0.0f, -100.0f), Vec3(100.0f, 0.0f, 100.0f), Vec3(-100.0f, 0.0f, 100.0f));
+	ground->finalize();
+	scene.add_primitive(std::unique_ptr<Primitive>(ground));
+
+	RNG rng(11);
+	for (int i = 0; i < 200; ++i) {
+		const Vec3 p(rng.next_float_c() * 40.0f, 1.0f + rng.next_float() * 20.0f, rng.next_float_c() * 40.0f);
+		const Vec3 u(2.0f + rng.next_float() * 4.0f, rng.next_float_c(), 0.0f);
+		const Vec3 v(rng.next_float_c(), rng.next_float_c(), 2.0f + rng.next_float() * 4.0f);
+		Bilinear *patch = new Bilinear(p, p + u, p + u + v, p + v);
+		patch->finalize();
+		scene.add_primitive(std::unique_ptr<Primitive>(patch));
+	}
+}
+
+// Narrow rays from above the scene, aimed down into it, so that
+// the patches get diced finely
+static void make_rays(size_t count, uint32_t seed, Array<Ray> &rays)
+{
+	RNG rng(seed);
+	rays.resize(count);
+	for (size_t i = 0; i < count; ++i) {
+		Ray &ray = rays[i];
+		ray.o = Vec3(rng.next_float_c() * 20.0f, 60.0f, rng.next_float_c() * 20.0f);
+		const Vec3 target(rng.next_float_c() * 50.0f, 0.0f, rng.next_float_c() * 50.0f);
+		ray.d = target - ray.o;
+		ray.time = rng.next_float();
+		ray.ow = 0.0f;
+		ray.dw = 0.02f;
+		ray.max_t = std::numeric_limits<float>::infinity();
+		ray.is_shadow_ray = false;
+		ray.finalize();
+	}
+}
+
+// Sets the size of the MicroSurface cache for the lifetime of the
+// object, and then puts it back to the configured size
+struct MicroSurfaceCacheSize {
+	MicroSurfaceCacheSize(size_t size) {
+		MicroSurfaceCache::cache.clear();
+		MicroSurfaceCache::cache.set_max_size(size);
+	}
+
+	~MicroSurfaceCacheSize() {
+		MicroSurfaceCache::cache.clear();
+		MicroSurfaceCache::cache.set_max_size(Config::grid_cache_size * (1000*1000));
+	}
+};
+
+// Results of tracing a set of rays
+struct TraceResults {
+	Array<Intersection> intersections;
+	Array<uint8_t> occluded;
+	uint64_t cache_misses;
+};
+
+// Traces and tests the occlusion of the given rays with a new tracer,
+// starting from an empty MicroSurface cache
+static void trace_all(Scene &scene, int thread_count, Array<Ray> &rays, TraceResults &results)
+{
+	MicroSurfaceCache::cache.clear();
+	Global::Stats::clear();
+
+	results.intersections.resize(rays.size());
+	results.occluded.resize(rays.size());
+
+	Tracer tracer(&scene, thread_count);
+	tracer.trace(Slice<Ray>(rays), Slice<Intersection>(results.intersections));
+	tracer.occluded(Slice<Ray>(rays), Slice<uint8_t>(results.occluded));
+	results.cache_misses = Global::Stats::cache_misses;
+}
+
+// Returns whether two intersections are the same down to the bit
+static bool same_intersection(const Intersection &a, const Intersection &b)
+{
+	if (a.hit != b.hit)
+		return false;
+	if (!a.hit)
+		return true;
+	const float va[9] = {a.t, a.p.x, a.p.y, a.p.z, a.n.x, a.n.y, a.n.z, a.u, a.v};
+	const float vb[9] = {b.t, b.p.x, b.p.y, b.p.z, b.n.x, b.n.y, b.n.z, b.u, b.v};
+	return std::memcmp(va, vb, sizeof(va)) == 0 && a.backfacing == b.backfacing;
+}
+
+
+/*
+ * Test suite for Tracer.
+ */
+BOOST_AUTO_TEST_SUITE(tracer);
+
+// Test that tracing a batch on several threads gives exactly the same
+// results as tracing it on one, when nothing is evicted from the
+// MicroSurface cache
+BOOST_AUTO_TEST_CASE(thread_count_1)
+{
+	Scene scene;
+	fill_scene(scene);
+	scene.finalize();
+	Array<Ray> rays;
+	make_rays(10000, 3, rays);
+
+	// Big enough that nothing is evicted
+	MicroSurfaceCacheSize cache_size(size_t(8000) * 1000 * 1000);
+	TraceResults results_1, results_4;
+	trace_all(scene, 1, rays, results_1);
+	trace_all(scene, 4, rays, results_4);
+	BOOST_CHECK_EQUAL(results_1.cache_misses, results_4.cache_misses);
+
+	size_t hits = 0;
+	size_t same = 0;
+	size_t same_occluded = 0;
+	for (size_t i = 0; i < rays.size(); ++i) {
+		hits += results_1.intersections[i].hit;
+		same += same_intersection(results_1.intersections[i], results_4.intersections[i]);
+		same_occluded += results_1.occluded[i] == results_4.occluded[i];
+	}
+	BOOST_CHECK(hits > rays.size() / 2);
+	BOOST_CHECK_EQUAL(same, rays.size());
+	BOOST_CHECK_EQUAL(same_occluded, rays.size());
+}
+
+// Test that with a MicroSurface cache small enough to evict, tracing on
+// several threads still finds the same hits as tracing on one, at very
+// nearly the same distances.  Which MicroSurfaces are evicted depends on
+// the timing of the threads, and a ray may be tested against a finer
+// MicroSurface that happens to still be cached, so the results aren't
+// bit-for-bit identical in that case.
+BOOST_AUTO_TEST_CASE(thread_count_2)
+{
+	Scene scene;
+	fill_scene(scene);
+	scene.finalize();
+	Array<Ray> rays;
+	make_rays(10000, 5, rays);
+
+	TraceResults unevicted, results_1, results_4;
+	trace_all(scene, 1, rays, unevicted);
+
+	MicroSurfaceCacheSize cache_size(64 * 1024);
+	trace_all(scene, 1, rays, results_1);
+	trace_all(scene, 4, rays, results_4);
+
+	// Make sure the small cache really did evict things
+	BOOST_CHECK(results_1.cache_misses > unevicted.cache_misses);
+
+	size_t same_hit = 0;
+	size_t close_t = 0;
+	size_t same_occluded = 0;
+	for (size_t i = 0; i < rays.size(); ++i) {
+		const Intersection &a = results_1.intersections[i];
+		const Intersection &b = results_4.intersections[i];
+		same_hit += a.hit == b.hit;
+		close_t += !a.hit || !b.hit || std::abs(a.t - b.t) <= (a.t * 0.01f);
+		same_occluded += results_1.occluded[i] == results_4.occluded[i];
+	}
+	BOOST_CHECK(same_hit >= rays.size() - (rays.size() / 200));
+	BOOST_CHECK_EQUAL(close_t, rays.size());
+	BOOST_CHECK(same_occluded >= rays.size() - (rays.size() / 200));
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,334 @@
+#ifndef CONCURRENT_CACHE_HPP
+#define CONCURRENT_CACHE_HPP
+
+#include <cstdlib>
+#include <cstdint>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+
+#include "spinlock.hpp"
+#include "lru_cache.hpp" // For size_in_bytes()
+
+
+// How expensive an item is to recreate, in arbitrary units (seconds
+// is a good choice).  Should be overloaded for types where eviction
+// cost matters.
+template <class T>
+float eviction_cost(const T& data)
+{
+	return 1.0f;
+}
+
+
+/**
+ * @brief CLOCK eviction policy for ConcurrentCache.
+ *
+ * Approximates LRU.  A read hit only sets the item's reference bit, and
+ * only if it isn't already set.
+ */
+struct ClockEviction {
+	struct Meta {
+		bool referenced {false};
+	};
+
+	struct State {
+		size_t hand {0};
+	};
+
+	static void on_insert(State& state, Meta& meta, size_t bytes, float cost) {
+		meta.referenced = false;
+	}
+
+	static void on_hit(State& state, Meta& meta) {
+		if (!meta.referenced)
+			meta.referenced = true;
+	}
+
+	/*
+	 * Returns the index of the next slot to evict, or slots.size() if
+	 * there is nothing to evict.  The slot at index "keep" is never
+	 * chosen.
+	 */
+	template <class SLOTS>
+	static size_t victim(State& state, SLOTS& slots, size_t keep) {
+		// Two full sweeps is enough to clear every reference bit and
+		// then find a victim.
+		for (size_t steps = slots.size() * 2; steps > 0; --steps) {
+			if (state.hand >= slots.size())
+				state.hand = 0;
+			const size_t i = state.hand++;
+
+			if (slots[i].occupied && i != keep) {
+				if (slots[i].meta.referenced)
+					slots[i].meta.referenced = false;
+				else
+					return i;
+			}
+		}
+		return slots.size();
+	}
+};
+
+
+/**
+ * @brief GreedyDual-Size-Frequency eviction policy for ConcurrentCache.
+ *
+ * Each item's priority is L + (hit_count * cost / bytes), where cost is
+ * given by eviction_cost() and L is the priority of the most recently
+ * evicted item.  Items that are expensive to recreate per byte of memory
+ * they use are kept longer, and L ages out items that haven't been hit
+ * in a while.
+ *
+ * The victim is the lowest priority item out of a small sample of
+ * items, which avoids maintaining a priority queue.
+ */
+struct GDSFEviction {
+	static constexpr size_t SAMPLE_COUNT = 8;
+
+	struct Meta {
+		float priority {0.0f};
+		float cost_per_byte {0.0f};
+		uint32_t hit_count {0};
+	};
+
+	struct State {
+		size_t hand {0};
+		float inflation {0.0f}; // "L"
+	};
+
+	static void on_insert(State& state, Meta& meta, size_t bytes, float cost) {
+		meta.hit_count = 1;
+		meta.cost_per_byte = cost / bytes;
+		meta.priority = state.inflation + meta.cost_per_byte;
+	}
+
+	static void on_hit(State& state, Meta& meta) {
+		meta.hit_count++;
+		meta.priority = state.inflation + (meta.hit_count * meta.cost_per_byte);
+	}
+
+	template <class SLOTS>
+	static size_t victim(State& state, SLOTS& slots, size_t keep) {
+		size_t best = slots.size();
+		size_t sampled = 0;
+		for (size_t steps = slots.size(); steps > 0 && sampled < SAMPLE_COUNT; --steps) {
+			if (state.hand >= slots.size())
+				state.hand = 0;
+			const size_t i = state.hand++;
+
+			if (slots[i].occupied && i != keep) {
+				++sampled;
+				if (best == slots.size() || slots[i].meta.priority < slots[best].meta.priority)
+					best = i;
+			}
+		}
+
+		if (best < slots.size())
+			state.inflation = slots[best].meta.priority;
+
+		return best;
+	}
+};
+
+
+/**
+ * @brief A thread-safe cache built for many concurrent readers.
+ *
+ * The cache is split into independently locked shards, selected by key
+ * hash, so threads working on different keys rarely contend for the
+ * same lock.  Eviction within a shard is delegated to the EVICTION
+ * policy, CLOCK by default.  Unlike LRUCache, a read hit does no list
+ * manipulation.
+ *
+ * Like LRUCache, the cache is bounded by a total byte count, measured
+ * with size_in_bytes() plus a per-item overhead estimate.  The budget is
+ * split evenly between the shards.
+ */
+template <class K, class T, class EVICTION=ClockEviction>
+class ConcurrentCache
+{
+	struct Slot {
+		K key;
+		std::shared_ptr<T> data_ptr;
+		size_t bytes {0};
+		bool occupied {false};
+		typename EVICTION::Meta meta;
+	};
+
+	struct Shard {
+		SpinLock slock;
+		size_t max_bytes {0};
+		size_t byte_count {0};
+		typename EVICTION::State eviction;
+		std::unordered_map<K, size_t> map; // Key -> index into slots
+		std::deque<Slot> slots;
+		std::vector<size_t> free_slots;
+	};
+
+	std::vector<Shard> shards;
+	size_t shard_mask;
+
+	// The number of bytes each item takes up, aside from the size of the
+	// item itself.  Estimated as the size of a slot plus a map entry.
+	const size_t per_item_size_cost = sizeof(Slot) + sizeof(K) + sizeof(size_t) + (sizeof(void*)*2);
+
+public:
+	/**
+	 * @brief Constructor.
+	 *
+	 * @param max_bytes_ Maximum total size of the cache in bytes.
+	 * @param shard_count Number of shards.  Rounded up to a power of two.
+	 */
+	ConcurrentCache(size_t max_bytes_=40, size_t shard_count=64) {
+		size_t count = 1;
+		while (count < shard_count)
+			count <<= 1;
+		shards = std::vector<Shard>(count);
+		shard_mask = count - 1;
+		set_max_size(max_bytes_);
+	}
+
+	/*
+	 * Sets the maximum number of bytes in the cache.
+	 * Should only be called once right after construction.
+	 */
+	void set_max_size(size_t size) {
+		for (auto& shard: shards)
+			shard.max_bytes = size / shards.size();
+	}
+
+	/*
+	 * Adds the given item to the cache using the given key.
+	 * If the key already exists, the existing item will be
+	 * replaced.
+	 *
+	 * Returns the key.
+	 */
+	K put(std::shared_ptr<T> data_ptr, K key) {
+		Shard& shard = shard_for(key);
+		std::unique_lock<SpinLock> lock(shard.slock);
+
+		const size_t bytes = size_in_bytes(*data_ptr) + per_item_size_cost;
+
+		// Replace in place if the key already exists
+		const auto itr = shard.map.find(key);
+		if (itr != shard.map.end()) {
+			Slot& slot = shard.slots[itr->second];
+			shard.byte_count -= slot.bytes;
+			EVICTION::on_insert(shard.eviction, slot.meta, bytes, eviction_cost(*data_ptr));
+			slot.data_ptr = std::move(data_ptr);
+			slot.bytes = bytes;
+			shard.byte_count += bytes;
+			evict(shard, itr->second);
+			return key;
+		}
+
+		// Make room
+		shard.byte_count += bytes;
+		evict(shard, shard.slots.size());
+
+		// Add the new data
+		size_t slot_i;
+		if (shard.free_slots.empty()) {
+			slot_i = shard.slots.size();
+			shard.slots.emplace_back();
+		} else {
+			slot_i = shard.free_slots.back();
+			shard.free_slots.pop_back();
+		}
+		Slot& slot = shard.slots[slot_i];
+		EVICTION::on_insert(shard.eviction, slot.meta, bytes, eviction_cost(*data_ptr));
+		slot.key = key;
+		slot.data_ptr = std::move(data_ptr);
+		slot.bytes = bytes;
+		slot.occupied = true;
+		shard.map.emplace(key, slot_i);
+
+		return key;
+	}
+
+	/**
+	 * @brief Fetches the data associated with a key.
+	 *
+	 * @param key The key of the data to fetch.
+	 *
+	 * @return shared_ptr to the data on success, nullptr if the data isn't
+	 *         in the cache.
+	 */
+	std::shared_ptr<T> get(K key) {
+		Shard& shard = shard_for(key);
+		std::unique_lock<SpinLock> lock(shard.slock);
+
+		const auto itr = shard.map.find(key);
+		if (itr == shard.map.end())
+			return nullptr;
+
+		Slot& slot = shard.slots[itr->second];
+		EVICTION::on_hit(shard.eviction, slot.meta);
+
+		return slot.data_ptr;
+	}
+
+	/**
+	 * @brief Erases all items from the cache.
+	 */
+	void clear() {
+		for (auto& shard: shards) {
+			std::unique_lock<SpinLock> lock(shard.slock);
+
+			shard.map.clear();
+			shard.slots.clear();
+			shard.free_slots.clear();
+			shard.byte_count = 0;
+			shard.eviction = typename EVICTION::State();
+		}
+	}
+
+	/**
+	 * @brief Returns the total number of bytes currently in the cache,
+	 * as counted against the byte budget.
+	 */
+	size_t byte_count() {
+		size_t total = 0;
+		for (auto& shard: shards) {
+			std::unique_lock<SpinLock> lock(shard.slock);
+			total += shard.byte_count;
+		}
+		return total;
+	}
+
+private:
+	Shard& shard_for(const K& key) {
+		// Mix the hash, since std::hash is often the identity function
+		uint64_t h = std::hash<K>()(key);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return shards[h & shard_mask];
+	}
+
+	/*
+	 * Evicts items until the shard is within budget or there is nothing
+	 * left to evict.  The item at slot index "keep" is never evicted.
+	 */
+	void evict(Shard& shard, size_t keep) {
+		while (shard.byte_count > shard.max_bytes) {
+			const size_t i = EVICTION::victim(shard.eviction, shard.slots, keep);
+			if (i >= shard.slots.size())
+				break;
+
+			Slot& slot = shard.slots[i];
+			shard.byte_count -= slot.bytes;
+			shard.map.erase(slot.key);
+			slot.data_ptr.reset();
+			slot.occupied = false;
+			shard.free_slots.push_back(i);
+		}
+	}
+};
+
+#endif // CONCURRENT_CACHE_HPP
@@ -0,0 +1,255 @@
+#include "test.hpp"
+
+#include <vector>
+#include <thread>
+#include <memory>
+#include <atomic>
+
+#include "concurrent_cache.hpp"
+#include "lru_cache.hpp"
+#include "timer.hpp"
+
+
+BOOST_AUTO_TEST_SUITE(concurrent_cache);
+
+BOOST_AUTO_TEST_CASE(put_get)
+{
+	ConcurrentCache<int, int> cache(1000000);
+
+	for (int i = 0; i < 100; ++i)
+		cache.put(std::make_shared<int>(i * 2), i);
+
+	bool test = true;
+	for (int i = 0; i < 100; ++i) {
+		auto p = cache.get(i);
+		test = test && p && (*p == i * 2);
+	}
+
+	BOOST_CHECK(test);
+	BOOST_CHECK(cache.get(100) == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(replace)
+{
+	ConcurrentCache<int, int> cache(1000000);
+
+	cache.put(std::make_shared<int>(1), 5);
+	const size_t bytes = cache.byte_count();
+	cache.put(std::make_shared<int>(2), 5);
+
+	BOOST_CHECK(*cache.get(5) == 2);
+	BOOST_CHECK(cache.byte_count() == bytes);
+}
+
+BOOST_AUTO_TEST_CASE(clear)
+{
+	ConcurrentCache<int, int> cache(1000000);
+
+	for (int i = 0; i < 100; ++i)
+		cache.put(std::make_shared<int>(i), i);
+	cache.clear();
+
+	bool test = true;
+	for (int i = 0; i < 100; ++i)
+		test = test && cache.get(i) == nullptr;
+
+	BOOST_CHECK(test);
+	BOOST_CHECK(cache.byte_count() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(byte_budget)
+{
+	const size_t max_bytes = 100 * 1000;
+	ConcurrentCache<int, int> cache(max_bytes, 4);
+
+	for (int i = 0; i < 100000; ++i)
+		cache.put(std::make_shared<int>(i), i);
+
+	BOOST_CHECK(cache.byte_count() <= max_bytes);
+	BOOST_CHECK(cache.byte_count() > max_bytes / 2);
+
+	// Most recently added item should still be there
+	BOOST_CHECK(cache.get(99999) != nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(oversized_item)
+{
+	// Single shard with a budget smaller than any item, so every put
+	// evicts everything else, even items with their reference bit set.
+	ConcurrentCache<int, int> cache(1, 1);
+
+	cache.put(std::make_shared<int>(1), 1);
+	cache.get(1);
+	cache.put(std::make_shared<int>(2), 2);
+
+	BOOST_CHECK(cache.get(1) == nullptr);
+	BOOST_CHECK(cache.get(2) != nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(clock_keeps_referenced)
+{
+	// Find the per-item byte cost
+	ConcurrentCache<int, int> probe(1000000, 1);
+	probe.put(std::make_shared<int>(0), 0);
+	const size_t item_bytes = probe.byte_count();
+
+	// Single shard with room for exactly two items
+	ConcurrentCache<int, int> cache(item_bytes * 2, 1);
+	cache.put(std::make_shared<int>(1), 1);
+	cache.put(std::make_shared<int>(2), 2);
+	cache.get(1);
+	cache.put(std::make_shared<int>(3), 3);
+
+	BOOST_CHECK(cache.get(1) != nullptr);
+	BOOST_CHECK(cache.get(2) == nullptr);
+	BOOST_CHECK(cache.get(3) != nullptr);
+}
+
+// Item with a configurable size and recreation cost
+struct CostlyItem {
+	size_t bytes;
+	float cost;
+};
+
+static size_t size_in_bytes(const CostlyItem& item)
+{
+	return item.bytes;
+}
+
+static float eviction_cost(const CostlyItem& item)
+{
+	return item.cost;
+}
+
+BOOST_AUTO_TEST_CASE(gdsf_keeps_expensive)
+{
+	// Find the per-item byte cost
+	ConcurrentCache<int, CostlyItem, GDSFEviction> probe(1000000, 1);
+	probe.put(std::make_shared<CostlyItem>(CostlyItem {100, 1.0f}), 0);
+	const size_t item_bytes = probe.byte_count();
+
+	// Single shard with room for exactly two items.  The expensive
+	// item is the oldest and has never been hit, but should still
+	// outlive the cheap ones.
+	ConcurrentCache<int, CostlyItem, GDSFEviction> cache(item_bytes * 2, 1);
+	cache.put(std::make_shared<CostlyItem>(CostlyItem {100, 100.0f}), 1);
+	cache.put(std::make_shared<CostlyItem>(CostlyItem {100, 1.0f}), 2);
+	cache.put(std::make_shared<CostlyItem>(CostlyItem {100, 1.0f}), 3);
+
+	BOOST_CHECK(cache.get(1) != nullptr);
+	BOOST_CHECK(cache.get(2) == nullptr);
+	BOOST_CHECK(cache.get(3) != nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(gdsf_prefers_small)
+{
+	ConcurrentCache<int, CostlyItem, GDSFEviction> probe(1000000, 1);
+	probe.put(std::make_shared<CostlyItem>(CostlyItem {0, 1.0f}), 0);
+	const size_t overhead = probe.byte_count();
+
+	// Equal cost, but item 1 is much bigger, so it gives back more
+	// memory per unit of cost when evicted.
+	ConcurrentCache<int, CostlyItem, GDSFEviction> cache((overhead * 3) + 1100, 1);
+	cache.put(std::make_shared<CostlyItem>(CostlyItem {1000, 1.0f}), 1);
+	cache.put(std::make_shared<CostlyItem>(CostlyItem {10, 1.0f}), 2);
+	cache.put(std::make_shared<CostlyItem>(CostlyItem {10, 1.0f}), 3);
+	cache.put(std::make_shared<CostlyItem>(CostlyItem {100, 1.0f}), 4);
+
+	BOOST_CHECK(cache.get(1) == nullptr);
+	BOOST_CHECK(cache.get(2) != nullptr);
+	BOOST_CHECK(cache.get(3) != nullptr);
+	BOOST_CHECK(cache.get(4) != nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(threaded)
+{
+	ConcurrentCache<int, int> cache(1000000);
+	const int thread_count = 8;
+
+	std::vector<std::thread> threads;
+	std::vector<int> fails(thread_count, 0);
+	for (int t = 0; t < thread_count; ++t) {
+		threads.emplace_back([&cache, &fails, t]() {
+			for (int i = 0; i < 1000; ++i) {
+				const int key = t * 1000 + i;
+				cache.put(std::make_shared<int>(key), key);
+				auto p = cache.get(key);
+				if (!p || *p != key)
+					fails[t]++;
+			}
+		});
+	}
+	for (auto& t: threads)
+		t.join();
+
+	int fail_count = 0;
+	for (auto f: fails)
+		fail_count += f;
+
+	BOOST_CHECK(fail_count == 0);
+}
+
+// Reports the time taken by many threads hammering get() on a shared
+// LRUCache vs a shared ConcurrentCache.  The caches are big enough that
+// nothing gets evicted, so every get() must hit, and failed_gets counts
+// the ones that returned a missing or wrong item.
+template <class CACHE>
+static float contention_time(CACHE& cache, int thread_count, int key_count, int gets_per_thread, int* failed_gets)
+{
+	for (int i = 0; i < key_count; ++i)
+		cache.put(std::make_shared<int>(i), i);
+
+	std::atomic<int> fails {0};
+	Timer<> timer;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < thread_count; ++t) {
+		threads.emplace_back([&cache, &fails, t, key_count, gets_per_thread]() {
+			int thread_fails = 0;
+			for (int i = 0; i < gets_per_thread; ++i) {
+				const int key = (i * 7919 + t) % key_count;
+				auto p = cache.get(key);
+				if (!p || *p != key)
+					thread_fails++;
+			}
+			fails += thread_fails;
+		});
+	}
+	for (auto& t: threads)
+		t.join();
+	const float time = timer.time();
+
+	// Everything should still be there afterwards
+	for (int i = 0; i < key_count; ++i) {
+		auto p = cache.get(i);
+		if (!p || *p != i)
+			fails++;
+	}
+
+	*failed_gets = fails;
+	return time;
+}
+
+BOOST_AUTO_TEST_CASE(contention_benchmark)
+{
+	const int key_count = 4096;
+	const int gets_per_thread = 100000;
+	const unsigned hw_threads = std::thread::hardware_concurrency();
+	const int thread_count = hw_threads > 2 ? hw_threads : 2;
+
+	LRUCache<int, int> lru(1000 * 1000 * 1000);
+	ConcurrentCache<int, int> concurrent(1000 * 1000 * 1000);
+
+	int lru_fails = 0;
+	int concurrent_fails = 0;
+	const float lru_time = contention_time(lru, thread_count, key_count, gets_per_thread, &lru_fails);
+	const float concurrent_time = contention_time(concurrent, thread_count, key_count, gets_per_thread, &concurrent_fails);
+
+	BOOST_TEST_MESSAGE("Cache contention, " << thread_count << " threads x " << gets_per_thread << " gets:");
+	BOOST_TEST_MESSAGE("    LRUCache:        " << lru_time << "s");
+	BOOST_TEST_MESSAGE("    ConcurrentCache: " << concurrent_time << "s");
+
+	BOOST_CHECK_EQUAL(lru_fails, 0);
+	BOOST_CHECK_EQUAL(concurrent_fails, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
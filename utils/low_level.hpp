@@ -1,7 +1,7 @@
 #ifndef LOW_LEVEL_HPP
 #define LOW_LEVEL_HPP
 
-#include <mmintrin.h>
+#include <xmmintrin.h>
 
 namespace LowLevel
 {
@@ -13,7 +13,7 @@ inline void prefetch_L1(T* address)
 {
 	constexpr int lines = (sizeof(T)/cache_line_size) + ((sizeof(T)%cache_line_size) == 0 ? 0 : 1);
 	for (int i = 0; i < lines; ++i) {
-		_mm_prefetch(address+i, _MM_HINT_T0);
+		_mm_prefetch(reinterpret_cast<const char*>(address) + (i * cache_line_size), _MM_HINT_T0);
 	}
 }
 
@@ -22,7 +22,7 @@ inline void prefetch_L2(T* address)
 {
 	constexpr int lines = (sizeof(T)/cache_line_size) + ((sizeof(T)%cache_line_size) == 0 ? 0 : 1);
 	for (int i = 0; i < lines; ++i) {
-		_mm_prefetch(address+i, _MM_HINT_T1);
+		_mm_prefetch(reinterpret_cast<const char*>(address) + (i * cache_line_size), _MM_HINT_T1);
 	}
 }
 
@@ -31,7 +31,7 @@ inline void prefetch_L3(T* address)
 {
 	constexpr int lines = (sizeof(T)/cache_line_size) + ((sizeof(T)%cache_line_size) == 0 ? 0 : 1);
 	for (int i = 0; i < lines; ++i) {
-		_mm_prefetch(address+i, _MM_HINT_T2);
+		_mm_prefetch(reinterpret_cast<const char*>(address) + (i * cache_line_size), _MM_HINT_T2);
 	}
 }
 
@@ -0,0 +1,182 @@
+#ifndef MEMORY_ARENA_HPP
+#define MEMORY_ARENA_HPP
+
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+
+/**
+ * @brief A monotonic memory arena.
+ *
+ * Allocation just bumps a pointer within the current block of memory,
+ * and nothing is freed individually.  Instead, reset() frees everything
+ * allocated since the last reset all at once.  The memory blocks
+ * themselves are kept around for reuse, so after an arena has warmed up
+ * it does no heap allocation at all.
+ *
+ * Objects created with make() that have non-trivial destructors are
+ * destroyed (in reverse order of creation) by reset().
+ *
+ * An arena is not thread safe.  The intended use is one arena per
+ * thread for scratch memory.
+ */
+class MemoryArena
+{
+	struct Destructor {
+		void (*destroy)(void*);
+		void *object;
+		Destructor *next;
+	};
+
+	struct Block {
+		std::unique_ptr<char[]> data;
+		size_t size;
+	};
+
+	size_t block_size;
+	std::vector<Block> blocks;
+	size_t block_i {0}; // Current block
+	size_t used {0}; // Bytes used in the current block
+	Destructor *destructors {nullptr}; // Most recently created first
+
+	template <class T>
+	static void destroy(void *object) {
+		static_cast<T*>(object)->~T();
+	}
+
+public:
+	/**
+	 * @brief Constructor.
+	 *
+	 * @param block_size_ Size in bytes of each block of memory the arena
+	 *                    gets from the heap.  Allocations larger than this
+	 *                    get a block of their own.
+	 */
+	MemoryArena(size_t block_size_=1<<16): block_size {block_size_} {}
+
+	MemoryArena(const MemoryArena&) = delete;
+	MemoryArena& operator=(const MemoryArena&) = delete;
+
+	MemoryArena(MemoryArena&& b): block_size {b.block_size}, blocks {std::move(b.blocks)}, block_i {b.block_i}, used {b.used}, destructors {b.destructors} {
+		b.blocks.clear();
+		b.block_i = 0;
+		b.used = 0;
+		b.destructors = nullptr;
+	}
+
+	~MemoryArena() {
+		reset();
+	}
+
+	/**
+	 * @brief Allocates uninitialized memory.
+	 *
+	 * @param size Number of bytes to allocate.
+	 * @param align Required alignment.  Must be a power of two.
+	 */
+	void *alloc(size_t size, size_t align=alignof(std::max_align_t)) {
+		while (block_i < blocks.size()) {
+			Block &block = blocks[block_i];
+			const uintptr_t start = reinterpret_cast<uintptr_t>(block.data.get());
+			const uintptr_t p = (start + used + (align - 1)) & ~(uintptr_t)(align - 1);
+			if ((p + size) <= (start + block.size)) {
+				used = (p + size) - start;
+				return reinterpret_cast<void*>(p);
+			}
+
+			// Doesn't fit, so move on to the next block
+			++block_i;
+			used = 0;
+		}
+
+		// Out of blocks, so get a new one
+		const size_t new_size = std::max(block_size, size + align);
+		blocks.push_back(Block {std::unique_ptr<char[]>(new char[new_size]), new_size});
+		block_i = blocks.size() - 1;
+		used = 0;
+		return alloc(size, align);
+	}
+
+	/**
+	 * @brief Creates an object of type T in the arena.
+	 *
+	 * The object lives until the next reset().
+	 */
+	template <class T, class... ARGS>
+	T *make(ARGS&&... args) {
+		T *object = new(alloc(sizeof(T), alignof(T))) T(std::forward<ARGS>(args)...);
+
+		if (!std::is_trivially_destructible<T>::value) {
+			Destructor *d = new(alloc(sizeof(Destructor), alignof(Destructor))) Destructor;
+			d->destroy = &destroy<T>;
+			d->object = object;
+			d->next = destructors;
+			destructors = d;
+		}
+
+		return object;
+	}
+
+	/**
+	 * @brief A point in the arena's allocations, to rewind() to later.
+	 */
+	struct Mark {
+		size_t block_i;
+		size_t used;
+		Destructor *destructors;
+	};
+
+	/**
+	 * @brief Returns a Mark of everything allocated so far.
+	 */
+	Mark mark() const {
+		return Mark {block_i, used, destructors};
+	}
+
+	/**
+	 * @brief Destroys everything created since the given mark was taken,
+	 * making its memory available for reuse.
+	 *
+	 * The mark must have been taken since the last reset(), and not
+	 * before a mark that has already been rewound to.
+	 */
+	void rewind(const Mark &m) {
+		for (Destructor *d = destructors; d != m.destructors; d = d->next)
+			d->destroy(d->object);
+		destructors = m.destructors;
+		block_i = m.block_i;
+		used = m.used;
+	}
+
+	/**
+	 * @brief Destroys everything in the arena, making its memory available
+	 * for reuse.
+	 */
+	void reset() {
+		for (Destructor *d = destructors; d != nullptr; d = d->next)
+			d->destroy(d->object);
+		destructors = nullptr;
+		block_i = 0;
+		used = 0;
+	}
+
+	/**
+	 * @brief Returns the total number of bytes the arena has gotten from
+	 * the heap.
+	 */
+	size_t capacity() const {
+		size_t total = 0;
+		for (const auto& block: blocks)
+			total += block.size;
+		return total;
+	}
+};
+
+#endif // MEMORY_ARENA_HPP
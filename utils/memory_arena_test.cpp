@@ -0,0 +1,139 @@
+#include "test.hpp"
+
+#include <cstdint>
+
+#include "memory_arena.hpp"
+
+
+BOOST_AUTO_TEST_SUITE(memory_arena);
+
+// Counts how many instances have been destroyed
+struct Counted {
+	int *destroyed;
+	Counted(int *destroyed_): destroyed {destroyed_} {}
+	~Counted() {
+		(*destroyed)++;
+	}
+};
+
+struct alignas(64) Aligned {
+	char data[3];
+};
+
+
+BOOST_AUTO_TEST_CASE(make)
+{
+	MemoryArena arena;
+
+	int *a = arena.make<int>(5);
+	int *b = arena.make<int>(7);
+
+	BOOST_CHECK(*a == 5);
+	BOOST_CHECK(*b == 7);
+	BOOST_CHECK(a != b);
+}
+
+BOOST_AUTO_TEST_CASE(alignment)
+{
+	MemoryArena arena;
+
+	arena.make<char>('a');
+	Aligned *a = arena.make<Aligned>();
+	arena.make<char>('b');
+	Aligned *b = arena.make<Aligned>();
+
+	BOOST_CHECK((reinterpret_cast<uintptr_t>(a) % 64) == 0);
+	BOOST_CHECK((reinterpret_cast<uintptr_t>(b) % 64) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(large_alloc)
+{
+	// Allocations bigger than the block size still work
+	MemoryArena arena(64);
+
+	char *p = static_cast<char*>(arena.alloc(1000));
+	for (int i = 0; i < 1000; ++i)
+		p[i] = i;
+
+	BOOST_CHECK(arena.capacity() >= 1000);
+}
+
+BOOST_AUTO_TEST_CASE(reset_destroys)
+{
+	int destroyed = 0;
+	MemoryArena arena;
+
+	for (int i = 0; i < 10; ++i)
+		arena.make<Counted>(&destroyed);
+	BOOST_CHECK(destroyed == 0);
+
+	arena.reset();
+	BOOST_CHECK(destroyed == 10);
+
+	// Destroying the arena doesn't destroy things twice
+	arena.make<Counted>(&destroyed);
+	{
+		MemoryArena moved(std::move(arena));
+	}
+	arena.reset();
+	BOOST_CHECK(destroyed == 11);
+}
+
+BOOST_AUTO_TEST_CASE(reset_reuses_memory)
+{
+	MemoryArena arena(256);
+
+	for (int i = 0; i < 100; ++i)
+		arena.make<double>(i);
+	const size_t capacity = arena.capacity();
+
+	// Doing the same allocations again shouldn't need more memory
+	for (int round = 0; round < 10; ++round) {
+		arena.reset();
+		for (int i = 0; i < 100; ++i)
+			arena.make<double>(i);
+	}
+
+	BOOST_CHECK(arena.capacity() == capacity);
+}
+
+BOOST_AUTO_TEST_CASE(rewind_destroys_since_mark)
+{
+	int destroyed = 0;
+	MemoryArena arena(256);
+
+	for (int i = 0; i < 5; ++i)
+		arena.make<Counted>(&destroyed);
+	const MemoryArena::Mark mark = arena.mark();
+	for (int i = 0; i < 100; ++i)
+		arena.make<Counted>(&destroyed);
+
+	arena.rewind(mark);
+	BOOST_CHECK(destroyed == 100);
+
+	// Only the objects from before the mark are left
+	arena.reset();
+	BOOST_CHECK(destroyed == 105);
+}
+
+BOOST_AUTO_TEST_CASE(rewind_reuses_memory)
+{
+	MemoryArena arena(256);
+
+	arena.make<double>(1.0);
+	const MemoryArena::Mark mark = arena.mark();
+	for (int i = 0; i < 100; ++i)
+		arena.make<double>(i);
+	const size_t capacity = arena.capacity();
+
+	// Repeatedly rewinding and allocating shouldn't need more memory
+	for (int round = 0; round < 10; ++round) {
+		arena.rewind(mark);
+		for (int i = 0; i < 100; ++i)
+			arena.make<double>(i);
+	}
+
+	BOOST_CHECK(arena.capacity() == capacity);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
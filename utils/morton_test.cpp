@@ -0,0 +1,39 @@
+#include "test.hpp"
+
+#include "numtype.h"
+#include "morton.hpp"
+
+/*
+ * Test suite for the morton code transforms.
+ */
+BOOST_AUTO_TEST_SUITE(morton);
+
+// Test that the bits of the coordinates are interleaved in the right order
+BOOST_AUTO_TEST_CASE(xyz2d_1)
+{
+	BOOST_CHECK_EQUAL(Morton::xyz2d(0, 0, 0), 0u);
+	BOOST_CHECK_EQUAL(Morton::xyz2d(1, 0, 0), 1u);
+	BOOST_CHECK_EQUAL(Morton::xyz2d(0, 1, 0), 2u);
+	BOOST_CHECK_EQUAL(Morton::xyz2d(0, 0, 1), 4u);
+	BOOST_CHECK_EQUAL(Morton::xyz2d(2, 0, 0), 8u);
+	BOOST_CHECK_EQUAL(Morton::xyz2d(1023, 1023, 1023), 0x3fffffffu);
+}
+
+// Test that decoding gives back the encoded coordinates
+BOOST_AUTO_TEST_CASE(d2xyz_1)
+{
+	bool equals = true;
+
+	for (uint32_t i = 0; i < 1024; i += 3) {
+		const uint32_t x = i;
+		const uint32_t y = (i * 7) & 1023;
+		const uint32_t z = 1023 - i;
+		uint32_t x2, y2, z2;
+		Morton::d2xyz(Morton::xyz2d(x, y, z), &x2, &y2, &z2);
+		equals = equals && (x == x2) && (y == y2) && (z == z2);
+	}
+
+	BOOST_CHECK(equals);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,172 @@
+#ifndef RADIX_SORT_HPP
+#define RADIX_SORT_HPP
+
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <functional>
+#include "numtype.h"
+#include "worker_pool.hpp"
+
+namespace RadixSort
+{
+
+static constexpr uint32_t DIGIT_BITS = 8;
+static constexpr size_t BUCKET_COUNT = 1 << DIGIT_BITS;
+static constexpr uint32_t DIGIT_MASK = BUCKET_COUNT - 1;
+
+// Below this many items parallel_sort() just does a serial sort
+static constexpr size_t PARALLEL_THRESHOLD = 1 << 16;
+
+
+/**
+ * @brief LSD radix sort.
+ *
+ * Sorts items by an unsigned 32-bit integer key, in linear time.  The
+ * sort is stable.  Only as many 8-bit digit passes are made as needed
+ * to cover max_key, and passes where every item has the same digit are
+ * skipped.
+ *
+ * @param list Pointer to the beginning of the array.
+ * @param scratch Scratch space of at least list_length items.
+ * @param list_length Length of the array.
+ * @param max_key The largest key of any item in the array.
+ * @param key Functor that returns the uint32_t key of an item.
+ */
+template <class T, class KEY>
+void sort(T *list, T *scratch, size_t list_length, uint32_t max_key, KEY key)
+{
+	if (list_length < 2)
+		return;
+
+	T *from = list;
+	T *to = scratch;
+	for (uint32_t shift = 0; shift < 32 && (max_key >> shift) > 0; shift += DIGIT_BITS) {
+		// Count the items in each bucket
+		size_t counts[BUCKET_COUNT] = {};
+		for (size_t i = 0; i < list_length; i++)
+			counts[(key(from[i]) >> shift) & DIGIT_MASK]++;
+
+		// Everything is in one bucket, nothing to do
+		if (counts[(key(from[0]) >> shift) & DIGIT_MASK] == list_length)
+			continue;
+
+		// Turn counts into start indices
+		size_t running_count = 0;
+		for (size_t b = 0; b < BUCKET_COUNT; b++) {
+			const size_t count = counts[b];
+			counts[b] = running_count;
+			running_count += count;
+		}
+
+		// Scatter
+		for (size_t i = 0; i < list_length; i++)
+			to[counts[(key(from[i]) >> shift) & DIGIT_MASK]++] = from[i];
+
+		std::swap(from, to);
+	}
+
+	if (from != list)
+		std::copy(from, from + list_length, list);
+}
+
+
+/**
+ * @brief Multi-threaded version of sort(), run on the given workers.
+ *
+ * The array is split into one contiguous chunk per worker.  Each digit
+ * pass has each worker count the items of its own chunk and then
+ * scatter them to their destinations, so the result is identical to
+ * sort() regardless of worker count.
+ *
+ * Parameters are the same as sort(), plus the pool of workers to use.
+ */
+template <class T, class KEY>
+void parallel_sort(T *list, T *scratch, size_t list_length, uint32_t max_key, KEY key, WorkerPool &workers)
+{
+	const size_t thread_count = workers.size();
+	if (thread_count <= 1 || list_length < PARALLEL_THRESHOLD) {
+		sort(list, scratch, list_length, max_key, key);
+		return;
+	}
+
+	const size_t chunk_size = (list_length + thread_count - 1) / thread_count;
+	std::vector<std::array<size_t, BUCKET_COUNT>> counts(thread_count);
+
+	// Runs the given function on every chunk, one worker per chunk
+	auto run_chunks = [&](const std::function<void(size_t, size_t, size_t)>& f) {
+		workers.run([&f, chunk_size, list_length](size_t t) {
+			f(t, std::min(list_length, t * chunk_size), std::min(list_length, (t + 1) * chunk_size));
+		});
+	};
+
+	T *from = list;
+	T *to = scratch;
+	for (uint32_t shift = 0; shift < 32 && (max_key >> shift) > 0; shift += DIGIT_BITS) {
+		// Count the items in each bucket, per chunk
+		run_chunks([&](size_t t, size_t start, size_t end) {
+			auto& c = counts[t];
+			std::fill(c.begin(), c.end(), 0);
+			for (size_t i = start; i < end; i++)
+				c[(key(from[i]) >> shift) & DIGIT_MASK]++;
+		});
+
+		// Everything is in one bucket, nothing to do
+		const size_t first_bucket = (key(from[0]) >> shift) & DIGIT_MASK;
+		size_t first_bucket_count = 0;
+		for (size_t t = 0; t < thread_count; t++)
+			first_bucket_count += counts[t][first_bucket];
+		if (first_bucket_count == list_length)
+			continue;
+
+		// Turn counts into start indices.  Within each bucket, earlier
+		// chunks come first, which keeps the sort stable.
+		size_t running_count = 0;
+		for (size_t b = 0; b < BUCKET_COUNT; b++) {
+			for (size_t t = 0; t < thread_count; t++) {
+				const size_t count = counts[t][b];
+				counts[t][b] = running_count;
+				running_count += count;
+			}
+		}
+
+		// Scatter
+		run_chunks([&](size_t t, size_t start, size_t end) {
+			auto& c = counts[t];
+			for (size_t i = start; i < end; i++)
+				to[c[(key(from[i]) >> shift) & DIGIT_MASK]++] = from[i];
+		});
+
+		std::swap(from, to);
+	}
+
+	if (from != list) {
+		run_chunks([&](size_t t, size_t start, size_t end) {
+			std::copy(from + start, from + end, list + start);
+		});
+	}
+}
+
+
+/**
+ * @brief Multi-threaded version of sort(), on thread_count threads that
+ * are created for just this sort.
+ *
+ * Parameters are the same as sort(), plus the number of threads to use.
+ */
+template <class T, class KEY>
+void parallel_sort(T *list, T *scratch, size_t list_length, uint32_t max_key, KEY key, size_t thread_count)
+{
+	if (thread_count <= 1 || list_length < PARALLEL_THRESHOLD) {
+		sort(list, scratch, list_length, max_key, key);
+		return;
+	}
+
+	WorkerPool workers(thread_count);
+	parallel_sort(list, scratch, list_length, max_key, key, workers);
+}
+
+}
+#endif // RADIX_SORT_HPP
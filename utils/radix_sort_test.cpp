@@ -0,0 +1,93 @@
+#include "test.hpp"
+
+#include <vector>
+#include <algorithm>
+
+#include "radix_sort.hpp"
+#include "rng.hpp"
+
+
+BOOST_AUTO_TEST_SUITE(radix_sort);
+
+struct Item {
+	uint32_t key;
+	uint32_t index; // Original position, for checking stability
+};
+
+static std::vector<Item> random_items(size_t count, uint32_t max_key)
+{
+	RNG rng(42);
+	std::vector<Item> items(count);
+	for (size_t i = 0; i < count; ++i) {
+		items[i].key = max_key == 0xffffffff ? rng.next_uint() : rng.next_uint() % (max_key + 1);
+		items[i].index = i;
+	}
+	return items;
+}
+
+static bool is_stably_sorted(const std::vector<Item>& items)
+{
+	for (size_t i = 1; i < items.size(); ++i) {
+		if (items[i-1].key > items[i].key)
+			return false;
+		if (items[i-1].key == items[i].key && items[i-1].index > items[i].index)
+			return false;
+	}
+	return true;
+}
+
+static uint32_t item_key(const Item& item)
+{
+	return item.key;
+}
+
+
+BOOST_AUTO_TEST_CASE(sort_small_keys)
+{
+	auto items = random_items(1000, 10);
+	std::vector<Item> scratch(items.size());
+
+	RadixSort::sort(items.data(), scratch.data(), items.size(), 10, item_key);
+
+	BOOST_CHECK(is_stably_sorted(items));
+}
+
+BOOST_AUTO_TEST_CASE(sort_large_keys)
+{
+	auto items = random_items(1000, 0xffffffff);
+	std::vector<Item> scratch(items.size());
+
+	RadixSort::sort(items.data(), scratch.data(), items.size(), 0xffffffff, item_key);
+
+	BOOST_CHECK(is_stably_sorted(items));
+}
+
+BOOST_AUTO_TEST_CASE(sort_all_same)
+{
+	auto items = random_items(100, 0);
+
+	std::vector<Item> scratch(items.size());
+	RadixSort::sort(items.data(), scratch.data(), items.size(), 1000, item_key);
+
+	BOOST_CHECK(is_stably_sorted(items));
+}
+
+BOOST_AUTO_TEST_CASE(parallel_sort_matches_sort)
+{
+	const size_t count = RadixSort::PARALLEL_THRESHOLD * 3 + 7;
+	auto items1 = random_items(count, 100000);
+	auto items2 = items1;
+	std::vector<Item> scratch(count);
+
+	RadixSort::sort(items1.data(), scratch.data(), count, 100000, item_key);
+	RadixSort::parallel_sort(items2.data(), scratch.data(), count, 100000, item_key, 5);
+
+	bool same = true;
+	for (size_t i = 0; i < count; ++i)
+		same = same && items1[i].index == items2[i].index;
+
+	BOOST_CHECK(is_stably_sorted(items2));
+	BOOST_CHECK(same);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
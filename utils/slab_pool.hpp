@@ -0,0 +1,245 @@
+#ifndef SLAB_POOL_HPP
+#define SLAB_POOL_HPP
+
+#include "numtype.h"
+
+#include <new>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include "spinlock.hpp"
+
+
+/**
+ * @brief A thread-safe pool of fixed-size memory blocks, divided into
+ * size classes.
+ *
+ * Each size class is identified by a subdivision level and a number of
+ * time samples, and all blocks of a class have the same size, given by
+ * a function supplied by the owner of the pool.  Blocks that are
+ * released go onto their class's free list, and are handed out again by
+ * the next allocation of the same class instead of going back to the
+ * heap.  This avoids both the cost of the heap allocator and the
+ * fragmentation caused by lots of large, short-lived allocations of a
+ * handful of different sizes.
+ *
+ * The total size of the idle blocks is capped, and blocks released
+ * beyond that cap are freed to the heap.
+ *
+ * Blocks are aligned for any fundamental type, and are uninitialized.
+ */
+class SlabPool
+{
+public:
+	/**
+	 * @brief Usage statistics of a size class.
+	 */
+	struct ClassStats {
+		uint32_t level = 0;
+		uint32_t time_count = 0;
+		size_t block_bytes = 0; // Size of each block
+		size_t allocs = 0; // Total blocks handed out
+		size_t reuses = 0; // Blocks handed out from the free list rather than the heap
+		size_t releases = 0; // Total blocks released
+		size_t discards = 0; // Released blocks freed to the heap because of the cap
+		size_t live = 0; // Blocks currently in use
+		size_t peak_live = 0; // Most blocks in use at once
+		size_t idle = 0; // Blocks currently on the free list
+	};
+
+	typedef size_t (*BlockSizeFunc)(uint32_t level, uint32_t time_count);
+
+private:
+	struct SizeClass {
+		ClassStats stats;
+		std::vector<void*> free_blocks;
+	};
+
+	const BlockSizeFunc block_size_func;
+	size_t max_idle_bytes;
+	size_t idle_bytes {0};
+	std::unordered_map<uint64_t, SizeClass> classes;
+	mutable SpinLock lock;
+
+	static uint64_t class_key(uint32_t level, uint32_t time_count) {
+		return (static_cast<uint64_t>(level) << 32) | time_count;
+	}
+
+	SizeClass &get_class(uint32_t level, uint32_t time_count) {
+		SizeClass &c = classes[class_key(level, time_count)];
+		if (c.stats.block_bytes == 0) {
+			c.stats.level = level;
+			c.stats.time_count = time_count;
+			c.stats.block_bytes = block_size_func(level, time_count);
+		}
+		return c;
+	}
+
+public:
+	/**
+	 * @brief Constructor.
+	 *
+	 * @param block_size_func_ Function giving the size in bytes of the
+	 *                         blocks of each size class.
+	 * @param max_idle_bytes_ The most memory to keep on the free lists.
+	 */
+	SlabPool(BlockSizeFunc block_size_func_, size_t max_idle_bytes_): block_size_func {block_size_func_}, max_idle_bytes {max_idle_bytes_} {}
+
+	SlabPool(const SlabPool&) = delete;
+	SlabPool& operator=(const SlabPool&) = delete;
+
+	~SlabPool() {
+		trim();
+	}
+
+	/**
+	 * @brief Returns the size in bytes of the blocks of a size class.
+	 */
+	size_t block_bytes(uint32_t level, uint32_t time_count) const {
+		return block_size_func(level, time_count);
+	}
+
+	/**
+	 * @brief Allocates a block of the given size class.
+	 */
+	void *alloc(uint32_t level, uint32_t time_count) {
+		size_t bytes;
+		{
+			std::lock_guard<SpinLock> guard(lock);
+			SizeClass &c = get_class(level, time_count);
+			c.stats.allocs++;
+			c.stats.live++;
+			c.stats.peak_live = std::max(c.stats.peak_live, c.stats.live);
+			if (!c.free_blocks.empty()) {
+				void *block = c.free_blocks.back();
+				c.free_blocks.pop_back();
+				c.stats.reuses++;
+				c.stats.idle--;
+				idle_bytes -= c.stats.block_bytes;
+				return block;
+			}
+			bytes = c.stats.block_bytes;
+		}
+
+		// Free list was empty, so get a new block from the heap
+		return ::operator new(bytes);
+	}
+
+	/**
+	 * @brief Releases a block back to the pool.
+	 *
+	 * The block must have been allocated from the same size class of
+	 * this pool.
+	 */
+	void release(void *block, uint32_t level, uint32_t time_count) {
+		if (block == nullptr)
+			return;
+
+		{
+			std::lock_guard<SpinLock> guard(lock);
+			SizeClass &c = get_class(level, time_count);
+			c.stats.releases++;
+			c.stats.live--;
+			if ((idle_bytes + c.stats.block_bytes) <= max_idle_bytes) {
+				c.free_blocks.push_back(block);
+				c.stats.idle++;
+				idle_bytes += c.stats.block_bytes;
+				return;
+			}
+			c.stats.discards++;
+		}
+
+		// Over the cap, so give it back to the heap
+		::operator delete(block);
+	}
+
+	/**
+	 * @brief Sets the most memory to keep on the free lists.  Idle blocks
+	 * beyond the new cap are freed.
+	 */
+	void set_max_idle_bytes(size_t bytes) {
+		std::vector<void*> to_free;
+		{
+			std::lock_guard<SpinLock> guard(lock);
+			max_idle_bytes = bytes;
+			for (auto &kv: classes) {
+				SizeClass &c = kv.second;
+				while (idle_bytes > max_idle_bytes && !c.free_blocks.empty()) {
+					to_free.push_back(c.free_blocks.back());
+					c.free_blocks.pop_back();
+					c.stats.idle--;
+					idle_bytes -= c.stats.block_bytes;
+				}
+			}
+		}
+
+		for (void *block: to_free)
+			::operator delete(block);
+	}
+
+	/**
+	 * @brief Frees all idle blocks to the heap.
+	 */
+	void trim() {
+		std::vector<void*> to_free;
+		{
+			std::lock_guard<SpinLock> guard(lock);
+			for (auto &kv: classes) {
+				SizeClass &c = kv.second;
+				to_free.insert(to_free.end(), c.free_blocks.begin(), c.free_blocks.end());
+				c.free_blocks.clear();
+				c.stats.idle = 0;
+			}
+			idle_bytes = 0;
+		}
+
+		for (void *block: to_free)
+			::operator delete(block);
+	}
+
+	/**
+	 * @brief Returns the total size of the idle blocks.
+	 */
+	size_t idle_size() const {
+		std::lock_guard<SpinLock> guard(lock);
+		return idle_bytes;
+	}
+
+	/**
+	 * @brief Returns the statistics of every size class that has been
+	 * used, ordered by level and then by time sample count.
+	 */
+	std::vector<ClassStats> stats() const {
+		std::vector<ClassStats> s;
+		{
+			std::lock_guard<SpinLock> guard(lock);
+			for (const auto &kv: classes)
+				s.push_back(kv.second.stats);
+		}
+
+		std::sort(s.begin(), s.end(), [](const ClassStats &a, const ClassStats &b) {
+			return class_key(a.level, a.time_count) < class_key(b.level, b.time_count);
+		});
+		return s;
+	}
+
+	/**
+	 * @brief Resets the counters of every size class.  The live and idle
+	 * block counts are left as they are.
+	 */
+	void clear_stats() {
+		std::lock_guard<SpinLock> guard(lock);
+		for (auto &kv: classes) {
+			ClassStats &s = kv.second.stats;
+			s.allocs = 0;
+			s.reuses = 0;
+			s.releases = 0;
+			s.discards = 0;
+			s.peak_live = s.live;
+		}
+	}
+};
+
+#endif // SLAB_POOL_HPP
@@ -0,0 +1,112 @@
+#include "test.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#include "slab_pool.hpp"
+
+
+BOOST_AUTO_TEST_SUITE(slab_pool);
+
+static size_t test_block_size(uint32_t level, uint32_t time_count)
+{
+	return (size_t(1) << level) * time_count * 16;
+}
+
+
+BOOST_AUTO_TEST_CASE(alloc_1)
+{
+	SlabPool pool(test_block_size, 1 << 20);
+
+	char *a = static_cast<char*>(pool.alloc(4, 1));
+	char *b = static_cast<char*>(pool.alloc(4, 1));
+	BOOST_CHECK(a != b);
+
+	// The whole block should be usable
+	std::memset(a, 1, pool.block_bytes(4, 1));
+	std::memset(b, 2, pool.block_bytes(4, 1));
+	BOOST_CHECK(a[255] == 1);
+	BOOST_CHECK(b[0] == 2);
+
+	pool.release(a, 4, 1);
+	pool.release(b, 4, 1);
+}
+
+// Released blocks should be reused by the same size class only
+BOOST_AUTO_TEST_CASE(reuse_1)
+{
+	SlabPool pool(test_block_size, 1 << 20);
+
+	void *a = pool.alloc(3, 2);
+	pool.release(a, 3, 2);
+
+	void *b = pool.alloc(3, 1);
+	void *c = pool.alloc(3, 2);
+	BOOST_CHECK(b != a);
+	BOOST_CHECK(c == a);
+
+	pool.release(b, 3, 1);
+	pool.release(c, 3, 2);
+}
+
+// Blocks released beyond the idle cap should be freed
+BOOST_AUTO_TEST_CASE(max_idle_1)
+{
+	SlabPool pool(test_block_size, 3 * 128);
+
+	void *blocks[5];
+	for (int i = 0; i < 5; ++i)
+		blocks[i] = pool.alloc(3, 1);
+	for (int i = 0; i < 5; ++i)
+		pool.release(blocks[i], 3, 1);
+
+	const auto s = pool.stats();
+	BOOST_CHECK_EQUAL(s.size(), 1);
+	BOOST_CHECK_EQUAL(s[0].idle, 3);
+	BOOST_CHECK_EQUAL(s[0].discards, 2);
+	BOOST_CHECK_EQUAL(pool.idle_size(), 3 * 128);
+
+	pool.set_max_idle_bytes(128);
+	BOOST_CHECK_EQUAL(pool.idle_size(), 128);
+
+	pool.trim();
+	BOOST_CHECK_EQUAL(pool.idle_size(), 0);
+	BOOST_CHECK_EQUAL(pool.stats()[0].idle, 0);
+}
+
+BOOST_AUTO_TEST_CASE(stats_1)
+{
+	SlabPool pool(test_block_size, 1 << 20);
+
+	void *a = pool.alloc(5, 1);
+	void *b = pool.alloc(2, 3);
+	void *c = pool.alloc(2, 1);
+	pool.release(a, 5, 1);
+	a = pool.alloc(5, 1);
+
+	const auto s = pool.stats();
+	BOOST_CHECK_EQUAL(s.size(), 3);
+
+	// Ordered by level, then time samples
+	BOOST_CHECK_EQUAL(s[0].level, 2);
+	BOOST_CHECK_EQUAL(s[0].time_count, 1);
+	BOOST_CHECK_EQUAL(s[1].level, 2);
+	BOOST_CHECK_EQUAL(s[1].time_count, 3);
+	BOOST_CHECK_EQUAL(s[2].level, 5);
+	BOOST_CHECK_EQUAL(s[2].block_bytes, 32 * 16);
+	BOOST_CHECK_EQUAL(s[2].allocs, 2);
+	BOOST_CHECK_EQUAL(s[2].reuses, 1);
+	BOOST_CHECK_EQUAL(s[2].releases, 1);
+	BOOST_CHECK_EQUAL(s[2].live, 1);
+	BOOST_CHECK_EQUAL(s[2].peak_live, 1);
+
+	pool.clear_stats();
+	BOOST_CHECK_EQUAL(pool.stats()[2].allocs, 0);
+	BOOST_CHECK_EQUAL(pool.stats()[2].live, 1);
+
+	pool.release(a, 5, 1);
+	pool.release(b, 2, 3);
+	pool.release(c, 2, 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
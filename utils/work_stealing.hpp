@@ -0,0 +1,84 @@
+#ifndef WORK_STEALING_HPP
+#define WORK_STEALING_HPP
+
+#include <cstdlib>
+#include <vector>
+#include <mutex>
+
+#include "spinlock.hpp"
+
+
+/**
+ * @brief Hands out the indices [0, item_count) to a fixed number of
+ * workers, with work stealing.
+ *
+ * The index range is split evenly into one contiguous sub-range per
+ * worker.  Each worker takes indices from the front of its own sub-range,
+ * and once that is exhausted it steals indices from the back of the other
+ * workers' sub-ranges.  This keeps workers mostly within their own
+ * contiguous (and therefore cache-friendly) block of work while still
+ * balancing well when item costs are very uneven.
+ *
+ * Every index is handed out exactly once.
+ */
+class WorkStealingRange
+{
+	struct alignas(64) Span {
+		SpinLock lock;
+		size_t front;
+		size_t back; // One past the last item
+	};
+
+	std::vector<Span> spans;
+
+public:
+	/**
+	 * @brief Constructor.
+	 *
+	 * @param item_count Total number of work items.
+	 * @param worker_count Number of workers that will pull from the range.
+	 */
+	WorkStealingRange(size_t item_count, size_t worker_count): spans(worker_count > 0 ? worker_count : 1) {
+		const size_t count = spans.size();
+		for (size_t i = 0; i < count; ++i) {
+			spans[i].front = (item_count * i) / count;
+			spans[i].back = (item_count * (i + 1)) / count;
+		}
+	}
+
+	/**
+	 * @brief Fetches the next work item for the given worker.
+	 *
+	 * @param worker Index of the calling worker, in [0, worker_count).
+	 * @param [out] item The fetched work item index.
+	 *
+	 * @returns True if an item was fetched, false if all work has been
+	 *          handed out.
+	 */
+	bool next(size_t worker, size_t *item) {
+		// Own span first, from the front
+		{
+			Span &span = spans[worker];
+			std::lock_guard<SpinLock> lock(span.lock);
+			if (span.front < span.back) {
+				*item = span.front++;
+				return true;
+			}
+		}
+
+		// Steal from the back of the other spans
+		const size_t count = spans.size();
+		for (size_t i = 1; i < count; ++i) {
+			Span &span = spans[(worker + i) % count];
+			std::lock_guard<SpinLock> lock(span.lock);
+			if (span.front < span.back) {
+				*item = --span.back;
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
+
+#endif // WORK_STEALING_HPP
@@ -0,0 +1,79 @@
+#include "test.hpp"
+
+#include <vector>
+#include <atomic>
+#include <thread>
+
+#include "work_stealing.hpp"
+
+
+BOOST_AUTO_TEST_SUITE(work_stealing);
+
+BOOST_AUTO_TEST_CASE(single_worker)
+{
+	WorkStealingRange range(10, 1);
+
+	size_t item;
+	bool test = true;
+	for (size_t i = 0; i < 10; ++i)
+		test = test && range.next(0, &item) && item == i;
+
+	BOOST_CHECK(test);
+	BOOST_CHECK(!range.next(0, &item));
+}
+
+BOOST_AUTO_TEST_CASE(empty_range)
+{
+	WorkStealingRange range(0, 4);
+
+	size_t item;
+	BOOST_CHECK(!range.next(0, &item));
+	BOOST_CHECK(!range.next(3, &item));
+}
+
+BOOST_AUTO_TEST_CASE(steal_from_others)
+{
+	// Worker 0 should end up handling the whole range by itself
+	WorkStealingRange range(100, 4);
+
+	std::vector<int> counts(100, 0);
+	size_t item;
+	while (range.next(0, &item))
+		counts[item]++;
+
+	bool test = true;
+	for (auto c: counts)
+		test = test && c == 1;
+
+	BOOST_CHECK(test);
+}
+
+BOOST_AUTO_TEST_CASE(threaded)
+{
+	const size_t item_count = 100000;
+	const size_t thread_count = 8;
+	WorkStealingRange range(item_count, thread_count);
+
+	std::vector<std::atomic<int>> counts(item_count);
+	for (auto& c: counts)
+		c = 0;
+
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < thread_count; ++t) {
+		threads.emplace_back([&range, &counts, t]() {
+			size_t item;
+			while (range.next(t, &item))
+				counts[item]++;
+		});
+	}
+	for (auto& t: threads)
+		t.join();
+
+	bool test = true;
+	for (auto& c: counts)
+		test = test && c == 1;
+
+	BOOST_CHECK(test);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,133 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+
+/**
+ * @brief A fixed set of worker threads that run one function at a time
+ * on all workers at once.
+ *
+ * The threads are created once, in the constructor, and sleep between
+ * calls to run().  This avoids paying thread start-up costs for every
+ * parallel phase when there are many short phases in a row.
+ *
+ * run() is not reentrant: it must not be called from within a function
+ * that's being run by the same pool, nor from more than one thread at a
+ * time.
+ */
+class WorkerPool
+{
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable start_cv;
+	std::condition_variable done_cv;
+	const std::function<void(size_t)> *job {nullptr};
+	uint64_t generation {0}; // Incremented for each call to run()
+	size_t running {0}; // Number of threads still running the current job
+	bool quit {false};
+
+	void run_worker(size_t worker) {
+		uint64_t seen = 0;
+		while (true) {
+			const std::function<void(size_t)> *f;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start_cv.wait(lock, [&]() {
+					return quit || generation != seen;
+				});
+				if (quit)
+					return;
+				seen = generation;
+				f = job;
+			}
+
+			(*f)(worker);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--running == 0)
+				done_cv.notify_one();
+		}
+	}
+
+public:
+	/**
+	 * @brief Constructor.
+	 *
+	 * @param worker_count Number of workers, including the thread that
+	 *                     calls run().  So worker_count - 1 threads are
+	 *                     created.  Zero is treated as one.
+	 */
+	explicit WorkerPool(size_t worker_count) {
+		for (size_t i = 1; i < worker_count; ++i)
+			threads.emplace_back(&WorkerPool::run_worker, this, i);
+	}
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		start_cv.notify_all();
+		for (auto &thread: threads)
+			thread.join();
+	}
+
+	/**
+	 * @brief Returns the number of workers, including the calling thread.
+	 */
+	size_t size() const {
+		return threads.size() + 1;
+	}
+
+	/**
+	 * @brief Runs the given function on every worker, passing each its
+	 * worker index in [0, size()), and waits for all of them to finish.
+	 *
+	 * The calling thread runs it as worker 0.  If it throws there, the
+	 * exception is rethrown once the other workers have finished.
+	 */
+	void run(const std::function<void(size_t)> &f) {
+		if (threads.empty()) {
+			f(0);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &f;
+			running = threads.size();
+			++generation;
+		}
+		start_cv.notify_all();
+
+		std::exception_ptr error;
+		try {
+			f(0);
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done_cv.wait(lock, [this]() {
+			return running == 0;
+		});
+		job = nullptr;
+		lock.unlock();
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+#endif // WORKER_POOL_HPP
@@ -0,0 +1,68 @@
+#include "test.hpp"
+
+#include <vector>
+#include <atomic>
+#include <stdexcept>
+
+#include "worker_pool.hpp"
+
+
+BOOST_AUTO_TEST_SUITE(worker_pool);
+
+// Test that every worker runs each job exactly once, with its own index,
+// across many jobs on the same threads
+BOOST_AUTO_TEST_CASE(run_1)
+{
+	WorkerPool workers(5);
+	BOOST_CHECK_EQUAL(workers.size(), 5u);
+
+	std::vector<int> runs(5, 0);
+	std::atomic<int> total {0};
+	for (int i = 0; i < 1000; ++i) {
+		workers.run([&](size_t worker) {
+			++runs[worker];
+			++total;
+		});
+	}
+
+	bool all = true;
+	for (auto r: runs)
+		all = all && r == 1000;
+	BOOST_CHECK(all);
+	BOOST_CHECK_EQUAL(total.load(), 5000);
+}
+
+// Test that a pool with a single worker just runs jobs on the caller
+BOOST_AUTO_TEST_CASE(run_2)
+{
+	WorkerPool workers(1);
+	BOOST_CHECK_EQUAL(workers.size(), 1u);
+
+	int runs = 0;
+	workers.run([&](size_t worker) {
+		runs += worker == 0;
+	});
+	BOOST_CHECK_EQUAL(runs, 1);
+}
+
+// Test that an exception on the calling worker is rethrown after the
+// other workers finish, and that the pool is still usable afterwards
+BOOST_AUTO_TEST_CASE(run_3)
+{
+	WorkerPool workers(4);
+	std::atomic<int> finished {0};
+	BOOST_CHECK_THROW(workers.run([&](size_t worker) {
+		if (worker == 0)
+			throw std::runtime_error("test");
+		++finished;
+	}), std::runtime_error);
+	BOOST_CHECK_EQUAL(finished.load(), 3);
+
+	std::atomic<int> total {0};
+	workers.run([&](size_t) {
+		++total;
+	});
+	BOOST_CHECK_EQUAL(total.load(), 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END();